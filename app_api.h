@@ -8,6 +8,12 @@ struct app_state_t {
     bool is_initialized;
 
     bool end_execution;
+
+    // Set by update_and_render() when nothing changed and nothing was drawn.
+    // The platform layer can then block until the next event arrives instead
+    // of calling update_and_render() every frame.
+    bool idle;
+
     struct gui_state_t gui_st;
 
     mem_pool_t memory;
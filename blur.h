@@ -0,0 +1,753 @@
+/*
+ * Copyright (C) 2018 Santiago León O. <santileortiz@gmail.com>
+ */
+
+#if !defined(BLUR_H)
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLUR_X86
+#endif
+
+// Gaussian blur of ARGB32 images, used for CSS box shadows. It only depends on
+// common.h so it can be benchmarked without cairo (see blur_bench.c).
+//
+// The blur is separable, it's computed as a horizontal pass followed by a
+// vertical one. Instead of walking columns for the vertical pass, rows are
+// blurred in blocks of BLUR_BLOCK_ROWS and written transposed into a temporary
+// image, then the same row pass runs again over the transposed image and
+// transposes back. This way all convolutions read memory sequentially.
+//
+// Each row is copied into a zero padded line buffer first, so convolution
+// loops have no bounds checks. Pixels outside the image count as transparent
+// black, which is what we want for shadows.
+//
+// The row convolution has scalar, SSE2 and AVX2 implementations, the best one
+// supported by the CPU is selected at runtime. All of them produce the same
+// result bit by bit, which is also the result of the original convolution that
+// divided each sum by the kernel's area with integer division.
+//
+// There is also a faster approximation, three successive box blurs computed
+// with running sums. Its cost per pixel doesn't depend on the radius. See
+// blur_box3_kernel_init().
+//
+// When work_queue.h is included first, blur_argb32_parallel() splits the blur
+// across worker threads.
+//
+// NOTE: Premultiplied and straight alpha are blurred the same way, each of the
+// 4 channels is processed independently.
+
+#define BLUR_BLOCK_ROWS 8
+#define BLUR_ROW_ALIGN 8 // Outputs computed at once by the widest implementation.
+#define BLUR_BUFFER_ALIGN 32 // Temporary buffers start at AVX2 register boundaries.
+
+static inline
+uint32_t blur_aligned_width (uint32_t width)
+{
+    return (width + BLUR_ROW_ALIGN - 1)/BLUR_ROW_ALIGN*BLUR_ROW_ALIGN;
+}
+
+enum blur_mode_t {
+    BLUR_MODE_AUTO,     // Box approximation for radii >= BLUR_AUTO_BOX3_RADIUS
+    BLUR_MODE_GAUSSIAN,
+    BLUR_MODE_BOX3,
+
+    NUM_BLUR_MODES
+};
+
+char *blur_mode_names[] = {
+    "auto",
+    "gaussian",
+    "box3"
+};
+
+// Radius from which the box approximation is faster than the vectorized
+// gaussian, measured with blur_bench. Below it the gaussian is cheap anyway.
+#define BLUR_AUTO_BOX3_RADIUS 16
+
+enum blur_impl_t {
+    BLUR_IMPL_AUTO,
+    BLUR_IMPL_SCALAR,
+    BLUR_IMPL_SSE2,
+    BLUR_IMPL_AVX2,
+
+    NUM_BLUR_IMPL
+};
+
+char *blur_impl_names[] = {
+    "auto",
+    "scalar",
+    "SSE2",
+    "AVX2"
+};
+
+// Kernel taps are stored in pairs so SIMD code can multiply two taps at a time
+// with 16 bit multiply-adds. An odd kernel is padded with a 0 weight tap.
+struct blur_kernel_t {
+    uint32_t size; // Including the padding tap
+    uint32_t half;
+    int16_t *weights;
+
+    // Division by the kernel's area as a fixed point multiply, see
+    // blur_kernel_init().
+    uint32_t recip;
+    uint32_t shift;
+
+    // Box blur approximation, weights are not used.
+    uint32_t box_radius[3];
+    uint32_t *box_tmp[2];
+    void (*box_pass)(uint32_t *in, uint32_t *out, uint32_t begin, uint32_t end, uint32_t r);
+};
+
+void blur_kernel_init (mem_pool_t *pool, struct blur_kernel_t *kernel, double r)
+{
+    uint32_t size = 2*r+1;
+    kernel->half = size/2;
+    kernel->size = size + size%2;
+    kernel->weights = mem_pool_push_size_full (pool, kernel->size*sizeof(int16_t), POOL_ZERO_INIT);
+
+    uint32_t i, area = 0;
+    double mu = size/2;
+    for (i=0; i<size; i++) {
+        kernel->weights[i] = (uint8_t)(255*exp(-(i-mu)*(i-mu)/(2*(r/2)*(r/2))));
+        area += kernel->weights[i];
+    }
+
+    // Outputs are floor(c/area) for sums c <= 255*area, computed as
+    // (c*recip) >> shift with recip = ceil(2^shift/area). With
+    // e = recip*area - 2^shift < area the result is exact if c*e < 2^shift,
+    // so 255*area^2 <= 2^shift is enough. The shift is at least 32 so SIMD
+    // code can take the high half of 64 bit products.
+    uint64_t max_c_times_area = 255*(uint64_t)area*area;
+    kernel->shift = 32;
+    while (((uint64_t)1 << kernel->shift) < max_c_times_area) {
+        kernel->shift++;
+    }
+    kernel->recip = (((uint64_t)1 << kernel->shift) + area - 1)/area;
+    assert ((uint64_t)kernel->recip*area - ((uint64_t)1 << kernel->shift) < area);
+}
+
+static inline
+uint8_t blur_divide_by_area (int32_t c, struct blur_kernel_t *kernel)
+{
+    return ((uint64_t)c*kernel->recip) >> kernel->shift;
+}
+
+// Three box blurs approximate a gaussian with the same standard deviation, box
+// sizes are computed as in "Fast Almost-Gaussian Filtering" by Peter Kovesi.
+// The gaussian kernel above uses sigma = r/2.
+void blur_box3_kernel_init (struct blur_kernel_t *kernel, double r)
+{
+    *kernel = ZERO_INIT (struct blur_kernel_t);
+
+    int n = ARRAY_SIZE(kernel->box_radius);
+    double sigma = r/2;
+    int w_l = floor (sqrt (12*sigma*sigma/n + 1));
+    if (w_l%2 == 0) {
+        w_l--;
+    }
+    int w_u = w_l + 2;
+    int m = round ((12*sigma*sigma - n*w_l*w_l - 4*n*w_l - 3*n)/(-4*w_l - 4));
+
+    int i;
+    for (i=0; i<n; i++) {
+        kernel->box_radius[i] = ((i < m ? w_l : w_u) - 1)/2;
+        kernel->half += kernel->box_radius[i];
+    }
+
+    // NOTE: Only used to size line buffers.
+    kernel->size = 2*kernel->half + 2;
+}
+
+typedef void (blur_row_func_t)(uint32_t *line, uint32_t width,
+                               struct blur_kernel_t *kernel, uint32_t *out);
+
+// _line_ holds the padded row, the output pixel x is centered at line[x + half].
+// _out_ must have space for width rounded up to BLUR_ROW_ALIGN pixels.
+void blur_row_scalar (uint32_t *line, uint32_t width, struct blur_kernel_t *kernel, uint32_t *out)
+{
+    uint32_t x;
+    for (x=0; x<width; x++) {
+        uint8_t *src = (uint8_t*)(line + x);
+        int32_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+        uint32_t k;
+        for (k=0; k<kernel->size; k++) {
+            int32_t w = kernel->weights[k];
+            c0 += src[4*k+0]*w;
+            c1 += src[4*k+1]*w;
+            c2 += src[4*k+2]*w;
+            c3 += src[4*k+3]*w;
+        }
+
+        uint8_t *dest = (uint8_t*)(out + x);
+        dest[0] = blur_divide_by_area (c0, kernel);
+        dest[1] = blur_divide_by_area (c1, kernel);
+        dest[2] = blur_divide_by_area (c2, kernel);
+        dest[3] = blur_divide_by_area (c3, kernel);
+    }
+}
+
+#if defined(BLUR_X86)
+// Computes blur_divide_by_area() for the 4 sums in _c_. _mm_mul_epu32() only
+// multiplies even lanes, odd ones are shifted down to be multiplied separately.
+__attribute__((target("sse2")))
+static inline
+__m128i blur_divide_by_area_sse2 (__m128i c, __m128i recip, __m128i shift)
+{
+    __m128i even = _mm_srl_epi64 (_mm_mul_epu32 (c, recip), shift);
+    __m128i odd = _mm_srl_epi64 (_mm_mul_epu32 (_mm_srli_epi64 (c, 32), recip), shift);
+    return _mm_or_si128 (even, _mm_slli_epi64 (odd, 32));
+}
+
+__attribute__((target("avx2")))
+static inline
+__m256i blur_divide_by_area_avx2 (__m256i c, __m256i recip, __m128i shift)
+{
+    __m256i even = _mm256_srl_epi64 (_mm256_mul_epu32 (c, recip), shift);
+    __m256i odd = _mm256_srl_epi64 (_mm256_mul_epu32 (_mm256_srli_epi64 (c, 32), recip), shift);
+    return _mm256_or_si256 (even, _mm256_slli_epi64 (odd, 32));
+}
+
+// Interleaving the channels of pixel x+k (A) with those of pixel x+k+1 (B) and
+// zero extending them to 16 bits lets _mm_madd_epi16() compute A*w_k + B*w_k+1
+// for the 4 channels of an output pixel at once.
+__attribute__((target("sse2")))
+void blur_row_sse2 (uint32_t *line, uint32_t width, struct blur_kernel_t *kernel, uint32_t *out)
+{
+    __m128i zero = _mm_setzero_si128 ();
+    __m128i recip = _mm_set1_epi32 (kernel->recip);
+    __m128i shift = _mm_cvtsi32_si128 (kernel->shift);
+
+    uint32_t x;
+    for (x=0; x<width; x+=4) {
+        __m128i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+
+        uint32_t k;
+        for (k=0; k<kernel->size; k+=2) {
+            __m128i w = _mm_set1_epi32 ((uint16_t)kernel->weights[k] |
+                                        ((uint32_t)(uint16_t)kernel->weights[k+1] << 16));
+            __m128i a = _mm_loadu_si128 ((__m128i*)(line + x + k));
+            __m128i b = _mm_loadu_si128 ((__m128i*)(line + x + k + 1));
+
+            __m128i ab_lo = _mm_unpacklo_epi8 (a, b); // Outputs x, x+1
+            __m128i ab_hi = _mm_unpackhi_epi8 (a, b); // Outputs x+2, x+3
+            acc0 = _mm_add_epi32 (acc0, _mm_madd_epi16 (_mm_unpacklo_epi8 (ab_lo, zero), w));
+            acc1 = _mm_add_epi32 (acc1, _mm_madd_epi16 (_mm_unpackhi_epi8 (ab_lo, zero), w));
+            acc2 = _mm_add_epi32 (acc2, _mm_madd_epi16 (_mm_unpacklo_epi8 (ab_hi, zero), w));
+            acc3 = _mm_add_epi32 (acc3, _mm_madd_epi16 (_mm_unpackhi_epi8 (ab_hi, zero), w));
+        }
+
+        acc0 = blur_divide_by_area_sse2 (acc0, recip, shift);
+        acc1 = blur_divide_by_area_sse2 (acc1, recip, shift);
+        acc2 = blur_divide_by_area_sse2 (acc2, recip, shift);
+        acc3 = blur_divide_by_area_sse2 (acc3, recip, shift);
+        __m128i res = _mm_packus_epi16 (_mm_packs_epi32 (acc0, acc1), _mm_packs_epi32 (acc2, acc3));
+        _mm_storeu_si128 ((__m128i*)(out + x), res);
+    }
+}
+
+// Same as blur_row_sse2() but 8 outputs at a time. AVX2 unpacks work inside
+// 128 bit lanes, so each accumulator holds output x+i in its low lane and x+4+i
+// in the high one. Packing keeps the lanes apart too, which puts everything
+// back in order.
+__attribute__((target("avx2")))
+void blur_row_avx2 (uint32_t *line, uint32_t width, struct blur_kernel_t *kernel, uint32_t *out)
+{
+    __m256i zero = _mm256_setzero_si256 ();
+    __m256i recip = _mm256_set1_epi32 (kernel->recip);
+    __m128i shift = _mm_cvtsi32_si128 (kernel->shift);
+
+    uint32_t x;
+    for (x=0; x<width; x+=8) {
+        __m256i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+
+        uint32_t k;
+        for (k=0; k<kernel->size; k+=2) {
+            __m256i w = _mm256_set1_epi32 ((uint16_t)kernel->weights[k] |
+                                           ((uint32_t)(uint16_t)kernel->weights[k+1] << 16));
+            __m256i a = _mm256_loadu_si256 ((__m256i*)(line + x + k));
+            __m256i b = _mm256_loadu_si256 ((__m256i*)(line + x + k + 1));
+
+            __m256i ab_lo = _mm256_unpacklo_epi8 (a, b);
+            __m256i ab_hi = _mm256_unpackhi_epi8 (a, b);
+            acc0 = _mm256_add_epi32 (acc0, _mm256_madd_epi16 (_mm256_unpacklo_epi8 (ab_lo, zero), w));
+            acc1 = _mm256_add_epi32 (acc1, _mm256_madd_epi16 (_mm256_unpackhi_epi8 (ab_lo, zero), w));
+            acc2 = _mm256_add_epi32 (acc2, _mm256_madd_epi16 (_mm256_unpacklo_epi8 (ab_hi, zero), w));
+            acc3 = _mm256_add_epi32 (acc3, _mm256_madd_epi16 (_mm256_unpackhi_epi8 (ab_hi, zero), w));
+        }
+
+        acc0 = blur_divide_by_area_avx2 (acc0, recip, shift);
+        acc1 = blur_divide_by_area_avx2 (acc1, recip, shift);
+        acc2 = blur_divide_by_area_avx2 (acc2, recip, shift);
+        acc3 = blur_divide_by_area_avx2 (acc3, recip, shift);
+        __m256i res = _mm256_packus_epi16 (_mm256_packs_epi32 (acc0, acc1),
+                                           _mm256_packs_epi32 (acc2, acc3));
+        _mm256_storeu_si256 ((__m256i*)(out + x), res);
+    }
+}
+#endif
+
+// Computes the box blur of radius _r_ of in[begin] to in[end-1] into out[begin]
+// to out[end-1]. Reads from in[begin-r] to in[end-1+r].
+void blur_box_pass_scalar (uint32_t *in, uint32_t *out, uint32_t begin, uint32_t end, uint32_t r)
+{
+    float inv_d = 1.0f/(2*r+1);
+    int32_t s[4] = {0};
+    uint32_t i, c;
+    for (i=begin-r; i<=begin+r; i++) {
+        for (c=0; c<4; c++) {
+            s[c] += (in[i] >> 8*c) & 0xFF;
+        }
+    }
+
+    for (i=begin; i<end; i++) {
+        out[i] = 0;
+        for (c=0; c<4; c++) {
+            out[i] |= (uint32_t)((float)s[c]*inv_d + 0.5f) << 8*c;
+        }
+
+        if (i+1 < end) {
+            for (c=0; c<4; c++) {
+                s[c] += (int32_t)((in[i+r+1] >> 8*c) & 0xFF) - (int32_t)((in[i-r] >> 8*c) & 0xFF);
+            }
+        }
+    }
+}
+
+#if defined(BLUR_X86)
+// Same as blur_box_pass_scalar(), the running sums of the 4 channels are kept
+// in a single register.
+__attribute__((target("sse2")))
+void blur_box_pass_sse2 (uint32_t *in, uint32_t *out, uint32_t begin, uint32_t end, uint32_t r)
+{
+    __m128i zero = _mm_setzero_si128 ();
+    __m128 inv_d = _mm_set1_ps (1.0f/(2*r+1));
+    __m128 half = _mm_set1_ps (0.5f);
+
+#define UNPACK_PX(px) _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(px),zero),zero)
+    __m128i s = zero;
+    uint32_t i;
+    for (i=begin-r; i<=begin+r; i++) {
+        s = _mm_add_epi32 (s, UNPACK_PX (in[i]));
+    }
+
+    for (i=begin; i<end; i++) {
+        __m128i res = _mm_cvttps_epi32 (_mm_add_ps (_mm_mul_ps (_mm_cvtepi32_ps (s), inv_d), half));
+        res = _mm_packs_epi32 (res, res);
+        out[i] = _mm_cvtsi128_si32 (_mm_packus_epi16 (res, res));
+
+        if (i+1 < end) {
+            s = _mm_add_epi32 (s, _mm_sub_epi32 (UNPACK_PX (in[i+r+1]), UNPACK_PX (in[i-r])));
+        }
+    }
+#undef UNPACK_PX
+}
+#endif
+
+// Row function for the box approximation. Each pass only computes the range
+// the next one reads, the last one computes the width pixels of the row.
+void blur_row_box3 (uint32_t *line, uint32_t width, struct blur_kernel_t *kernel, uint32_t *out)
+{
+    uint32_t *r = kernel->box_radius;
+    uint32_t half = kernel->half;
+    uint32_t *a = kernel->box_tmp[0], *b = kernel->box_tmp[1];
+
+    kernel->box_pass (line, a, half - r[1] - r[2], half + width + r[1] + r[2], r[0]);
+    kernel->box_pass (a, b, half - r[2], half + width + r[2], r[1]);
+    kernel->box_pass (b, a, half, half + width, r[2]);
+    memcpy (out, a + half, width*sizeof(uint32_t));
+}
+
+bool blur_impl_supported (enum blur_impl_t impl)
+{
+    switch (impl) {
+        case BLUR_IMPL_AUTO:
+        case BLUR_IMPL_SCALAR:
+            return true;
+#if defined(BLUR_X86)
+        case BLUR_IMPL_SSE2:
+            return __builtin_cpu_supports ("sse2");
+        case BLUR_IMPL_AVX2:
+            return __builtin_cpu_supports ("avx2");
+#endif
+        default:
+            return false;
+    }
+}
+
+blur_row_func_t* blur_get_row_func (enum blur_impl_t impl)
+{
+    if (impl == BLUR_IMPL_AUTO) {
+        impl = BLUR_IMPL_SCALAR;
+        if (blur_impl_supported (BLUR_IMPL_AVX2)) {
+            impl = BLUR_IMPL_AVX2;
+        } else if (blur_impl_supported (BLUR_IMPL_SSE2)) {
+            impl = BLUR_IMPL_SSE2;
+        }
+    }
+
+    switch (impl) {
+#if defined(BLUR_X86)
+        case BLUR_IMPL_SSE2:
+            return blur_row_sse2;
+        case BLUR_IMPL_AVX2:
+            return blur_row_avx2;
+#endif
+        default:
+            return blur_row_scalar;
+    }
+}
+
+enum blur_mode_t blur_resolve_mode (double r, enum blur_mode_t mode)
+{
+    if (mode == BLUR_MODE_AUTO) {
+        mode = r < BLUR_AUTO_BOX3_RADIUS ? BLUR_MODE_GAUSSIAN : BLUR_MODE_BOX3;
+    }
+    return mode;
+}
+
+// Initializes _kernel_ for a blur of radius _r_ and returns the row function
+// to use with it. Box kernels don't get temporary buffers, callers allocate
+// kernel->box_tmp.
+blur_row_func_t* blur_kernel_setup (mem_pool_t *pool, struct blur_kernel_t *kernel, double r,
+                                    enum blur_mode_t mode, enum blur_impl_t impl)
+{
+    if (blur_resolve_mode (r, mode) == BLUR_MODE_BOX3) {
+        blur_box3_kernel_init (kernel, r);
+        kernel->box_pass = blur_box_pass_scalar;
+#if defined(BLUR_X86)
+        // NOTE: There is nothing to gain from AVX2 here, a pixel fits in an SSE
+        // register.
+        if ((impl == BLUR_IMPL_AUTO || impl >= BLUR_IMPL_SSE2) && blur_impl_supported (BLUR_IMPL_SSE2)) {
+            kernel->box_pass = blur_box_pass_sse2;
+        }
+#endif
+        return blur_row_box3;
+
+    } else {
+        *kernel = ZERO_INIT (struct blur_kernel_t);
+        blur_kernel_init (pool, kernel, r);
+        return blur_get_row_func (impl);
+    }
+}
+
+// Blurs each row of _src_ (width x height) and writes the result transposed
+// into _dest_, so row y of _src_ becomes column y of _dest_. Strides are in
+// pixels.
+void blur_rows_transposed (uint32_t *src, uint32_t src_stride, uint32_t width, uint32_t height,
+                           uint32_t *dest, uint32_t dest_stride,
+                           struct blur_kernel_t *kernel, blur_row_func_t *blur_row,
+                           uint32_t *line, uint32_t *block)
+{
+    uint32_t block_stride = blur_aligned_width (width);
+
+    uint32_t y0;
+    for (y0=0; y0<height; y0+=BLUR_BLOCK_ROWS) {
+        uint32_t num_rows = MIN (BLUR_BLOCK_ROWS, height - y0);
+
+        uint32_t i;
+        for (i=0; i<num_rows; i++) {
+            // NOTE: Only the image part of the line changes, padding stays 0.
+            memcpy (line + kernel->half, src + (y0 + i)*src_stride, width*sizeof(uint32_t));
+            blur_row (line, width, kernel, block + i*block_stride);
+        }
+
+        // Each column of the block becomes num_rows consecutive pixels of
+        // _dest_, reading the block stays in cache.
+        uint32_t x;
+        for (x=0; x<width; x++) {
+            uint32_t *dest_px = dest + x*dest_stride + y0;
+            for (i=0; i<num_rows; i++) {
+                dest_px[i] = block[i*block_stride + x];
+            }
+        }
+    }
+}
+
+// Same as blur_rows_transposed() but only for rows [_y0_, _y1_), buffers are
+// allocated from _scratch_. Bands of the same pass can run in parallel, the
+// result is the same as blurring all rows at once.
+void blur_band_transposed (mem_pool_t *scratch, uint32_t *src, uint32_t src_stride, uint32_t width,
+                           uint32_t y0, uint32_t y1, uint32_t *dest, uint32_t dest_stride,
+                           struct blur_kernel_t *kernel, blur_row_func_t *blur_row)
+{
+    struct blur_kernel_t band_kernel = *kernel;
+    uint32_t line_len = blur_aligned_width (width) + kernel->size + BLUR_ROW_ALIGN;
+    uint32_t *line = mem_pool_push_size_aligned_full (scratch, line_len*sizeof(uint32_t),
+                                                      BLUR_BUFFER_ALIGN, POOL_ZERO_INIT);
+    uint32_t *block = mem_pool_push_size_aligned (scratch,
+        BLUR_BLOCK_ROWS*blur_aligned_width (width)*sizeof(uint32_t), BLUR_BUFFER_ALIGN);
+    if (blur_row == blur_row_box3) {
+        uint32_t tmp_len = blur_aligned_width (width) + kernel->size;
+        band_kernel.box_tmp[0] = mem_pool_push_size_aligned (scratch, tmp_len*sizeof(uint32_t), BLUR_BUFFER_ALIGN);
+        band_kernel.box_tmp[1] = mem_pool_push_size_aligned (scratch, tmp_len*sizeof(uint32_t), BLUR_BUFFER_ALIGN);
+    }
+
+    blur_rows_transposed (src + y0*src_stride, src_stride, width, y1 - y0, dest + y0, dest_stride,
+                          &band_kernel, blur_row, line, block);
+}
+
+// Blurs rows, then columns of _pixels_ using _blur_row_ and _kernel_.
+void blur_separable (mem_pool_t *pool, uint32_t *pixels, uint32_t width, uint32_t height,
+                     uint32_t stride, struct blur_kernel_t *kernel, blur_row_func_t *blur_row)
+{
+    // SIMD implementations read up to BLUR_ROW_ALIGN-1 pixels past the last
+    // output, plus one more for the second tap of each pair.
+    uint32_t max_dim = MAX (width, height);
+    uint32_t line_len = blur_aligned_width (max_dim) + kernel->size + BLUR_ROW_ALIGN;
+    uint32_t *line = mem_pool_push_size_aligned_full (pool, line_len*sizeof(uint32_t),
+                                                      BLUR_BUFFER_ALIGN, POOL_ZERO_INIT);
+    uint32_t *block = mem_pool_push_size_aligned (pool,
+        BLUR_BLOCK_ROWS*blur_aligned_width (max_dim)*sizeof(uint32_t), BLUR_BUFFER_ALIGN);
+    uint32_t *transposed = mem_pool_push_size_aligned (pool, width*height*sizeof(uint32_t),
+                                                       BLUR_BUFFER_ALIGN);
+
+    blur_rows_transposed (pixels, stride, width, height, transposed, height,
+                          kernel, blur_row, line, block);
+
+    // The tail of the line still has pixels from the last row, clear them.
+    memset (line + kernel->half, 0, (line_len - kernel->half)*sizeof(uint32_t));
+    blur_rows_transposed (transposed, height, height, width, pixels, stride,
+                          kernel, blur_row, line, block);
+}
+
+void gaussian_blur_argb32_full (uint32_t *pixels, uint32_t width, uint32_t height,
+                                uint32_t stride, double r, enum blur_impl_t impl)
+{
+    if (r == 0 || width == 0 || height == 0) {
+        return;
+    }
+
+    mem_pool_t pool = {0};
+    struct blur_kernel_t kernel;
+    blur_row_func_t *blur_row = blur_kernel_setup (&pool, &kernel, r, BLUR_MODE_GAUSSIAN, impl);
+    blur_separable (&pool, pixels, width, height, stride, &kernel, blur_row);
+    mem_pool_destroy (&pool);
+}
+
+void gaussian_blur_argb32 (uint32_t *pixels, uint32_t width, uint32_t height,
+                           uint32_t stride, double r)
+{
+    gaussian_blur_argb32_full (pixels, width, height, stride, r, BLUR_IMPL_AUTO);
+}
+
+// Approximation of gaussian_blur_argb32() with three box blurs, takes the same
+// time for any radius.
+void box3_blur_argb32_full (uint32_t *pixels, uint32_t width, uint32_t height,
+                            uint32_t stride, double r, enum blur_impl_t impl)
+{
+    if (r == 0 || width == 0 || height == 0) {
+        return;
+    }
+
+    mem_pool_t pool = {0};
+    struct blur_kernel_t kernel;
+    blur_row_func_t *blur_row = blur_kernel_setup (&pool, &kernel, r, BLUR_MODE_BOX3, impl);
+
+    uint32_t tmp_len = blur_aligned_width (MAX (width, height)) + kernel.size;
+    kernel.box_tmp[0] = mem_pool_push_size_aligned (&pool, tmp_len*sizeof(uint32_t), BLUR_BUFFER_ALIGN);
+    kernel.box_tmp[1] = mem_pool_push_size_aligned (&pool, tmp_len*sizeof(uint32_t), BLUR_BUFFER_ALIGN);
+    blur_separable (&pool, pixels, width, height, stride, &kernel, blur_row);
+    mem_pool_destroy (&pool);
+}
+
+void box3_blur_argb32 (uint32_t *pixels, uint32_t width, uint32_t height,
+                       uint32_t stride, double r)
+{
+    box3_blur_argb32_full (pixels, width, height, stride, r, BLUR_IMPL_AUTO);
+}
+
+void blur_argb32 (uint32_t *pixels, uint32_t width, uint32_t height,
+                  uint32_t stride, double r, enum blur_mode_t mode)
+{
+    mode = blur_resolve_mode (r, mode);
+    if (mode == BLUR_MODE_BOX3) {
+        box3_blur_argb32 (pixels, width, height, stride, r);
+    } else {
+        gaussian_blur_argb32 (pixels, width, height, stride, r);
+    }
+}
+
+#if defined(WORK_QUEUE_H)
+//////////////////////
+// PARALLEL BLUR
+//
+// Only available if work_queue.h is included before this file. Both passes of
+// blur_separable() are split into bands of rows that run on the workers. Each
+// band takes its line buffers from the worker's scratch pool.
+
+// Images with fewer pixels are blurred in the calling thread, splitting them
+// costs more than it saves.
+#define BLUR_PARALLEL_MIN_PIXELS (256*256)
+#define BLUR_BANDS_PER_WORKER 4
+
+struct blur_band_job_t {
+    uint32_t *src;
+    uint32_t src_stride;
+    uint32_t width;
+    uint32_t y0, y1;
+    uint32_t *dest;
+    uint32_t dest_stride;
+    struct blur_kernel_t *kernel;
+    blur_row_func_t *blur_row;
+};
+
+void blur_band_job (mem_pool_t *scratch, void *data)
+{
+    struct blur_band_job_t *band = (struct blur_band_job_t*)data;
+    blur_band_transposed (scratch, band->src, band->src_stride, band->width,
+                          band->y0, band->y1, band->dest, band->dest_stride,
+                          band->kernel, band->blur_row);
+}
+
+// One pass of blur_separable(), bands of rows are blurred by the workers.
+void blur_pass_parallel (struct work_queue_t *wq, mem_pool_t *pool,
+                         uint32_t *src, uint32_t src_stride, uint32_t width, uint32_t height,
+                         uint32_t *dest, uint32_t dest_stride,
+                         struct blur_kernel_t *kernel, blur_row_func_t *blur_row)
+{
+    uint32_t band_rows = height/(wq->num_workers*BLUR_BANDS_PER_WORKER) + 1;
+    band_rows = (band_rows + BLUR_BLOCK_ROWS - 1)/BLUR_BLOCK_ROWS*BLUR_BLOCK_ROWS;
+    uint32_t num_bands = (height + band_rows - 1)/band_rows;
+    // NOTE: The pool may have been left unaligned by the caller's pushes, jobs
+    // hold pointers.
+    struct blur_band_job_t *bands =
+        mem_pool_push_array_aligned (pool, num_bands, struct blur_band_job_t, sizeof(void*));
+
+    struct job_group_t group = {0};
+    uint32_t i;
+    for (i=0; i<num_bands; i++) {
+        struct blur_band_job_t *band = bands + i;
+        band->src = src;
+        band->src_stride = src_stride;
+        band->width = width;
+        band->y0 = i*band_rows;
+        band->y1 = MIN (band->y0 + band_rows, height);
+        band->dest = dest;
+        band->dest_stride = dest_stride;
+        band->kernel = kernel;
+        band->blur_row = blur_row;
+        work_queue_push (wq, &group, blur_band_job, band);
+    }
+    job_group_wait (&group);
+}
+
+// Same result as blur_argb32(), split across the workers of _wq_.
+void blur_argb32_parallel (struct work_queue_t *wq, uint32_t *pixels, uint32_t width, uint32_t height,
+                           uint32_t stride, double r, enum blur_mode_t mode)
+{
+    if (r == 0 || width == 0 || height == 0) {
+        return;
+    }
+
+    mem_pool_t pool = {0};
+    struct blur_kernel_t kernel;
+    blur_row_func_t *blur_row = blur_kernel_setup (&pool, &kernel, r, mode, BLUR_IMPL_AUTO);
+    uint32_t *transposed = mem_pool_push_size_aligned (&pool, width*height*sizeof(uint32_t),
+                                                       BLUR_BUFFER_ALIGN);
+
+    blur_pass_parallel (wq, &pool, pixels, stride, width, height, transposed, height, &kernel, blur_row);
+    blur_pass_parallel (wq, &pool, transposed, height, height, width, pixels, stride, &kernel, blur_row);
+    mem_pool_destroy (&pool);
+}
+#endif
+
+// Number of pixels at each side of a pixel that contribute to its value after
+// calling blur_argb32() with the same arguments.
+uint32_t blur_support (double r, enum blur_mode_t mode)
+{
+    if (r == 0) {
+        return 0;
+    }
+
+    if (blur_resolve_mode (r, mode) == BLUR_MODE_BOX3) {
+        struct blur_kernel_t kernel;
+        blur_box3_kernel_init (&kernel, r);
+        return kernel.half;
+    } else {
+        uint32_t size = 2*r+1;
+        return size/2;
+    }
+}
+
+//////////////////////
+// NINE SLICE
+//
+// A blurred rounded rectangle is constant along each axis once we are far
+// enough from the corners, all columns between them are equal, same for rows.
+// Instead of blurring the full image we can blur a template where the shape is
+// shorter by an integer number of pixels, then expand it back by repeating its
+// middle row and column. Because the shape is only shortened by whole pixels,
+// its antialiased edges rasterize the same in both images and the result
+// matches the full blur exactly.
+
+struct nine_slice_axis_t {
+    uint32_t size;     // Of the full image
+    uint32_t tpl_size; // Of the template
+    uint32_t corner;   // Index of the repeated row or column in the template
+    uint32_t removed;  // Pixels removed from the shape in the template
+};
+
+// Computes the template for one axis of an image _size_ pixels long, that
+// contains a shape starting at _start_ and _len_ pixels long, with rounded
+// corners of _radius_. The content must be blurred with a blur that reaches
+// _support_ pixels to each side, see blur_support().
+//
+// Returns false if nothing can be removed, in that case the template is the
+// full image.
+bool nine_slice_axis (uint32_t size, double start, double len, double radius,
+                      uint32_t support, struct nine_slice_axis_t *axis)
+{
+    *axis = ZERO_INIT (struct nine_slice_axis_t);
+    axis->size = size;
+    axis->tpl_size = size;
+
+    // NOTE: A pixel is outside of the corner if it doesn't touch the arc, an
+    // extra pixel of margin is left at each side so rounding in the
+    // rasterizer can't bite us.
+    double corner = ceil (start + radius) + support + 1;
+    double removed = floor (start + len - radius - support - 2 - corner);
+    if (corner < 0 || removed <= 0 || corner + 1 > size - removed) {
+        return false;
+    }
+
+    axis->corner = corner;
+    axis->removed = removed;
+    axis->tpl_size = size - axis->removed;
+    return true;
+}
+
+// Expands a template computed with nine_slice_axis() into the full image.
+void nine_slice_expand_argb32 (uint32_t *tpl, uint32_t tpl_stride,
+                               struct nine_slice_axis_t *x_axis, struct nine_slice_axis_t *y_axis,
+                               uint32_t *dest, uint32_t dest_stride)
+{
+    uint32_t left = x_axis->corner;
+    uint32_t right = x_axis->tpl_size - x_axis->corner;
+
+    uint32_t y;
+    for (y=0; y<y_axis->size; y++) {
+        uint32_t tpl_y = y;
+        if (y >= y_axis->corner + y_axis->removed) {
+            tpl_y = y - y_axis->removed;
+        } else if (y > y_axis->corner) {
+            tpl_y = y_axis->corner;
+        }
+
+        uint32_t *src_row = tpl + tpl_y*tpl_stride;
+        uint32_t *dest_row = dest + y*dest_stride;
+        memcpy (dest_row, src_row, left*sizeof(uint32_t));
+
+        uint32_t middle = src_row[left];
+        uint32_t x;
+        for (x=0; x<x_axis->removed; x++) {
+            dest_row[left + x] = middle;
+        }
+
+        memcpy (dest_row + left + x_axis->removed, src_row + left, right*sizeof(uint32_t));
+    }
+}
+
+#define BLUR_H
+#endif
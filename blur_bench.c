@@ -0,0 +1,680 @@
+/*
+ * Copyright (C) 2018 Santiago León O. <santileortiz@gmail.com>
+ */
+
+// Microbenchmark for the blur used by CSS box shadows. It doesn't need X11 or
+// cairo.
+//
+// Usage:
+//   blur_bench [-n ITERATIONS] [-s WIDTH HEIGHT] [RADIUS...]
+//
+// For each radius, blurs a WIDTH x HEIGHT test image with the naive
+// convolution css_gaussian_blur() used to have, and with each implementation
+// from blur.h supported by this CPU. Reports the time per blur, the speedup
+// over the naive code and the maximum per channel difference against it. The
+// default radii include odd and fractional ones, where the kernel's area is
+// not a power of 2. Uniform images are checked too, an opaque one must stay
+// opaque.
+//
+// Then does the same for the box blur approximation, comparing it against the
+// gaussian blur. The mean difference is also reported for it.
+//
+// Finally, for outset and inset shadows of rounded boxes of different sizes,
+// compares the nine slice rendering against blurring the full shadow.
+//
+// Also checks that blur_argb32_parallel() matches blur_argb32() bit by bit,
+// for several image sizes, radii and modes. And that jobs pushed to the work
+// queue from several threads are each popped exactly once.
+//
+// Returns non zero if an implementation of the gaussian blur doesn't match the
+// naive one exactly, if the box blur's error is larger than BOX3_MAX_ERROR, if a nine
+// slice shadow differs from the full one, if the parallel blur differs from
+// the serial one, or if the work queue loses or repeats jobs.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "common.h"
+#include "slo_timers.h"
+#include "work_queue.h"
+#include "blur.h"
+
+// Largest difference per channel allowed between the box blur approximation
+// and the gaussian blur, out of 255. It's only checked from BOX3_MIN_RADIUS,
+// below that boxes are 1 or 3 pixels wide and the approximation is poor.
+#define BOX3_MAX_ERROR 16
+#define BOX3_MIN_RADIUS 4
+
+// Two pass convolution that was used by css_gaussian_blur(), with per tap
+// bounds checks and a vertical pass walking columns.
+void blur_naive (uint32_t *src, uint32_t src_width, uint32_t src_height, double r)
+{
+    int size = 2*r+1;
+    uint8_t kernel[size];
+    uint32_t i;
+    uint32_t area = 0;
+    double mu = ARRAY_SIZE(kernel)/2;
+    for (i=0; i<ARRAY_SIZE(kernel); i++) {
+        kernel[i] = (uint32_t)(255*exp(-(i-mu)*(i-mu)/(2*(r/2)*(r/2))));
+        area += kernel[i];
+    }
+
+    uint32_t *tmp = malloc (src_width*src_height*sizeof(uint32_t));
+    for (i=0; i<src_height; i++) {
+        uint32_t j;
+        for (j=0; j<src_width; j++) {
+            uint32_t k;
+            uint32_t a = 0, r = 0, g = 0, b = 0;
+            for (k=0; k<ARRAY_SIZE(kernel); k++) {
+                if (j - ARRAY_SIZE(kernel)/2 + k < 0) {
+                    continue;
+                } else if (j - ARRAY_SIZE(kernel)/2 + k >= src_width) {
+                    continue;
+                }
+
+                uint8_t *src_px = (uint8_t*)(src + j - ARRAY_SIZE(kernel)/2 + k + i*src_width);
+                a += src_px[0]*kernel[k];
+                r += src_px[1]*kernel[k];
+                g += src_px[2]*kernel[k];
+                b += src_px[3]*kernel[k];
+            }
+            uint8_t *dest_px = (uint8_t*)(tmp + j + i*src_width);
+            dest_px[0] = a/area;
+            dest_px[1] = r/area;
+            dest_px[2] = g/area;
+            dest_px[3] = b/area;
+        }
+    }
+
+    uint32_t j;
+    for (j=0; j<src_width; j++) {
+        uint32_t i;
+        for (i=0; i<src_height; i++) {
+            uint32_t k;
+            uint32_t a = 0, r = 0, g = 0, b = 0;
+            for (k=0; k<ARRAY_SIZE(kernel); k++) {
+                if (i - ARRAY_SIZE(kernel)/2 + k < 0) {
+                    continue;
+                } else if (i - ARRAY_SIZE(kernel)/2 + k >= src_height) {
+                    continue;
+                }
+
+                uint8_t *src_px = (uint8_t*)(tmp + j + (i - ARRAY_SIZE(kernel)/2 + k)*src_width);
+                a += src_px[0]*kernel[k];
+                r += src_px[1]*kernel[k];
+                g += src_px[2]*kernel[k];
+                b += src_px[3]*kernel[k];
+            }
+            uint8_t *dest_px = (uint8_t*)(src + j + i*src_width);
+            dest_px[0] = a/area;
+            dest_px[1] = r/area;
+            dest_px[2] = g/area;
+            dest_px[3] = b/area;
+        }
+    }
+    free (tmp);
+}
+
+// Something that looks like a shadow mask, an opaque rectangle with a margin
+// of transparent pixels, plus noise so channels can't be mixed up unnoticed.
+void fill_test_image (uint32_t *pixels, uint32_t width, uint32_t height)
+{
+    uint32_t seed = 1;
+    uint32_t x, y;
+    for (y=0; y<height; y++) {
+        for (x=0; x<width; x++) {
+            seed = seed*1103515245 + 12345;
+            uint32_t noise = seed >> 8;
+            if (x > width/8 && x < width - width/8 && y > height/8 && y < height - height/8) {
+                pixels[y*width + x] = 0xFF000000 | (noise & 0x00FFFFFF);
+            } else {
+                pixels[y*width + x] = noise & 0x0F0F0F0F;
+            }
+        }
+    }
+}
+
+uint32_t max_channel_diff (uint32_t *a, uint32_t *b, uint32_t num_pixels, double *mean)
+{
+    uint32_t res = 0;
+    uint64_t total = 0;
+    uint8_t *a_bytes = (uint8_t*)a, *b_bytes = (uint8_t*)b;
+    uint32_t i;
+    for (i=0; i<4*num_pixels; i++) {
+        uint32_t diff = abs ((int)a_bytes[i] - (int)b_bytes[i]);
+        res = MAX (res, diff);
+        total += diff;
+    }
+
+    if (mean != NULL) {
+        *mean = (double)total/(4*num_pixels);
+    }
+    return res;
+}
+
+// Checks the fixed point division of blur_kernel_init() for every sum a
+// kernel of radius _r_ can produce.
+bool check_divide_by_area (double r)
+{
+    mem_pool_t pool = {0};
+    struct blur_kernel_t kernel;
+    blur_kernel_init (&pool, &kernel, r);
+
+    uint32_t area = 0, k;
+    for (k=0; k<kernel.size; k++) {
+        area += kernel.weights[k];
+    }
+
+    bool success = true;
+    int32_t c;
+    for (c=0; c<=255*(int32_t)area; c++) {
+        if (blur_divide_by_area (c, &kernel) != c/area) {
+            printf ("Error: radius %.1f divides %d by %u wrong.\n", r, c, area);
+            success = false;
+            break;
+        }
+    }
+    mem_pool_destroy (&pool);
+    return success;
+}
+
+// Compares every implementation against the naive blur on an image filled
+// with _color_.
+bool check_uniform (uint32_t width, uint32_t height, double r, uint32_t color)
+{
+    uint32_t num_pixels = width*height;
+    uint32_t *expected = malloc (num_pixels*sizeof(uint32_t));
+    uint32_t *result = malloc (num_pixels*sizeof(uint32_t));
+    uint32_t i;
+    for (i=0; i<num_pixels; i++) {
+        expected[i] = color;
+    }
+    blur_naive (expected, width, height, r);
+
+    bool success = true;
+    enum blur_impl_t impl;
+    for (impl=BLUR_IMPL_SCALAR; impl<NUM_BLUR_IMPL; impl++) {
+        if (!blur_impl_supported (impl)) {
+            continue;
+        }
+
+        for (i=0; i<num_pixels; i++) {
+            result[i] = color;
+        }
+        gaussian_blur_argb32_full (result, width, height, width, r, impl);
+        if (memcmp (expected, result, num_pixels*sizeof(uint32_t)) != 0) {
+            printf ("Error: %s differs from naive on a uniform 0x%08X image, radius %.1f.\n",
+                    blur_impl_names[impl], color, r);
+            success = false;
+        }
+    }
+
+    // The center is farther than the radius from transparent pixels outside.
+    uint32_t center = result[(height/2)*width + width/2];
+    if ((color >> 24) == 0xFF && 2*r < MIN (width, height)/2 && center != color) {
+        printf ("Error: center of a uniform 0x%08X image became 0x%08X, radius %.1f.\n",
+                color, center, r);
+        success = false;
+    }
+
+    free (expected);
+    free (result);
+    return success;
+}
+
+// Blurs an image whose rows have padding at the end with blur_argb32() and
+// with blur_argb32_parallel(), the results must be equal, padding included.
+bool check_parallel (struct work_queue_t *wq, uint32_t width, uint32_t height,
+                     double r, enum blur_mode_t mode)
+{
+    uint32_t stride = width + 3;
+    uint32_t num_pixels = stride*height;
+    uint32_t *serial = malloc (num_pixels*sizeof(uint32_t));
+    uint32_t *parallel = malloc (num_pixels*sizeof(uint32_t));
+    fill_test_image (serial, stride, height);
+    memcpy (parallel, serial, num_pixels*sizeof(uint32_t));
+
+    blur_argb32 (serial, width, height, stride, r, mode);
+    blur_argb32_parallel (wq, parallel, width, height, stride, r, mode);
+
+    bool success = true;
+    if (memcmp (serial, parallel, num_pixels*sizeof(uint32_t)) != 0) {
+        printf ("Error: parallel %s blur differs from the serial one, %" PRIu32 "x%" PRIu32
+                " image, radius %.1f.\n", blur_mode_names[mode], width, height, r);
+        success = false;
+    }
+
+    free (serial);
+    free (parallel);
+    return success;
+}
+
+#define MPMC_PRODUCERS 4
+#define MPMC_CONSUMERS 4
+#define MPMC_JOBS_PER_PRODUCER 200000
+#define MPMC_NUM_JOBS (MPMC_PRODUCERS*MPMC_JOBS_PER_PRODUCER)
+
+struct mpmc_check_t {
+    struct work_queue_t *wq;
+    uint32_t *times_popped; // Indexed by job id
+    uint32_t num_popped;
+};
+
+struct mpmc_producer_t {
+    struct mpmc_check_t *check;
+    uint32_t first_id;
+};
+
+// NOTE: Jobs are never run, the job id is stored in the data pointer.
+void* mpmc_producer (void *arg)
+{
+    struct mpmc_producer_t *producer = (struct mpmc_producer_t*)arg;
+    uint32_t i;
+    for (i=0; i<MPMC_JOBS_PER_PRODUCER; i++) {
+        struct job_t job = {NULL, (void*)(uintptr_t)(producer->first_id + i), NULL};
+        while (!work_queue_try_push (producer->check->wq, &job)) {
+            sched_yield ();
+        }
+    }
+    return NULL;
+}
+
+void* mpmc_consumer (void *arg)
+{
+    struct mpmc_check_t *check = (struct mpmc_check_t*)arg;
+    while (__atomic_load_n (&check->num_popped, __ATOMIC_RELAXED) < MPMC_NUM_JOBS) {
+        struct job_t job;
+        if (work_queue_try_pop (check->wq, &job)) {
+            uint32_t id = (uintptr_t)job.data;
+            __atomic_add_fetch (&check->times_popped[id], 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch (&check->num_popped, 1, __ATOMIC_RELAXED);
+        } else {
+            sched_yield ();
+        }
+    }
+    return NULL;
+}
+
+void count_job (mem_pool_t *scratch, void *data)
+{
+    __atomic_add_fetch ((uint32_t*)data, 1, __ATOMIC_RELAXED);
+}
+
+// Pushes and pops jobs on a queue without workers from several threads at
+// once, each job must be popped exactly once. Also checks the queue is FIFO,
+// how many jobs fit in it, and that work_queue_push() runs every job.
+bool check_work_queue (struct work_queue_t *workers)
+{
+    bool success = true;
+    static struct work_queue_t wq;
+    work_queue_init (&wq, 0);
+
+    uint32_t i;
+    struct job_t job = {0};
+    for (i=0; i<WORK_QUEUE_SIZE; i++) {
+        job.data = (void*)(uintptr_t)i;
+        if (!work_queue_try_push (&wq, &job)) {
+            printf ("Error: work queue was full after %" PRIu32 " jobs.\n", i);
+            success = false;
+            break;
+        }
+    }
+    if (work_queue_try_push (&wq, &job)) {
+        printf ("Error: pushed more than %d jobs to the work queue.\n", WORK_QUEUE_SIZE);
+        success = false;
+    }
+    for (i=0; i<WORK_QUEUE_SIZE; i++) {
+        if (!work_queue_try_pop (&wq, &job) || (uintptr_t)job.data != i) {
+            printf ("Error: work queue didn't pop jobs in the order they were pushed.\n");
+            success = false;
+            break;
+        }
+    }
+    if (work_queue_try_pop (&wq, &job)) {
+        printf ("Error: popped a job from an empty work queue.\n");
+        success = false;
+    }
+
+    struct mpmc_check_t check = {0};
+    check.wq = &wq;
+    check.times_popped = calloc (MPMC_NUM_JOBS, sizeof(uint32_t));
+    pthread_t consumers[MPMC_CONSUMERS], producers[MPMC_PRODUCERS];
+    struct mpmc_producer_t producer_args[MPMC_PRODUCERS];
+    for (i=0; i<MPMC_CONSUMERS; i++) {
+        pthread_create (&consumers[i], NULL, mpmc_consumer, &check);
+    }
+    for (i=0; i<MPMC_PRODUCERS; i++) {
+        producer_args[i].check = &check;
+        producer_args[i].first_id = i*MPMC_JOBS_PER_PRODUCER;
+        pthread_create (&producers[i], NULL, mpmc_producer, &producer_args[i]);
+    }
+    for (i=0; i<MPMC_PRODUCERS; i++) {
+        pthread_join (producers[i], NULL);
+    }
+    for (i=0; i<MPMC_CONSUMERS; i++) {
+        pthread_join (consumers[i], NULL);
+    }
+
+    uint32_t num_wrong = 0;
+    for (i=0; i<MPMC_NUM_JOBS; i++) {
+        if (check.times_popped[i] != 1) {
+            num_wrong++;
+        }
+    }
+    if (num_wrong > 0 || check.num_popped != MPMC_NUM_JOBS || work_queue_try_pop (&wq, &job)) {
+        printf ("Error: %" PRIu32 " of %d jobs weren't popped exactly once, %" PRIu32 " pops.\n",
+                num_wrong, MPMC_NUM_JOBS, check.num_popped);
+        success = false;
+    }
+    free (check.times_popped);
+    work_queue_destroy (&wq);
+
+    uint32_t num_run = 0;
+    struct job_group_t group = {0};
+    for (i=0; i<MPMC_NUM_JOBS; i++) {
+        work_queue_push (workers, &group, count_job, &num_run);
+    }
+    job_group_wait (&group);
+    if (num_run != MPMC_NUM_JOBS) {
+        printf ("Error: workers ran %" PRIu32 " of %d jobs.\n", num_run, MPMC_NUM_JOBS);
+        success = false;
+    }
+
+    printf ("Work queue: %d jobs from %d producers to %d consumers, %d jobs run by %d workers.\n",
+            MPMC_NUM_JOBS, MPMC_PRODUCERS, MPMC_CONSUMERS, MPMC_NUM_JOBS, workers->num_workers);
+    return success;
+}
+
+double time_ms (struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec)*1000.0 + (double)(end->tv_nsec - start->tv_nsec)/1e6;
+}
+
+// Rasterizes a rounded box like a shadow mask with 4x4 samples per pixel. If
+// _inset_ is true the box is a hole in an opaque image.
+void fill_rounded_box (uint32_t *pixels, uint32_t width, uint32_t height,
+                       double box_x, double box_y, double box_w, double box_h, double r,
+                       bool inset)
+{
+    uint32_t x, y;
+    for (y=0; y<height; y++) {
+        for (x=0; x<width; x++) {
+            uint32_t covered = 0;
+            int i, j;
+            for (i=0; i<4; i++) {
+                for (j=0; j<4; j++) {
+                    double p_x = x + (j + 0.5)/4 - box_x;
+                    double p_y = y + (i + 0.5)/4 - box_y;
+                    if (p_x < 0 || p_x > box_w || p_y < 0 || p_y > box_h) {
+                        continue;
+                    }
+
+                    double d_x = MAX (r - p_x, p_x - (box_w - r));
+                    double d_y = MAX (r - p_y, p_y - (box_h - r));
+                    if (d_x > 0 && d_y > 0 && d_x*d_x + d_y*d_y > r*r) {
+                        continue;
+                    }
+                    covered++;
+                }
+            }
+
+            uint32_t alpha = (inset ? 16 - covered : covered)*255/16;
+            pixels[y*width + x] = alpha << 24 | (alpha/2) << 8;
+        }
+    }
+}
+
+// Renders a shadow like draw_outset_shadows() or draw_inset_shadows() do, but
+// with the rasterizer above. If _nine_slice_ is true the template is rendered
+// and expanded into _pixels_, _tmp_ must be big enough for it.
+void render_shadow (uint32_t *pixels, uint32_t *tmp, double box_w, double box_h,
+                    double radius, double blur_r, bool inset, bool nine_slice)
+{
+    // NOTE: For inset shadows, the hole is a box offset by 3 pixels and 2
+    // pixels smaller at each side than the image, like a spread of 2.
+    uint32_t width = box_w + 2*blur_r;
+    uint32_t height = box_h + 2*blur_r;
+    double shape_x = inset ? blur_r + 5 : blur_r;
+    double shape_y = inset ? blur_r + 5 : blur_r;
+    double shape_w = inset ? box_w - 4 : box_w;
+    double shape_h = inset ? box_h - 4 : box_h;
+    double shape_r = inset ? LOW_CLAMP (radius - 2, 0) : radius;
+
+    if (!nine_slice) {
+        fill_rounded_box (pixels, width, height, shape_x, shape_y, shape_w, shape_h, shape_r, inset);
+        blur_argb32 (pixels, width, height, width, blur_r, BLUR_MODE_AUTO);
+        return;
+    }
+
+    uint32_t support = blur_support (blur_r, BLUR_MODE_AUTO);
+    struct nine_slice_axis_t x_axis, y_axis;
+    nine_slice_axis (width, shape_x, shape_w, shape_r, support, &x_axis);
+    nine_slice_axis (height, shape_y, shape_h, shape_r, support, &y_axis);
+
+    fill_rounded_box (tmp, x_axis.tpl_size, y_axis.tpl_size, shape_x, shape_y,
+                      shape_w - x_axis.removed, shape_h - y_axis.removed, shape_r, inset);
+    blur_argb32 (tmp, x_axis.tpl_size, y_axis.tpl_size, x_axis.tpl_size, blur_r, BLUR_MODE_AUTO);
+    nine_slice_expand_argb32 (tmp, x_axis.tpl_size, &x_axis, &y_axis, pixels, width);
+}
+
+// Times the rendering of a shadow with and without nine slices and checks they
+// match. Returns false if they don't.
+bool check_nine_slice (double box_w, double box_h, double radius, double blur_r,
+                       bool inset, uint32_t iterations)
+{
+    uint32_t num_pixels = (uint32_t)(box_w + 2*blur_r)*(uint32_t)(box_h + 2*blur_r);
+    uint32_t *expected = malloc (num_pixels*sizeof(uint32_t));
+    uint32_t *result = malloc (num_pixels*sizeof(uint32_t));
+    uint32_t *tmp = malloc (num_pixels*sizeof(uint32_t));
+
+    struct timespec start, end;
+    double ms[2];
+    int nine_slice;
+    for (nine_slice=0; nine_slice<2; nine_slice++) {
+        clock_gettime (CLOCK_MONOTONIC, &start);
+        uint32_t it;
+        for (it=0; it<iterations; it++) {
+            render_shadow (nine_slice ? result : expected, tmp,
+                           box_w, box_h, radius, blur_r, inset, nine_slice);
+        }
+        clock_gettime (CLOCK_MONOTONIC, &end);
+        ms[nine_slice] = time_ms (&start, &end)/iterations;
+    }
+
+    uint32_t diff = max_channel_diff (expected, result, num_pixels, NULL);
+    char size[32];
+    snprintf (size, ARRAY_SIZE(size), "%.1fx%.1f", box_w, box_h);
+    printf ("%-6s %14s %8.1f %8.1f %10.3f %10.3f %8.2fx %9" PRIu32 "\n",
+            inset ? "inset" : "outset", size, radius, blur_r,
+            ms[0], ms[1], ms[0]/ms[1], diff);
+
+    free (expected);
+    free (result);
+    free (tmp);
+
+    if (diff != 0) {
+        printf ("Error: nine slice shadow differs from the full one.\n");
+        return false;
+    }
+    return true;
+}
+
+void print_usage ()
+{
+    printf ("Usage: blur_bench [-n ITERATIONS] [-s WIDTH HEIGHT] [RADIUS...]\n");
+}
+
+int main (int argc, char **argv)
+{
+    uint32_t iterations = 10;
+    uint32_t width = 400, height = 200;
+    double radii[32];
+    uint32_t num_radii = 0;
+
+    int i;
+    for (i=1; i<argc; i++) {
+        if (strcmp (argv[i], "-n") == 0 && i+1 < argc) {
+            iterations = strtoul (argv[++i], NULL, 10);
+        } else if (strcmp (argv[i], "-s") == 0 && i+2 < argc) {
+            width = strtoul (argv[++i], NULL, 10);
+            height = strtoul (argv[++i], NULL, 10);
+        } else if (argv[i][0] != '-' && num_radii < ARRAY_SIZE(radii)) {
+            radii[num_radii++] = strtod (argv[i], NULL);
+        } else {
+            print_usage ();
+            return 1;
+        }
+    }
+
+    if (iterations == 0 || width == 0 || height == 0) {
+        print_usage ();
+        return 1;
+    }
+
+    if (num_radii == 0) {
+        double default_radii[] = {1, 1.5, 2, 3, 4, 5, 7.5, 8, 16, 32, 64};
+        for (num_radii=0; num_radii<ARRAY_SIZE(default_radii); num_radii++) {
+            radii[num_radii] = default_radii[num_radii];
+        }
+    }
+
+    setup_clocks ();
+
+    uint32_t num_pixels = width*height;
+    uint32_t *original = malloc (num_pixels*sizeof(uint32_t));
+    uint32_t *expected = malloc (num_pixels*sizeof(uint32_t));
+    uint32_t *reference = malloc (num_pixels*sizeof(uint32_t));
+    uint32_t *result = malloc (num_pixels*sizeof(uint32_t));
+    fill_test_image (original, width, height);
+
+    bool success = true;
+    printf ("Image: %" PRIu32 "x%" PRIu32 ", Iterations: %" PRIu32 "\n", width, height, iterations);
+    printf ("%8s %-12s %12s %9s %9s\n", "radius", "impl", "ms/blur", "speedup", "max diff");
+
+    uint32_t r_idx;
+    for (r_idx=0; r_idx<num_radii; r_idx++) {
+        double r = radii[r_idx];
+        struct timespec start, end;
+
+        clock_gettime (CLOCK_MONOTONIC, &start);
+        uint32_t it;
+        for (it=0; it<iterations; it++) {
+            memcpy (expected, original, num_pixels*sizeof(uint32_t));
+            blur_naive (expected, width, height, r);
+        }
+        clock_gettime (CLOCK_MONOTONIC, &end);
+        double naive_ms = time_ms (&start, &end)/iterations;
+        printf ("%8.1f %-12s %12.3f %9s %9s\n", r, "naive", naive_ms, "1.00x", "-");
+
+        bool have_reference = false;
+        enum blur_impl_t impl;
+        for (impl=BLUR_IMPL_SCALAR; impl<NUM_BLUR_IMPL; impl++) {
+            if (!blur_impl_supported (impl)) {
+                printf ("%8.1f %-12s %12s\n", r, blur_impl_names[impl], "unsupported");
+                continue;
+            }
+
+            clock_gettime (CLOCK_MONOTONIC, &start);
+            for (it=0; it<iterations; it++) {
+                memcpy (result, original, num_pixels*sizeof(uint32_t));
+                gaussian_blur_argb32_full (result, width, height, width, r, impl);
+            }
+            clock_gettime (CLOCK_MONOTONIC, &end);
+            double impl_ms = time_ms (&start, &end)/iterations;
+
+            uint32_t diff = max_channel_diff (expected, result, num_pixels, NULL);
+            printf ("%8.1f %-12s %12.3f %8.2fx %9" PRIu32 "\n", r, blur_impl_names[impl],
+                    impl_ms, naive_ms/impl_ms, diff);
+
+            if (diff != 0) {
+                printf ("Error: %s result differs from naive.\n", blur_impl_names[impl]);
+                success = false;
+            }
+
+            if (!have_reference) {
+                memcpy (reference, result, num_pixels*sizeof(uint32_t));
+                have_reference = true;
+            } else if (memcmp (reference, result, num_pixels*sizeof(uint32_t)) != 0) {
+                printf ("Error: %s result differs from %s.\n",
+                        blur_impl_names[impl], blur_impl_names[BLUR_IMPL_SCALAR]);
+                success = false;
+            }
+        }
+
+        // The box blur only has scalar and SSE2 implementations.
+        for (impl=BLUR_IMPL_SCALAR; impl<=BLUR_IMPL_SSE2; impl++) {
+            if (!blur_impl_supported (impl)) {
+                continue;
+            }
+
+            clock_gettime (CLOCK_MONOTONIC, &start);
+            for (it=0; it<iterations; it++) {
+                memcpy (result, original, num_pixels*sizeof(uint32_t));
+                box3_blur_argb32_full (result, width, height, width, r, impl);
+            }
+            clock_gettime (CLOCK_MONOTONIC, &end);
+            double box3_ms = time_ms (&start, &end)/iterations;
+
+            double mean_diff;
+            uint32_t box3_diff = max_channel_diff (reference, result, num_pixels, &mean_diff);
+            char name[32];
+            snprintf (name, ARRAY_SIZE(name), "%s %s", blur_mode_names[BLUR_MODE_BOX3], blur_impl_names[impl]);
+            printf ("%8.1f %-12s %12.3f %8.2fx %9" PRIu32 " (mean %.3f)\n", r, name,
+                    box3_ms, naive_ms/box3_ms, box3_diff, mean_diff);
+
+            if (r >= BOX3_MIN_RADIUS && box3_diff > BOX3_MAX_ERROR) {
+                printf ("Error: box blur differs by more than %d from the gaussian.\n", BOX3_MAX_ERROR);
+                success = false;
+            }
+        }
+    }
+
+    uint32_t colors[] = {0xFFFFFFFF, 0xFF000000, 0x80402010};
+    for (r_idx=0; r_idx<num_radii; r_idx++) {
+        success = check_divide_by_area (radii[r_idx]) && success;
+
+        uint32_t c_idx;
+        for (c_idx=0; c_idx<ARRAY_SIZE(colors); c_idx++) {
+            success = check_uniform (64, 64, radii[r_idx], colors[c_idx]) && success;
+        }
+    }
+
+    static struct work_queue_t wq;
+    work_queue_init (&wq, work_queue_default_num_workers ());
+    uint32_t parallel_sizes[][2] = {{1, 1}, {7, 300}, {257, 255}, {640, 480}, {1023, 17}};
+    uint32_t p_idx;
+    for (p_idx=0; p_idx<ARRAY_SIZE(parallel_sizes); p_idx++) {
+        for (r_idx=0; r_idx<num_radii; r_idx++) {
+            enum blur_mode_t mode;
+            for (mode=BLUR_MODE_AUTO; mode<NUM_BLUR_MODES; mode++) {
+                success = check_parallel (&wq, parallel_sizes[p_idx][0], parallel_sizes[p_idx][1],
+                                          radii[r_idx], mode) && success;
+            }
+        }
+    }
+    success = check_work_queue (&wq) && success;
+    work_queue_destroy (&wq);
+
+    printf ("\n%-6s %14s %8s %8s %10s %10s %9s %9s\n", "shadow", "box", "radius", "blur",
+            "full ms", "9-slice ms", "speedup", "max diff");
+    double box_sizes[][2] = {{50, 24}, {300.5, 40.25}, {2000, 60}, {2000, 1200}};
+    uint32_t s_idx;
+    for (s_idx=0; s_idx<ARRAY_SIZE(box_sizes); s_idx++) {
+        for (r_idx=0; r_idx<num_radii; r_idx++) {
+            int inset;
+            for (inset=0; inset<2; inset++) {
+                success = check_nine_slice (box_sizes[s_idx][0], box_sizes[s_idx][1], 6,
+                                            radii[r_idx], inset, iterations) && success;
+            }
+        }
+    }
+
+    free (original);
+    free (expected);
+    free (reference);
+    free (result);
+    return success ? 0 : 1;
+}
@@ -0,0 +1,1059 @@
+/*
+ * Copyright (C) 2018 Santiago León O. <santileortiz@gmail.com>
+ */
+
+#if !defined(CLOSET_H)
+// Geometry model of a closet. A closet is built by pushing holes next to
+// existing ones, holes are surrounded by separators, and each separator is
+// made of one or more cuboid parts.
+//
+// NOTE: Nothing here depends on GL, X11 or cairo so it can be used from
+// headless tools like closet_bench.c.
+
+enum faces_t {
+    RIGHT_FACE, //  X
+    LEFT_FACE,  // -X
+    UP_FACE,    //  Y
+    DOWN_FACE,  // -Y
+    FRONT_FACE, //  Z
+    BACK_FACE   // -Z
+};
+
+static inline
+enum faces_t opposite_face (enum faces_t face)
+{
+    if (face % 2 == 0) {
+        return face + 1;
+    } else {
+        return face - 1;
+    }
+}
+
+// NOTE: Naming is based on the first letter of the 3 faces that contain the
+// vertex in XYZ order.
+// NOTE: Ordering is lexicographic assuming it's a unit cube with LDB point
+// located at (0,0,0). Then coordinates in binary are ordered lexicographically.
+
+enum cube_vertices_t {
+    LDB, // 000
+    LDF, // 001
+    LUB, // 010
+    LUF, // 011
+    RDB, // 100
+    RDF, // 101
+    RUB, // 110
+    RUF  // 111
+};
+
+#define VERT_FACE_X(vert) ((vert&0x4)?RIGHT_FACE:LEFT_FACE)
+#define VERT_FACE_Y(vert) ((vert&0x2)?UP_FACE:DOWN_FACE)
+#define VERT_FACE_Z(vert) ((vert&0x1)?FRONT_FACE:BACK_FACE)
+
+struct cuboid_t {
+    fvec3 v[8];
+};
+
+#define UNIT_CUBE (struct cuboid_t){{\
+                    FVEC3(-1,-1,-1), \
+                    FVEC3(-1,-1, 1), \
+                    FVEC3(-1, 1,-1), \
+                    FVEC3(-1, 1, 1), \
+                    FVEC3( 1,-1,-1), \
+                    FVEC3( 1,-1, 1), \
+                    FVEC3( 1, 1,-1), \
+                    FVEC3( 1, 1, 1), \
+                   }}
+
+#define CUBOID_SIZE_X(c) ((c).v[4].x - (c).v[0].x)
+#define CUBOID_SIZE_Y(c) ((c).v[2].y - (c).v[0].y)
+#define CUBOID_SIZE_Z(c) ((c).v[1].z - (c).v[0].z)
+
+void cuboid_init (fvec3 dim, struct cuboid_t *res)
+{
+    *res = UNIT_CUBE;
+
+    int i;
+    for (i=0; i<8; i++) {
+        res->v[i].x = res->v[i].x * dim.x/2;
+        res->v[i].y = res->v[i].y * dim.y/2;
+        res->v[i].z = res->v[i].z * dim.z/2;
+    }
+}
+
+void cuboid_init_anchored (fvec3 dim,
+                           enum cube_vertices_t anchor_id, fvec3 anchor_pos,
+                           struct cuboid_t *res)
+{
+    *res = UNIT_CUBE;
+
+    fvec3 new_anchor = res->v[anchor_id];
+    new_anchor.x *= dim.x/2;
+    new_anchor.y *= dim.y/2;
+    new_anchor.z *= dim.z/2;
+
+    fvec3 disp = fvec3_subs (anchor_pos, new_anchor);
+
+    int i;
+    for (i=0; i<8; i++) {
+        res->v[i].x = res->v[i].x * dim.x/2 + disp.x;
+        res->v[i].y = res->v[i].y * dim.y/2 + disp.y;
+        res->v[i].z = res->v[i].z * dim.z/2 + disp.z;
+    }
+}
+
+void cuboid_print (struct cuboid_t *cb)
+{
+    int i;
+    for (i=0; i<8; i++) {
+        fvec3_print (cb->v[i]);
+    }
+}
+
+static inline
+float cuboid_face_coord (struct cuboid_t c, enum faces_t face)
+{
+    float res;
+    switch (face) {
+        case RIGHT_FACE:
+            res = c.v[7].x;
+            break;
+        case LEFT_FACE:
+            res = c.v[0].x;
+            break;
+        case UP_FACE:
+            res = c.v[7].y;
+            break;
+        case DOWN_FACE:
+            res = c.v[0].y;
+            break;
+        case BACK_FACE:
+            res = c.v[7].z;
+            break;
+        case FRONT_FACE:
+            res = c.v[0].z;
+            break;
+    }
+    return res;
+}
+
+static inline
+void face_vert_ids (enum faces_t face, uint8_t *face_ids, uint8_t *opposite_face_ids)
+{
+    uint8_t mask;
+    uint8_t axis_1_cnt = 0;
+    uint8_t *axis_1 = face_ids;
+    uint8_t axis_0_cnt = 0;
+    uint8_t *axis_0 = opposite_face_ids;
+
+    switch (face) {
+        case LEFT_FACE:
+            axis_0 = face_ids;
+            axis_1 = opposite_face_ids;
+        case RIGHT_FACE:
+            mask = 0x4;
+            break;
+
+        case DOWN_FACE:
+            axis_0 = face_ids;
+            axis_1 = opposite_face_ids;
+        case UP_FACE:
+            mask = 0x2;
+            break;
+
+        case BACK_FACE:
+            axis_0 = face_ids;
+            axis_1 = opposite_face_ids;
+        case FRONT_FACE:
+            mask = 0x1;
+            break;
+    }
+
+    uint8_t i;
+    for (i=0; i<8; i++) {
+        if (i & mask) {
+            if (axis_1 != NULL) {
+                axis_1[axis_1_cnt] = i;
+                axis_1_cnt++;
+            }
+        } else {
+            if (axis_0 != NULL) {
+                axis_0[axis_0_cnt] = i;
+                axis_0_cnt++;
+            }
+        }
+    }
+}
+
+#define CLOSET_MIN_ARRAY_SIZE 32
+#define DEFAULT_SEPARATION 0.025f
+
+struct relative_dimension_t {
+    uint32_t hole_id;
+    enum faces_t face;
+};
+
+// A hole's size in some axis can be specified in 3 ways:
+//
+//   DIM_DIRECT means we have a specific value.
+//
+//   DIM_COPY means we copy the size from the base hole.
+//
+//   DIM_RELATIVE means the moving face will match with a parallel face of
+//   another hole.
+
+enum dimension_type_t {
+    DIMENSION_DIRECT,
+    DIMENSION_COPY,
+    DIMENSION_RELATIVE
+};
+
+struct hole_dimension_t {
+    enum dimension_type_t type;
+    union {
+        float val;
+        struct relative_dimension_t rval;
+    };
+};
+
+#define DIM_F(n) (struct hole_dimension_t){DIMENSION_DIRECT,{n}}
+#define DIM_COPY (struct hole_dimension_t){DIMENSION_COPY,{0}}
+#define DIM_UNTIL(hole_id,face) (struct hole_dimension_t){DIMENSION_RELATIVE, \
+    {.rval = (struct relative_dimension_t){hole_id,face}}}
+
+struct hole_dimensions_t {
+    struct hole_dimension_t x;
+    struct hole_dimension_t y;
+    struct hole_dimension_t z;
+};
+
+#define HOLE_DIM_F(x,y,z) (struct hole_dimensions_t){DIM_F(x),DIM_F(y),DIM_F(z)}
+#define HOLE_DIM(x,y,z) (struct hole_dimensions_t){x,y,z}
+
+static inline
+fvec3 hole_dim_direct_to_fvec3 (struct hole_dimensions_t *dim)
+{
+    return FVEC3 (dim->x.val, dim->y.val, dim->z.val);
+}
+
+struct separator_part_t {
+    struct cuboid_t c;
+    fvec3 color;
+    bool dirty;
+};
+
+// NOTE: Holes, separators and separator parts are stored in arrays that grow
+// as needed, which means they can move in memory. References between them are
+// always done by index (id) and never by pointer.
+struct sep_part_list_t {
+    struct sep_part_list_t *next;
+    uint32_t part_id;
+};
+
+struct separator_t {
+    struct sep_part_list_t *parts;
+    float thickness;
+};
+
+struct hole_t {
+    struct cuboid_t h;
+    uint32_t separators[6];
+    bool dirty;
+};
+
+struct closet_t {
+    mem_pool_t pool; // Used for sep_part_list_t nodes, these never move.
+
+    uint32_t num_holes;
+    uint32_t size_holes;
+    struct hole_t *holes;
+
+    uint32_t num_seps;
+    uint32_t size_separators;
+    struct separator_t *separators;
+
+    uint32_t num_sep_parts;
+    uint32_t size_sep_parts;
+    struct separator_part_t *sep_parts;
+
+    // Ids of holes and separator parts that were created or modified since the
+    // last call to closet_clear_dirty(). Each id is listed at most once. These
+    // let the renderer update only what changed.
+    int_dyn_arr_t dirty_holes;
+    int_dyn_arr_t dirty_sep_parts;
+};
+
+static inline
+void closet_mark_hole_dirty (struct closet_t *cl, uint32_t id)
+{
+    if (!cl->holes[id].dirty) {
+        cl->holes[id].dirty = true;
+        int_dyn_arr_append (&cl->dirty_holes, id);
+    }
+}
+
+static inline
+void closet_mark_sep_part_dirty (struct closet_t *cl, uint32_t id)
+{
+    if (!cl->sep_parts[id].dirty) {
+        cl->sep_parts[id].dirty = true;
+        int_dyn_arr_append (&cl->dirty_sep_parts, id);
+    }
+}
+
+void closet_clear_dirty (struct closet_t *cl)
+{
+    uint32_t i;
+    for (i=0; i<cl->dirty_holes.len; i++) {
+        cl->holes[cl->dirty_holes.data[i]].dirty = false;
+    }
+    cl->dirty_holes.len = 0;
+
+    for (i=0; i<cl->dirty_sep_parts.len; i++) {
+        cl->sep_parts[cl->dirty_sep_parts.data[i]].dirty = false;
+    }
+    cl->dirty_sep_parts.len = 0;
+}
+
+// Makes sure _arr_ has space for at least one more element of size e_size. The
+// array's size is doubled when it's full, so pushing n elements costs amortized
+// O(1) per element.
+//
+// NOTE: The returned array may be at a different address than _arr_.
+void* closet_array_maybe_grow (void *arr, uint32_t len, uint32_t *size, size_t e_size)
+{
+    if (len < *size) {
+        return arr;
+    }
+
+    uint32_t new_size = MAX (CLOSET_MIN_ARRAY_SIZE, 2*(*size));
+    void *new_arr = realloc (arr, new_size*e_size);
+    if (new_arr == NULL) {
+        printf ("Error: Realloc failed.\n");
+        return arr;
+    }
+
+    *size = new_size;
+    return new_arr;
+}
+
+// NOTE: Pointers into cl->sep_parts are invalidated by this.
+uint32_t next_sep_part (struct closet_t *cl)
+{
+    cl->sep_parts = closet_array_maybe_grow (cl->sep_parts, cl->num_sep_parts,
+                                             &cl->size_sep_parts, sizeof(struct separator_part_t));
+    assert (cl->num_sep_parts < cl->size_sep_parts);
+
+    uint32_t id = cl->num_sep_parts++;
+    cl->sep_parts[id].color = FVEC3 (1, 1, 0);
+    cl->sep_parts[id].dirty = false;
+    closet_mark_sep_part_dirty (cl, id);
+    return id;
+}
+
+// NOTE: Pointers into cl->separators are invalidated by this.
+uint32_t next_separator (struct closet_t *cl)
+{
+    cl->separators = closet_array_maybe_grow (cl->separators, cl->num_seps,
+                                              &cl->size_separators, sizeof(struct separator_t));
+    assert (cl->num_seps < cl->size_separators);
+    return cl->num_seps++;
+}
+
+// NOTE: Pointers into cl->holes are invalidated by this.
+uint32_t next_hole (struct closet_t *cl)
+{
+    cl->holes = closet_array_maybe_grow (cl->holes, cl->num_holes,
+                                         &cl->size_holes, sizeof(struct hole_t));
+    assert (cl->num_holes < cl->size_holes);
+
+    uint32_t id = cl->num_holes++;
+    cl->holes[id].dirty = false;
+    closet_mark_hole_dirty (cl, id);
+    return id;
+}
+
+void compute_face_separator_part (struct cuboid_t *base, enum faces_t face,
+                                  struct cuboid_t *res, float thickness)
+{
+    uint8_t face_v[4];
+    uint8_t opposite_face_v[4];
+    face_vert_ids (face, face_v, opposite_face_v);
+
+    int i;
+    for (i=0; i<4; i++) {
+        res->v[face_v[i]] = res->v[opposite_face_v[i]] = base->v[face_v[i]];
+    }
+
+    uint8_t axis_idx;
+    switch (face) {
+        case LEFT_FACE:
+            thickness = -thickness;
+        case RIGHT_FACE:
+            axis_idx = 0;
+            break;
+
+        case DOWN_FACE:
+            thickness = -thickness;
+        case UP_FACE:
+            axis_idx = 1;
+            break;
+
+        case BACK_FACE:
+            thickness = -thickness;
+        case FRONT_FACE:
+            axis_idx = 2;
+            break;
+    }
+
+    for (i=0; i<4; i++) {
+        res->v[face_v[i]].E[axis_idx] += thickness;
+    }
+}
+
+// NOTE: These functions don't grow cl->holes so _hole_ can be a pointer into it.
+void set_new_separator (struct closet_t *cl, struct hole_t *hole, enum faces_t face, float thickness)
+{
+    uint32_t sep_id = next_separator (cl);
+    struct separator_t *new_sep = &cl->separators[sep_id];
+    new_sep->thickness = thickness;
+    hole->separators[face] = sep_id;
+
+    uint32_t part_id = next_sep_part (cl);
+    compute_face_separator_part (&hole->h, face, &cl->sep_parts[part_id].c, thickness);
+
+    struct sep_part_list_t *list_node = mem_pool_push_size (&cl->pool, sizeof(struct sep_part_list_t));
+    new_sep->parts = list_node;
+    list_node->part_id = part_id;
+    list_node->next = NULL;
+}
+
+void extend_separator (struct closet_t *cl, struct hole_t *hole, enum faces_t face, uint32_t sep_id)
+{
+    struct separator_t *sep = &cl->separators[sep_id];
+    uint32_t part_id = next_sep_part (cl);
+    compute_face_separator_part (&hole->h, face, &cl->sep_parts[part_id].c, sep->thickness);
+    hole->separators[face] = sep_id;
+
+    struct sep_part_list_t *list_node = mem_pool_push_size (&cl->pool, sizeof(struct sep_part_list_t));
+    list_node->part_id = part_id;
+    list_node->next = sep->parts;
+    sep->parts = list_node;
+}
+
+static inline
+void color_separator (struct closet_t *cl, uint32_t sep_id, fvec3 color)
+{
+    struct sep_part_list_t *curr_list_node = cl->separators[sep_id].parts;
+    while (curr_list_node != NULL) {
+        cl->sep_parts[curr_list_node->part_id].color = color;
+        closet_mark_sep_part_dirty (cl, curr_list_node->part_id);
+        curr_list_node = curr_list_node->next;
+    }
+}
+
+struct closet_t new_closet (struct hole_dimensions_t *dim)
+{
+    assert (dim->x.type == DIMENSION_DIRECT &&
+            dim->y.type == DIMENSION_DIRECT &&
+            dim->z.type == DIMENSION_DIRECT);
+
+    struct closet_t res = {0};
+
+    fvec3 hole_size = hole_dim_direct_to_fvec3 (dim);
+    uint32_t new_hole_id = next_hole (&res);
+    struct hole_t *new_hole = &res.holes[new_hole_id];
+    cuboid_init (hole_size, &new_hole->h);
+
+    set_new_separator (&res, new_hole, UP_FACE, DEFAULT_SEPARATION);
+    set_new_separator (&res, new_hole, DOWN_FACE, DEFAULT_SEPARATION);
+    set_new_separator (&res, new_hole, RIGHT_FACE, DEFAULT_SEPARATION);
+    set_new_separator (&res, new_hole, LEFT_FACE, DEFAULT_SEPARATION);
+    set_new_separator (&res, new_hole, FRONT_FACE, DEFAULT_SEPARATION);
+    set_new_separator (&res, new_hole, BACK_FACE, DEFAULT_SEPARATION);
+
+    return res;
+}
+
+void closet_destroy (struct closet_t *cl)
+{
+    free (cl->holes);
+    free (cl->separators);
+    free (cl->sep_parts);
+    int_dyn_arr_destroy (&cl->dirty_holes);
+    int_dyn_arr_destroy (&cl->dirty_sep_parts);
+    mem_pool_destroy (&cl->pool);
+    *cl = ZERO_INIT(struct closet_t);
+}
+
+// Returns the vertex of the hole built by push_hole() that is opposite to its
+// anchor. Relative dimensions must extend until a face that is parallel to one
+// of the faces containing it, and on the same side.
+enum cube_vertices_t push_hole_moving_vertex (enum faces_t face, enum cube_vertices_t base_anchor_id)
+{
+    // NOTE: push_hole() moves the anchor into _face_ of the base hole, which is
+    // the opposite face of the new one. The moving vertex ends up on the _face_
+    // side, and on the other axes it's opposite to the anchor.
+    int axis_bit = 0x4 >> (face/2);
+    enum cube_vertices_t res = base_anchor_id ^ 0x7;
+    if (face % 2 == 0) {
+        res |= axis_bit;
+    } else {
+        res &= ~axis_bit;
+    }
+    return res;
+}
+
+void push_hole (struct closet_t *cl,
+                struct hole_dimensions_t *dim, uint32_t base_id,
+                enum faces_t face, enum cube_vertices_t base_anchor_id,
+                float separation)
+{
+    assert (cl->num_holes > 0);
+    assert (base_id < cl->num_holes);
+
+    struct cuboid_t *base_hole_cuboid = &cl->holes[base_id].h;
+
+    // Ensure the base_anchor_id is in the face received as argument. If it's
+    // not we choose the closest vertex that is in it.
+    switch (face) {
+        case RIGHT_FACE:
+            base_anchor_id |= 0x4;
+            break;
+        case LEFT_FACE:
+            base_anchor_id &= ~0x4;
+            break;
+        case UP_FACE:
+            base_anchor_id |= 0x2;
+            break;
+        case DOWN_FACE:
+            base_anchor_id &= ~0x2;
+            break;
+        case FRONT_FACE:
+            base_anchor_id |= 0x1;
+            break;
+        case BACK_FACE:
+            base_anchor_id &= ~0x1;
+            break;
+    }
+
+    // Compute the position and id for the anchor vertex in the new cuboid
+    enum cube_vertices_t anchor_id = base_anchor_id;
+    fvec3 anchor_pos;
+    {
+        anchor_pos = base_hole_cuboid->v[anchor_id];
+        switch (face) {
+            case RIGHT_FACE:
+                anchor_pos.x += separation;
+                break;
+            case LEFT_FACE:
+                anchor_pos.x -= separation;
+                break;
+            case UP_FACE:
+                anchor_pos.y += separation;
+                break;
+            case DOWN_FACE:
+                anchor_pos.y -= separation;
+                break;
+            case FRONT_FACE:
+                anchor_pos.z += separation;
+                break;
+            case BACK_FACE:
+                anchor_pos.z -= separation;
+                break;
+            default:
+                invalid_code_path;
+        }
+
+        switch (face) {
+            case RIGHT_FACE:
+            case LEFT_FACE:
+                anchor_id = (anchor_id & ~0x04) | ((anchor_id ^ 0xFF) & 0x4);
+                break;
+            case UP_FACE:
+            case DOWN_FACE:
+                anchor_id = (anchor_id & ~0x02) | ((anchor_id ^ 0xFF) & 0x2);
+                break;
+            case FRONT_FACE:
+            case BACK_FACE:
+                anchor_id = (anchor_id & ~0x01) | ((anchor_id ^ 0xFF) & 0x1);
+                break;
+            default:
+                invalid_code_path;
+        }
+    }
+
+    // Compute the size of the new hole
+    fvec3 dim_vec = FVEC3(0,0,0);
+    enum cube_vertices_t moving_vertex_id = anchor_id^0x7;
+    {
+
+        switch (dim->x.type) {
+            case DIMENSION_DIRECT:
+                dim_vec.x = dim->x.val;
+                break;
+            case DIMENSION_COPY:
+                dim_vec.x = CUBOID_SIZE_X (*base_hole_cuboid);
+                break;
+            case DIMENSION_RELATIVE:
+                {
+                    struct relative_dimension_t rval = dim->x.rval;
+                    if (VERT_FACE_X(moving_vertex_id) == rval.face) {
+                        float face_coord = cuboid_face_coord (cl->holes[rval.hole_id].h, rval.face);
+                        dim_vec.x = fabs (anchor_pos.x - face_coord);
+                    } else {
+                        printf ("Invalid face for relative dimension.\n");
+                    }
+                } break;
+                break;
+            default:
+                invalid_code_path;
+        }
+
+        switch (dim->y.type) {
+            case DIMENSION_DIRECT:
+                dim_vec.y = dim->y.val;
+                break;
+            case DIMENSION_COPY:
+                dim_vec.y = CUBOID_SIZE_Y (*base_hole_cuboid);
+                break;
+            case DIMENSION_RELATIVE:
+                {
+                    struct relative_dimension_t rval = dim->y.rval;
+                    if (VERT_FACE_Y(moving_vertex_id) == rval.face) {
+                        float face_coord = cuboid_face_coord (cl->holes[rval.hole_id].h, rval.face);
+                        dim_vec.y = fabs (anchor_pos.y - face_coord);
+                    } else {
+                        printf ("Invalid face for relative dimension.\n");
+                    }
+                } break;
+            default:
+                invalid_code_path;
+        }
+
+        switch (dim->z.type) {
+            case DIMENSION_DIRECT:
+                dim_vec.z = dim->z.val;
+                break;
+            case DIMENSION_COPY:
+                dim_vec.z = CUBOID_SIZE_Z (*base_hole_cuboid);
+                break;
+            case DIMENSION_RELATIVE:
+                {
+                    struct relative_dimension_t rval = dim->z.rval;
+                    if (VERT_FACE_Z(moving_vertex_id) == rval.face) {
+                        float face_coord = cuboid_face_coord (cl->holes[rval.hole_id].h, rval.face);
+                        dim_vec.z = fabs (anchor_pos.z - face_coord);
+                    } else {
+                        printf ("Invalid face for relative dimension.\n");
+                    }
+                } break;
+            default:
+                invalid_code_path;
+        }
+    }
+
+    // Compute new hole
+    // NOTE: next_hole() may move cl->holes, base_hole_cuboid is invalid after
+    // this point.
+    uint32_t new_hole_id = next_hole (cl);
+    struct hole_t *new_hole = &cl->holes[new_hole_id];
+    cuboid_init_anchored (dim_vec, anchor_id, anchor_pos, &new_hole->h);
+
+    // Resolve separators
+    struct hole_t *base_hole = &cl->holes[base_id];
+    new_hole->separators[opposite_face (face)] = base_hole->separators[face];
+
+    if (VERT_FACE_X(anchor_id) != opposite_face (face)) {
+        extend_separator (cl, new_hole, VERT_FACE_X(anchor_id), base_hole->separators[VERT_FACE_X(anchor_id)]);
+    }
+
+    if (VERT_FACE_Y(anchor_id) != opposite_face (face)) {
+        extend_separator (cl, new_hole, VERT_FACE_Y(anchor_id), base_hole->separators[VERT_FACE_Y(anchor_id)]);
+    }
+
+    if (VERT_FACE_Z(anchor_id) != opposite_face (face)) {
+        extend_separator (cl, new_hole, VERT_FACE_Z(anchor_id), base_hole->separators[VERT_FACE_Z(anchor_id)]);
+    }
+
+    if (VERT_FACE_X(moving_vertex_id) != face) {
+        switch (dim->x.type) {
+            case DIMENSION_DIRECT:
+                set_new_separator (cl, new_hole, VERT_FACE_X(moving_vertex_id), DEFAULT_SEPARATION);
+                break;
+            case DIMENSION_COPY:
+                extend_separator (cl, new_hole,
+                                  VERT_FACE_X(moving_vertex_id),
+                                  base_hole->separators[VERT_FACE_X(moving_vertex_id)]);
+                break;
+            case DIMENSION_RELATIVE:
+                {
+                    struct relative_dimension_t rval = dim->x.rval;
+                    uint32_t rel_sep = cl->holes[rval.hole_id].separators[rval.face];
+                    extend_separator (cl, new_hole, VERT_FACE_X(moving_vertex_id), rel_sep);
+                } break;
+            default:
+                invalid_code_path;
+        }
+    }
+
+    if (VERT_FACE_Y(moving_vertex_id) != face) {
+        switch (dim->y.type) {
+            case DIMENSION_DIRECT:
+                set_new_separator (cl, new_hole, VERT_FACE_Y(moving_vertex_id), DEFAULT_SEPARATION);
+                break;
+            case DIMENSION_COPY:
+                extend_separator (cl, new_hole,
+                                  VERT_FACE_Y(moving_vertex_id),
+                                  base_hole->separators[VERT_FACE_Y(moving_vertex_id)]);
+                break;
+            case DIMENSION_RELATIVE:
+                {
+                    struct relative_dimension_t rval = dim->y.rval;
+                    uint32_t rel_sep = cl->holes[rval.hole_id].separators[rval.face];
+                    extend_separator (cl, new_hole, VERT_FACE_Y(moving_vertex_id), rel_sep);
+                } break;
+            default:
+                invalid_code_path;
+        }
+    }
+
+    if (VERT_FACE_Z(moving_vertex_id) != face) {
+        switch (dim->z.type) {
+            case DIMENSION_DIRECT:
+                set_new_separator (cl, new_hole, VERT_FACE_Z(moving_vertex_id), DEFAULT_SEPARATION);
+                break;
+            case DIMENSION_COPY:
+                extend_separator (cl, new_hole,
+                                  VERT_FACE_Z(moving_vertex_id),
+                                  base_hole->separators[VERT_FACE_Z(moving_vertex_id)]);
+                break;
+            case DIMENSION_RELATIVE:
+                {
+                    struct relative_dimension_t rval = dim->z.rval;
+                    uint32_t rel_sep = cl->holes[rval.hole_id].separators[rval.face];
+                    extend_separator (cl, new_hole, VERT_FACE_Z(moving_vertex_id), rel_sep);
+                } break;
+            default:
+                invalid_code_path;
+        }
+    }
+
+    // TODO: What happens if the distance between the faces of new_hole parallel
+    // to face was set using relative dimensioning? Then the separator may
+    // already exist, in which case we want to use extend_separator() here.
+    set_new_separator (cl, new_hole, face, DEFAULT_SEPARATION);
+}
+
+// Memory used by the closet, counting the full capacity of the growable arrays.
+uint64_t closet_allocated (struct closet_t *cl)
+{
+    uint64_t res = mem_pool_allocated (&cl->pool);
+    res += (uint64_t)cl->size_holes*sizeof(struct hole_t);
+    res += (uint64_t)cl->size_separators*sizeof(struct separator_t);
+    res += (uint64_t)cl->size_sep_parts*sizeof(struct separator_part_t);
+    res += (uint64_t)(cl->dirty_holes.size + cl->dirty_sep_parts.size)*sizeof(int);
+    return res;
+}
+
+//////////////////////
+// CLOSET DESCRIPTIONS
+//
+// A closet description is a text representation of the sequence of calls to
+// new_closet() and push_hole() that build a closet. It has one command per
+// line, empty lines and text after a # are ignored:
+//
+//   closet <x> <y> <z>
+//   hole <base_id> <face> <anchor> <x> <y> <z> [separation]
+//
+// The first command must be 'closet', it creates hole 0. Each 'hole' command
+// creates the next hole id. Faces are right, left, up, down, front or back.
+// Anchors are vertex names from enum cube_vertices_t (LDB, LDF, ..., RUF). In
+// 'hole' commands, each of the <x> <y> <z> dimensions can be one of:
+//
+//   0.3           Direct size in meters.
+//   copy          Copy the size from the base hole.
+//   until:0:down  Extend until the face 'down' of hole 0. The face must be
+//                 on the same axis as the dimension, and on the side the new
+//                 hole grows towards from its anchor.
+//
+// For example, this is the closet built at startup by closet_maker:
+//
+//   closet 0.9 0.4 0.7
+//   hole 0 up RUF copy copy copy
+//   hole 1 right RUF 0.3 until:0:down copy
+
+struct closet_hole_cmd_t {
+    struct hole_dimensions_t dim;
+    uint32_t base_id;
+    enum faces_t face;
+    enum cube_vertices_t anchor;
+    float separation;
+};
+
+struct closet_description_t {
+    struct hole_dimensions_t size;
+
+    uint32_t num_holes;
+    uint32_t size_holes;
+    struct closet_hole_cmd_t *holes;
+};
+
+void closet_description_destroy (struct closet_description_t *desc)
+{
+    free (desc->holes);
+    *desc = ZERO_INIT(struct closet_description_t);
+}
+
+struct closet_hole_cmd_t* closet_description_push_hole (struct closet_description_t *desc)
+{
+    desc->holes = closet_array_maybe_grow (desc->holes, desc->num_holes,
+                                           &desc->size_holes, sizeof(struct closet_hole_cmd_t));
+    assert (desc->num_holes < desc->size_holes);
+
+    struct closet_hole_cmd_t *res = &desc->holes[desc->num_holes++];
+    *res = ZERO_INIT(struct closet_hole_cmd_t);
+    res->separation = DEFAULT_SEPARATION;
+    return res;
+}
+
+char *face_names[] = {"right", "left", "up", "down", "front", "back"};
+char *vertex_names[] = {"LDB", "LDF", "LUB", "LUF", "RDB", "RDF", "RUB", "RUF"};
+
+// Copies the next space separated token into _buff_. Returns a pointer to the
+// character after it, or NULL if there were no more tokens in the line.
+static inline
+char* closet_description_next_token (char *c, char *buff, size_t buff_size)
+{
+    c = consume_spaces (c);
+    if (*c == '\n' || *c == '\0') {
+        return NULL;
+    }
+
+    size_t len = 0;
+    while (*c && *c != '\n' && !is_space (c)) {
+        if (len < buff_size - 1) {
+            buff[len++] = *c;
+        }
+        c++;
+    }
+    buff[len] = '\0';
+    return c;
+}
+
+static inline
+bool closet_description_parse_name (char *tok, char **names, int num_names, int *res)
+{
+    int i;
+    for (i=0; i<num_names; i++) {
+        if (strcmp (tok, names[i]) == 0) {
+            *res = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline
+bool closet_description_parse_float (char *tok, float *res)
+{
+    char *end;
+    *res = strtof (tok, &end);
+    return *tok != '\0' && *end == '\0';
+}
+
+static inline
+bool closet_description_parse_uint (char *tok, uint32_t *res)
+{
+    char *end;
+    unsigned long val = strtoul (tok, &end, 10);
+    *res = val;
+    return *tok != '\0' && *end == '\0' && val <= UINT32_MAX;
+}
+
+// Returns true if there is nothing but spaces or a comment until the end of
+// the line.
+static inline
+bool closet_description_is_line_end (char *c)
+{
+    c = consume_spaces (c);
+    return is_end_of_line_or_file (c) || *c == '#';
+}
+
+static inline
+bool closet_description_parse_dimension (char *tok, uint32_t num_holes,
+                                         struct hole_dimension_t *res)
+{
+    if (strcmp (tok, "copy") == 0) {
+        *res = DIM_COPY;
+        return true;
+
+    } else if (strncmp (tok, "until:", 6) == 0) {
+        char *hole_str = tok + 6;
+        char *face_str = strchr (hole_str, ':');
+        if (face_str == NULL) {
+            return false;
+        }
+        *face_str = '\0';
+        face_str++;
+
+        uint32_t hole_id;
+        int face;
+        if (!closet_description_parse_uint (hole_str, &hole_id) || hole_id >= num_holes ||
+            !closet_description_parse_name (face_str, face_names, ARRAY_SIZE(face_names), &face)) {
+            return false;
+        }
+
+        *res = DIM_UNTIL (hole_id, (enum faces_t)face);
+        return true;
+
+    } else {
+        float val;
+        if (!closet_description_parse_float (tok, &val) || val <= 0) {
+            return false;
+        }
+        *res = DIM_F (val);
+        return true;
+    }
+}
+
+// Parses _str_ into _desc_. On error prints a message with the line number,
+// and returns false.
+//
+// NOTE: All ids and the faces of relative dimensions are validated here, so
+// building a closet from a description returned by this function can't fail.
+bool closet_description_parse (char *str, struct closet_description_t *desc)
+{
+    *desc = ZERO_INIT(struct closet_description_t);
+
+    bool success = true;
+    bool has_closet = false;
+    int line_num = 1;
+    char tok[64];
+    char *c = str;
+    while (success && *c) {
+        char *line_start = c;
+        c = closet_description_next_token (c, tok, sizeof(tok));
+        if (c == NULL || tok[0] == '#') {
+            // Empty line or comment
+
+        } else if (strcmp (tok, "closet") == 0) {
+            if (has_closet) {
+                printf ("%d: Duplicate closet command.\n", line_num);
+                success = false;
+                break;
+            }
+
+            float dim[3];
+            int i;
+            for (i=0; i<3 && success; i++) {
+                c = closet_description_next_token (c, tok, sizeof(tok));
+                if (c == NULL || !closet_description_parse_float (tok, &dim[i]) || dim[i] <= 0) {
+                    printf ("%d: Expected 3 positive sizes for closet.\n", line_num);
+                    success = false;
+                }
+            }
+            desc->size = HOLE_DIM_F (dim[0], dim[1], dim[2]);
+            has_closet = true;
+
+        } else if (strcmp (tok, "hole") == 0) {
+            if (!has_closet) {
+                printf ("%d: Hole defined before closet command.\n", line_num);
+                success = false;
+                break;
+            }
+
+            // NOTE: Hole 0 is created by the closet command.
+            uint32_t num_holes = desc->num_holes + 1;
+            struct closet_hole_cmd_t *cmd = closet_description_push_hole (desc);
+
+            int face = 0, anchor = 0;
+            if ((c = closet_description_next_token (c, tok, sizeof(tok))) == NULL ||
+                !closet_description_parse_uint (tok, &cmd->base_id) || cmd->base_id >= num_holes) {
+                printf ("%d: Invalid base hole id.\n", line_num);
+                success = false;
+
+            } else if ((c = closet_description_next_token (c, tok, sizeof(tok))) == NULL ||
+                       !closet_description_parse_name (tok, face_names, ARRAY_SIZE(face_names), &face)) {
+                printf ("%d: Invalid face name.\n", line_num);
+                success = false;
+
+            } else if ((c = closet_description_next_token (c, tok, sizeof(tok))) == NULL ||
+                       !closet_description_parse_name (tok, vertex_names, ARRAY_SIZE(vertex_names), &anchor)) {
+                printf ("%d: Invalid anchor vertex name.\n", line_num);
+                success = false;
+            }
+            cmd->face = face;
+            cmd->anchor = anchor;
+
+            struct hole_dimension_t *dims[] = {&cmd->dim.x, &cmd->dim.y, &cmd->dim.z};
+            int i;
+            for (i=0; i<3 && success; i++) {
+                if ((c = closet_description_next_token (c, tok, sizeof(tok))) == NULL ||
+                    !closet_description_parse_dimension (tok, num_holes, dims[i])) {
+                    printf ("%d: Invalid hole dimension.\n", line_num);
+                    success = false;
+                }
+            }
+
+            if (success) {
+                enum cube_vertices_t moving = push_hole_moving_vertex (cmd->face, cmd->anchor);
+                enum faces_t moving_faces[] = {VERT_FACE_X(moving), VERT_FACE_Y(moving), VERT_FACE_Z(moving)};
+                for (i=0; i<3 && success; i++) {
+                    if (dims[i]->type == DIMENSION_RELATIVE && dims[i]->rval.face != moving_faces[i]) {
+                        printf ("%d: Invalid face for relative dimension, expected %s.\n",
+                                line_num, face_names[moving_faces[i]]);
+                        success = false;
+                    }
+                }
+            }
+
+            if (success && !closet_description_is_line_end (c)) {
+                char *sep_end = closet_description_next_token (c, tok, sizeof(tok));
+                if (sep_end != NULL) {
+                    if (!closet_description_parse_float (tok, &cmd->separation) || cmd->separation < 0) {
+                        printf ("%d: Invalid separation.\n", line_num);
+                        success = false;
+                    }
+                    c = sep_end;
+                }
+            }
+
+        } else {
+            printf ("%d: Unknown command '%s'.\n", line_num, tok);
+            success = false;
+        }
+
+        if (success && c != NULL && tok[0] != '#' && !closet_description_is_line_end (c)) {
+            printf ("%d: Unexpected text at end of line.\n", line_num);
+            success = false;
+        }
+
+        c = consume_line (line_start);
+        line_num++;
+    }
+
+    if (success && !has_closet) {
+        printf ("Missing closet command.\n");
+        success = false;
+    }
+
+    if (!success) {
+        closet_description_destroy (desc);
+    }
+    return success;
+}
+
+struct closet_t closet_from_description (struct closet_description_t *desc)
+{
+    struct closet_t res = new_closet (&desc->size);
+
+    uint32_t i;
+    for (i=0; i<desc->num_holes; i++) {
+        struct closet_hole_cmd_t *cmd = &desc->holes[i];
+        push_hole (&res, &cmd->dim, cmd->base_id, cmd->face, cmd->anchor, cmd->separation);
+    }
+    return res;
+}
+
+#define CLOSET_H
+#endif
@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2018 Santiago León O. <santileortiz@gmail.com>
+ */
+
+// Headless benchmark for the closet geometry pipeline. It doesn't need X11,
+// GL or cairo so it can run on machines without a display.
+//
+// Usage:
+//   closet_bench [-n ITERATIONS] [-g COLUMNS ROWS] [FILE]
+//
+// Builds the closet described in FILE (see closet.h for the format) or a
+// generated grid of COLUMNS x ROWS holes, ITERATIONS times. Then reports
+// throughput and memory usage. Returns non zero if the description is invalid.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "slo_timers.h"
+#include "closet.h"
+
+void closet_description_grid (struct closet_description_t *desc, uint32_t cols, uint32_t rows)
+{
+    *desc = ZERO_INIT(struct closet_description_t);
+    desc->size = HOLE_DIM_F (0.4, 0.3, 0.6);
+
+    uint32_t r, c;
+    for (r=0; r<rows; r++) {
+        for (c=0; c<cols; c++) {
+            if (r == 0 && c == 0) {
+                continue;
+            }
+
+            struct closet_hole_cmd_t *cmd = closet_description_push_hole (desc);
+            cmd->dim = HOLE_DIM (DIM_COPY, DIM_COPY, DIM_COPY);
+            cmd->anchor = RUF;
+            if (c == 0) {
+                cmd->base_id = (r-1)*cols;
+                cmd->face = UP_FACE;
+            } else {
+                cmd->base_id = r*cols + c - 1;
+                cmd->face = RIGHT_FACE;
+            }
+        }
+    }
+}
+
+void print_usage ()
+{
+    printf ("Usage: closet_bench [-n ITERATIONS] [-g COLUMNS ROWS] [FILE]\n");
+}
+
+int main (int argc, char **argv)
+{
+    uint32_t iterations = 100;
+    uint32_t grid_cols = 0, grid_rows = 0;
+    char *path = NULL;
+
+    int i;
+    for (i=1; i<argc; i++) {
+        if (strcmp (argv[i], "-n") == 0 && i+1 < argc) {
+            iterations = strtoul (argv[++i], NULL, 10);
+        } else if (strcmp (argv[i], "-g") == 0 && i+2 < argc) {
+            grid_cols = strtoul (argv[++i], NULL, 10);
+            grid_rows = strtoul (argv[++i], NULL, 10);
+        } else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        } else {
+            print_usage ();
+            return 1;
+        }
+    }
+
+    if (iterations == 0 || (path == NULL && (grid_cols == 0 || grid_rows == 0))) {
+        print_usage ();
+        return 1;
+    }
+
+    struct closet_description_t desc;
+    if (path != NULL) {
+        mem_pool_t pool = {0};
+        char *str = full_file_read (&pool, path);
+        if (str == NULL) {
+            return 1;
+        }
+
+        bool success = closet_description_parse (str, &desc);
+        mem_pool_destroy (&pool);
+        if (!success) {
+            printf ("Invalid closet description: %s\n", path);
+            return 1;
+        }
+
+    } else {
+        closet_description_grid (&desc, grid_cols, grid_rows);
+    }
+
+    setup_clocks ();
+
+    uint32_t num_holes = 0, num_seps = 0, num_sep_parts = 0;
+    uint64_t peak_pool = 0, peak_total = 0;
+
+    struct timespec start, end;
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    uint32_t it;
+    for (it=0; it<iterations; it++) {
+        struct closet_t cl = closet_from_description (&desc);
+
+        num_holes = cl.num_holes;
+        num_seps = cl.num_seps;
+        num_sep_parts = cl.num_sep_parts;
+        peak_pool = MAX (peak_pool, mem_pool_allocated (&cl.pool));
+        peak_total = MAX (peak_total, closet_allocated (&cl));
+
+        closet_destroy (&cl);
+    }
+    clock_gettime (CLOCK_MONOTONIC, &end);
+
+    double total_s = (end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec)/1e9;
+    double build_s = total_s/iterations;
+
+    printf ("Holes: %" PRIu32 ", Separators: %" PRIu32 ", Separator parts: %" PRIu32 "\n",
+            num_holes, num_seps, num_sep_parts);
+    printf ("Iterations: %" PRIu32 "\n", iterations);
+    printf ("Build time: %.3f ms\n", build_s*1000);
+    printf ("Holes/s: %.0f\n", num_holes/build_s);
+    printf ("Separator parts/s: %.0f\n", num_sep_parts/build_s);
+    printf ("Peak memory: %" PRIu64 " bytes (pool: %" PRIu64 " bytes)\n", peak_total, peak_pool);
+
+    closet_description_destroy (&desc);
+    return 0;
+}
@@ -23,267 +23,24 @@ dvec3 camera_compute_pos (struct camera_t *camera)
                   cos(camera->pitch)*cos(camera->yaw)*camera->distance);
 }
 
-enum faces_t {
-    RIGHT_FACE, //  X
-    LEFT_FACE,  // -X
-    UP_FACE,    //  Y
-    DOWN_FACE,  // -Y
-    FRONT_FACE, //  Z
-    BACK_FACE   // -Z
-};
-
-static inline
-enum faces_t opposite_face (enum faces_t face)
-{
-    if (face % 2 == 0) {
-        return face + 1;
-    } else {
-        return face - 1;
-    }
-}
-
-// NOTE: Naming is based on the first letter of the 3 faces that contain the
-// vertex in XYZ order.
-// NOTE: Ordering is lexicographic assuming it's a unit cube with LDB point
-// located at (0,0,0). Then coordinates in binary are ordered lexicographically.
-
-enum cube_vertices_t {
-    LDB, // 000
-    LDF, // 001
-    LUB, // 010
-    LUF, // 011
-    RDB, // 100
-    RDF, // 101
-    RUB, // 110
-    RUF  // 111
-};
-
-#define VERT_FACE_X(vert) ((vert&0x4)?RIGHT_FACE:LEFT_FACE)
-#define VERT_FACE_Y(vert) ((vert&0x2)?UP_FACE:DOWN_FACE)
-#define VERT_FACE_Z(vert) ((vert&0x1)?FRONT_FACE:BACK_FACE)
-
-struct cuboid_t {
-    fvec3 v[8];
-};
-
-#define UNIT_CUBE (struct cuboid_t){{\
-                    FVEC3(-1,-1,-1), \
-                    FVEC3(-1,-1, 1), \
-                    FVEC3(-1, 1,-1), \
-                    FVEC3(-1, 1, 1), \
-                    FVEC3( 1,-1,-1), \
-                    FVEC3( 1,-1, 1), \
-                    FVEC3( 1, 1,-1), \
-                    FVEC3( 1, 1, 1), \
-                   }}
-
-#define CUBOID_SIZE_X(c) ((c).v[4].x - (c).v[0].x)
-#define CUBOID_SIZE_Y(c) ((c).v[2].y - (c).v[0].y)
-#define CUBOID_SIZE_Z(c) ((c).v[1].z - (c).v[0].z)
-
-void cuboid_init (fvec3 dim, struct cuboid_t *res)
-{
-    *res = UNIT_CUBE;
-
-    int i;
-    for (i=0; i<8; i++) {
-        res->v[i].x = res->v[i].x * dim.x/2;
-        res->v[i].y = res->v[i].y * dim.y/2;
-        res->v[i].z = res->v[i].z * dim.z/2;
-    }
-}
-
-void cuboid_init_anchored (fvec3 dim,
-                           enum cube_vertices_t anchor_id, fvec3 anchor_pos,
-                           struct cuboid_t *res)
-{
-    *res = UNIT_CUBE;
-
-    fvec3 new_anchor = res->v[anchor_id];
-    new_anchor.x *= dim.x/2;
-    new_anchor.y *= dim.y/2;
-    new_anchor.z *= dim.z/2;
-
-    fvec3 disp = fvec3_subs (anchor_pos, new_anchor);
-
-    int i;
-    for (i=0; i<8; i++) {
-        res->v[i].x = res->v[i].x * dim.x/2 + disp.x;
-        res->v[i].y = res->v[i].y * dim.y/2 + disp.y;
-        res->v[i].z = res->v[i].z * dim.z/2 + disp.z;
-    }
-}
-
-void cuboid_print (struct cuboid_t *cb)
-{
-    int i;
-    for (i=0; i<8; i++) {
-        fvec3_print (cb->v[i]);
-    }
-}
-
-static inline
-float cuboid_face_coord (struct cuboid_t c, enum faces_t face)
-{
-    float res;
-    switch (face) {
-        case RIGHT_FACE:
-            res = c.v[7].x;
-            break;
-        case LEFT_FACE:
-            res = c.v[0].x;
-            break;
-        case UP_FACE:
-            res = c.v[7].y;
-            break;
-        case DOWN_FACE:
-            res = c.v[0].y;
-            break;
-        case BACK_FACE:
-            res = c.v[7].z;
-            break;
-        case FRONT_FACE:
-            res = c.v[0].z;
-            break;
-    }
-    return res;
-}
-
 static inline
-void face_vert_ids (enum faces_t face, uint8_t *face_ids, uint8_t *opposite_face_ids)
+bool camera_equal (struct camera_t *a, struct camera_t *b)
 {
-    uint8_t mask;
-    uint8_t axis_1_cnt = 0;
-    uint8_t *axis_1 = face_ids;
-    uint8_t axis_0_cnt = 0;
-    uint8_t *axis_0 = opposite_face_ids;
-
-    switch (face) {
-        case LEFT_FACE:
-            axis_0 = face_ids;
-            axis_1 = opposite_face_ids;
-        case RIGHT_FACE:
-            mask = 0x4;
-            break;
-
-        case DOWN_FACE:
-            axis_0 = face_ids;
-            axis_1 = opposite_face_ids;
-        case UP_FACE:
-            mask = 0x2;
-            break;
-
-        case BACK_FACE:
-            axis_0 = face_ids;
-            axis_1 = opposite_face_ids;
-        case FRONT_FACE:
-            mask = 0x1;
-            break;
-    }
-
-    uint8_t i;
-    for (i=0; i<8; i++) {
-        if (i & mask) {
-            if (axis_1 != NULL) {
-                axis_1[axis_1_cnt] = i;
-                axis_1_cnt++;
-            }
-        } else {
-            if (axis_0 != NULL) {
-                axis_0[axis_0_cnt] = i;
-                axis_0_cnt++;
-            }
-        }
-    }
+    return a->width_m == b->width_m &&
+           a->height_m == b->height_m &&
+           a->near_plane == b->near_plane &&
+           a->far_plane == b->far_plane &&
+           a->pitch == b->pitch &&
+           a->yaw == b->yaw &&
+           a->distance == b->distance;
 }
 
-#define NUM_HOLES 30
-#define NUM_SEPARATORS (5*NUM_HOLES)
-#define NUM_SEPARATOR_PARTS (23*NUM_HOLES)
-#define DEFAULT_SEPARATION 0.025f
-
-struct relative_dimension_t {
-    uint32_t hole_id;
-    enum faces_t face;
-};
-
-// A hole's size in some axis can be specified in 3 ways:
-//
-//   DIM_DIRECT means we have a specific value.
-//
-//   DIM_COPY means we copy the size from the base hole.
-//
-//   DIM_RELATIVE means the moving face will match with a parallel face of
-//   another hole.
-
-enum dimension_type_t {
-    DIMENSION_DIRECT,
-    DIMENSION_COPY,
-    DIMENSION_RELATIVE
-};
-
-struct hole_dimension_t {
-    enum dimension_type_t type;
-    union {
-        float val;
-        struct relative_dimension_t rval;
-    };
-};
-
-#define DIM_F(n) (struct hole_dimension_t){DIMENSION_DIRECT,{n}}
-#define DIM_COPY (struct hole_dimension_t){DIMENSION_COPY,{0}}
-#define DIM_UNTIL(hole_id,face) (struct hole_dimension_t){DIMENSION_RELATIVE, \
-    {.rval = (struct relative_dimension_t){hole_id,face}}}
-
-struct hole_dimensions_t {
-    struct hole_dimension_t x;
-    struct hole_dimension_t y;
-    struct hole_dimension_t z;
-};
-
-#define HOLE_DIM_F(x,y,z) (struct hole_dimensions_t){DIM_F(x),DIM_F(y),DIM_F(z)}
-#define HOLE_DIM(x,y,z) (struct hole_dimensions_t){x,y,z}
-
-static inline
-fvec3 hole_dim_direct_to_fvec3 (struct hole_dimensions_t *dim)
-{
-    return FVEC3 (dim->x.val, dim->y.val, dim->z.val);
-}
-
-struct separator_part_t {
-    struct cuboid_t c;
-    fvec3 color;
-};
-
-struct sep_part_list_t {
-    struct sep_part_list_t *next;
-    struct separator_part_t *part;
-};
-
-struct separator_t {
-    struct sep_part_list_t *parts;
-    float thickness;
-};
-
-struct hole_t {
-    struct cuboid_t h;
-    struct separator_t *separators[6];
-};
-
-struct closet_t {
-    mem_pool_t pool;
-
-    uint32_t num_holes;
-    uint32_t size_holes;
-    struct hole_t *holes;
-
-    uint32_t num_seps;
-    uint32_t size_separators;
-    struct separator_t *separators;
-
-    uint32_t num_sep_parts;
-    uint32_t size_sep_parts;
-    struct separator_part_t *sep_parts;
+// Holes and separator parts are rendered by instancing a single unit cube. Each
+// cuboid only uploads one of these records.
+struct cuboid_instance_t {
+    fvec3 min;
+    fvec3 size;
+    uint8_t color[4];
 };
 
 struct closet_scene_t {
@@ -291,13 +48,33 @@ struct closet_scene_t {
     GLuint model_loc;
     GLuint view_loc;
     GLuint proj_loc;
-    GLuint color_loc;
     GLuint alpha_loc;
 
-    uint32_t holes_vao_size;
+    GLuint cube_vbo;
+
+    uint32_t num_holes;
+    uint32_t holes_capacity;
     GLuint holes_vao;
-    uint32_t seps_vao_size;
+    GLuint holes_instance_vbo;
+
+    uint32_t num_sep_parts;
+    uint32_t sep_parts_capacity;
     GLuint seps_vao;
+    GLuint seps_instance_vbo;
+
+    // Weighted blended OIT. This program uses the same vertex shader, so it
+    // can render from the VAOs above.
+    GLuint wboit_program_id;
+    GLuint wboit_model_loc;
+    GLuint wboit_view_loc;
+    GLuint wboit_proj_loc;
+    GLuint wboit_alpha_loc;
+
+    GLuint wboit_composite_program_id;
+    GLuint empty_vao;
+
+    // Set by closet_scene_set_camera(), used to place labels.
+    mat4f view_projection;
 };
 
 #define VA_CUBOID_SIZE (36*6*sizeof(float))
@@ -362,462 +139,283 @@ float* put_cuboid_in_vertex_array (struct cuboid_t *cuboid, float *dest)
     return (float*)((uint8_t*)dest + sizeof (vertex_array));
 }
 
-struct separator_part_t* next_sep_part (struct closet_t *cl)
+static inline
+void cuboid_instance_set (struct cuboid_t *c, fvec3 color, struct cuboid_instance_t *res)
 {
-    assert (cl->num_sep_parts < cl->size_sep_parts - 1);
-    struct separator_part_t *res = &cl->sep_parts[cl->num_sep_parts++];
-    res->color = FVEC3 (1, 1, 0);
-    return res;
+    res->min = c->v[LDB];
+    res->size = FVEC3 (CUBOID_SIZE_X(*c), CUBOID_SIZE_Y(*c), CUBOID_SIZE_Z(*c));
+    res->color[0] = CLAMP (color.r, 0, 1)*255;
+    res->color[1] = CLAMP (color.g, 0, 1)*255;
+    res->color[2] = CLAMP (color.b, 0, 1)*255;
+    res->color[3] = 255;
 }
 
-struct separator_t* next_separator (struct closet_t *cl)
+void closet_scene_init_vao (GLuint program_id, GLuint vao, GLuint cube_vbo, GLuint instance_vbo)
 {
-    assert (cl->num_seps < cl->size_separators - 1);
-    return &cl->separators[cl->num_seps++];
-}
+    GLint pos_attr = glGetAttribLocation (program_id, "position");
+    GLint normal_attr = glGetAttribLocation (program_id, "in_normal");
+    GLint min_attr = glGetAttribLocation (program_id, "instance_min");
+    GLint size_attr = glGetAttribLocation (program_id, "instance_size");
+    GLint color_attr = glGetAttribLocation (program_id, "instance_color");
 
-struct hole_t* next_hole (struct closet_t *cl)
-{
-    assert (cl->num_holes < cl->size_holes - 1);
-    return &cl->holes[cl->num_holes++];
-}
+    glBindVertexArray (vao);
 
-void compute_face_separator_part (struct cuboid_t *base, enum faces_t face,
-                                  struct cuboid_t *res, float thickness)
-{
-    uint8_t face_v[4];
-    uint8_t opposite_face_v[4];
-    face_vert_ids (face, face_v, opposite_face_v);
+      glBindBuffer (GL_ARRAY_BUFFER, cube_vbo);
+      glEnableVertexAttribArray (pos_attr);
+      glVertexAttribPointer (pos_attr, 3, GL_FLOAT, GL_FALSE, 6*sizeof(float), 0);
 
-    int i;
-    for (i=0; i<4; i++) {
-        res->v[face_v[i]] = res->v[opposite_face_v[i]] = base->v[face_v[i]];
-    }
+      glEnableVertexAttribArray (normal_attr);
+      glVertexAttribPointer (normal_attr, 3, GL_FLOAT, GL_FALSE, 6*sizeof(float), (void*)(3*sizeof(float)));
 
-    uint8_t axis_idx;
-    switch (face) {
-        case LEFT_FACE:
-            thickness = -thickness;
-        case RIGHT_FACE:
-            axis_idx = 0;
-            break;
+      glBindBuffer (GL_ARRAY_BUFFER, instance_vbo);
+      glEnableVertexAttribArray (min_attr);
+      glVertexAttribPointer (min_attr, 3, GL_FLOAT, GL_FALSE, sizeof(struct cuboid_instance_t),
+                             (void*)offsetof(struct cuboid_instance_t, min));
+      glVertexAttribDivisor (min_attr, 1);
 
-        case DOWN_FACE:
-            thickness = -thickness;
-        case UP_FACE:
-            axis_idx = 1;
-            break;
+      glEnableVertexAttribArray (size_attr);
+      glVertexAttribPointer (size_attr, 3, GL_FLOAT, GL_FALSE, sizeof(struct cuboid_instance_t),
+                             (void*)offsetof(struct cuboid_instance_t, size));
+      glVertexAttribDivisor (size_attr, 1);
 
-        case BACK_FACE:
-            thickness = -thickness;
-        case FRONT_FACE:
-            axis_idx = 2;
-            break;
-    }
+      glEnableVertexAttribArray (color_attr);
+      glVertexAttribPointer (color_attr, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(struct cuboid_instance_t),
+                             (void*)offsetof(struct cuboid_instance_t, color));
+      glVertexAttribDivisor (color_attr, 1);
 
-    for (i=0; i<4; i++) {
-        res->v[face_v[i]].E[axis_idx] += thickness;
-    }
+    glBindVertexArray (0);
 }
 
-void set_new_separator (struct closet_t *cl, struct hole_t *hole, enum faces_t face, float thickness)
-{
-    struct separator_t *new_sep = next_separator (cl);
-    new_sep->thickness = thickness;
-    hole->separators[face] = new_sep;
-
-    struct separator_part_t *part = next_sep_part (cl);
-    struct cuboid_t *base = &hole->h;
-    compute_face_separator_part (base, face, &part->c, thickness);
-
-    struct sep_part_list_t *list_node = mem_pool_push_size (&cl->pool, sizeof(struct sep_part_list_t));
-    new_sep->parts = list_node;
-    list_node->part = part;
-    list_node->next = NULL;
-}
-
-void extend_separator (struct closet_t *cl, struct hole_t *hole, enum faces_t face, struct separator_t *sep)
+struct closet_scene_t init_closet_scene ()
 {
-    struct separator_part_t *part = next_sep_part (cl);
-    compute_face_separator_part (&hole->h, face, &part->c, sep->thickness);
-    hole->separators[face] = sep;
-
-    struct sep_part_list_t *list_node = mem_pool_push_size (&cl->pool, sizeof(struct sep_part_list_t));
-    list_node->part = part;
-    list_node->next = sep->parts;
-    sep->parts = list_node;
-}
+    struct closet_scene_t scene = {0};
 
-static inline
-void color_separator (struct separator_t *sep, fvec3 color)
-{
-    struct sep_part_list_t *curr_list_node = sep->parts;
-    while (curr_list_node != NULL) {
-        struct separator_part_t *part = curr_list_node->part;
-        part->color = color;
-        curr_list_node = curr_list_node->next;
+    scene.program_id = gl_program ("vertex_shader.glsl", "fragment_shader.glsl");
+    if (!scene.program_id) {
+        return scene;
     }
-}
-
-struct closet_t new_closet (struct hole_dimensions_t *dim)
-{
-    assert (dim->x.type == DIMENSION_DIRECT &&
-            dim->y.type == DIMENSION_DIRECT &&
-            dim->z.type == DIMENSION_DIRECT);
-
-    struct closet_t res = {0};
-    res.size_holes = NUM_HOLES;
-    res.holes = mem_pool_push_size (&res.pool,
-                                    NUM_HOLES*sizeof(struct hole_t));
-
-    res.size_separators = NUM_SEPARATORS;
-    res.separators = mem_pool_push_size (&res.pool,
-                                         NUM_SEPARATORS*sizeof(struct separator_t));
-
-    res.size_sep_parts = NUM_SEPARATOR_PARTS;
-    res.sep_parts = mem_pool_push_size (&res.pool,
-                                         NUM_SEPARATOR_PARTS*sizeof(struct separator_part_t));
-
-    fvec3 hole_size = hole_dim_direct_to_fvec3 (dim);
-    struct hole_t *new_hole = next_hole (&res);
-    cuboid_init (hole_size, &new_hole->h);
-
-    set_new_separator (&res, new_hole, UP_FACE, DEFAULT_SEPARATION);
-    set_new_separator (&res, new_hole, DOWN_FACE, DEFAULT_SEPARATION);
-    set_new_separator (&res, new_hole, RIGHT_FACE, DEFAULT_SEPARATION);
-    set_new_separator (&res, new_hole, LEFT_FACE, DEFAULT_SEPARATION);
-    set_new_separator (&res, new_hole, FRONT_FACE, DEFAULT_SEPARATION);
-    set_new_separator (&res, new_hole, BACK_FACE, DEFAULT_SEPARATION);
-
-    return res;
-}
-
-void push_hole (struct closet_t *cl,
-                struct hole_dimensions_t *dim, uint32_t base_id,
-                enum faces_t face, enum cube_vertices_t base_anchor_id,
-                float separation)
-{
-    assert (cl->num_holes > 0);
 
-    // TODO: Grow the hole array instead of failing
-    assert (cl->num_holes < cl->size_holes - 1);
-
-    struct cuboid_t *base_hole_cuboid = &cl->holes[base_id].h;
-
-    // Ensure the base_anchor_id is in the face received as argument. If it's
-    // not we choose the closest vertex that is in it.
-    switch (face) {
-        case RIGHT_FACE:
-            base_anchor_id |= 0x4;
-            break;
-        case LEFT_FACE:
-            base_anchor_id &= ~0x4;
-            break;
-        case UP_FACE:
-            base_anchor_id |= 0x2;
-            break;
-        case DOWN_FACE:
-            base_anchor_id &= ~0x2;
-            break;
-        case FRONT_FACE:
-            base_anchor_id |= 0x1;
-            break;
-        case BACK_FACE:
-            base_anchor_id &= ~0x1;
-            break;
-    }
+    scene.model_loc = glGetUniformLocation (scene.program_id, "model");
+    scene.view_loc = glGetUniformLocation (scene.program_id, "view");
+    scene.proj_loc = glGetUniformLocation (scene.program_id, "proj");
+    scene.alpha_loc = glGetUniformLocation (scene.program_id, "alpha");
 
-    // Compute the position and id for the anchor vertex in the new cuboid
-    enum cube_vertices_t anchor_id = base_anchor_id;
-    fvec3 anchor_pos;
-    {
-        anchor_pos = base_hole_cuboid->v[anchor_id];
-        switch (face) {
-            case RIGHT_FACE:
-                anchor_pos.x += separation;
-                break;
-            case LEFT_FACE:
-                anchor_pos.x -= separation;
-                break;
-            case UP_FACE:
-                anchor_pos.y += separation;
-                break;
-            case DOWN_FACE:
-                anchor_pos.y -= separation;
-                break;
-            case FRONT_FACE:
-                anchor_pos.z += separation;
-                break;
-            case BACK_FACE:
-                anchor_pos.z -= separation;
-                break;
-            default:
-                invalid_code_path;
-        }
+    struct cuboid_t unit_cube;
+    cuboid_init_anchored (FVEC3(1,1,1), LDB, FVEC3(0,0,0), &unit_cube);
+    float vertices[36*6];
+    put_cuboid_in_vertex_array (&unit_cube, vertices);
 
-        switch (face) {
-            case RIGHT_FACE:
-            case LEFT_FACE:
-                anchor_id = (anchor_id & ~0x04) | ((anchor_id ^ 0xFF) & 0x4);
-                break;
-            case UP_FACE:
-            case DOWN_FACE:
-                anchor_id = (anchor_id & ~0x02) | ((anchor_id ^ 0xFF) & 0x2);
-                break;
-            case FRONT_FACE:
-            case BACK_FACE:
-                anchor_id = (anchor_id & ~0x01) | ((anchor_id ^ 0xFF) & 0x1);
-                break;
-            default:
-                invalid_code_path;
-        }
-    }
+    glGenBuffers (1, &scene.cube_vbo);
+    glBindBuffer (GL_ARRAY_BUFFER, scene.cube_vbo);
+    glBufferData (GL_ARRAY_BUFFER, VA_CUBOID_SIZE, vertices, GL_STATIC_DRAW);
 
-    // Compute the size of the new hole
-    fvec3 dim_vec = FVEC3(0,0,0);
-    enum cube_vertices_t moving_vertex_id = anchor_id^0x7;
-    {
-
-        switch (dim->x.type) {
-            case DIMENSION_DIRECT:
-                dim_vec.x = dim->x.val;
-                break;
-            case DIMENSION_COPY:
-                dim_vec.x = CUBOID_SIZE_X (*base_hole_cuboid);
-                break;
-            case DIMENSION_RELATIVE:
-                {
-                    struct relative_dimension_t rval = dim->x.rval;
-                    if (VERT_FACE_X(moving_vertex_id) == rval.face) {
-                        float face_coord = cuboid_face_coord (cl->holes[rval.hole_id].h, rval.face);
-                        dim_vec.x = fabs (anchor_pos.x - face_coord);
-                    } else {
-                        printf ("Invalid face for relative dimension.\n");
-                    }
-                } break;
-                break;
-            default:
-                invalid_code_path;
-        }
+    glGenBuffers (1, &scene.holes_instance_vbo);
+    glGenVertexArrays (1, &scene.holes_vao);
+    closet_scene_init_vao (scene.program_id, scene.holes_vao, scene.cube_vbo, scene.holes_instance_vbo);
 
-        switch (dim->y.type) {
-            case DIMENSION_DIRECT:
-                dim_vec.y = dim->y.val;
-                break;
-            case DIMENSION_COPY:
-                dim_vec.y = CUBOID_SIZE_Y (*base_hole_cuboid);
-                break;
-            case DIMENSION_RELATIVE:
-                {
-                    struct relative_dimension_t rval = dim->y.rval;
-                    if (VERT_FACE_Y(moving_vertex_id) == rval.face) {
-                        float face_coord = cuboid_face_coord (cl->holes[rval.hole_id].h, rval.face);
-                        dim_vec.y = fabs (anchor_pos.y - face_coord);
-                    } else {
-                        printf ("Invalid face for relative dimension.\n");
-                    }
-                } break;
-            default:
-                invalid_code_path;
-        }
+    glGenBuffers (1, &scene.seps_instance_vbo);
+    glGenVertexArrays (1, &scene.seps_vao);
+    closet_scene_init_vao (scene.program_id, scene.seps_vao, scene.cube_vbo, scene.seps_instance_vbo);
+
+    // NOTE: Failing to build the weighted blended OIT programs is not fatal,
+    // we just keep using depth peeling.
+    scene.wboit_program_id = gl_program ("vertex_shader.glsl", "wboit_fragment_shader.glsl");
+    scene.wboit_composite_program_id = gl_program ("wboit_composite_vertex_shader.glsl",
+                                                   "wboit_composite_fragment_shader.glsl");
+    if (scene.wboit_program_id && scene.wboit_composite_program_id) {
+        scene.wboit_model_loc = glGetUniformLocation (scene.wboit_program_id, "model");
+        scene.wboit_view_loc = glGetUniformLocation (scene.wboit_program_id, "view");
+        scene.wboit_proj_loc = glGetUniformLocation (scene.wboit_program_id, "proj");
+        scene.wboit_alpha_loc = glGetUniformLocation (scene.wboit_program_id, "alpha");
+
+        glUseProgram (scene.wboit_composite_program_id);
+        glUniform1i (glGetUniformLocation (scene.wboit_composite_program_id, "accum_texture"), 0);
+        glUniform1i (glGetUniformLocation (scene.wboit_composite_program_id, "revealage_texture"), 1);
+        glGenVertexArrays (1, &scene.empty_vao);
 
-        switch (dim->z.type) {
-            case DIMENSION_DIRECT:
-                dim_vec.z = dim->z.val;
-                break;
-            case DIMENSION_COPY:
-                dim_vec.z = CUBOID_SIZE_Z (*base_hole_cuboid);
-                break;
-            case DIMENSION_RELATIVE:
-                {
-                    struct relative_dimension_t rval = dim->z.rval;
-                    if (VERT_FACE_Z(moving_vertex_id) == rval.face) {
-                        float face_coord = cuboid_face_coord (cl->holes[rval.hole_id].h, rval.face);
-                        dim_vec.z = fabs (anchor_pos.z - face_coord);
-                    } else {
-                        printf ("Invalid face for relative dimension.\n");
-                    }
-                } break;
-            default:
-                invalid_code_path;
-        }
+    } else {
+        scene.wboit_program_id = 0;
+        scene.wboit_composite_program_id = 0;
     }
 
-    // Compute new hole
-    struct hole_t *new_hole = next_hole (cl);
-    cuboid_init_anchored (dim_vec, anchor_id, anchor_pos, &new_hole->h);
-
-    // Resolve separators
-    struct hole_t *base_hole = &cl->holes[base_id];
-    new_hole->separators[opposite_face (face)] = base_hole->separators[face];
+    return scene;
+}
 
-    if (VERT_FACE_X(anchor_id) != opposite_face (face)) {
-        extend_separator (cl, new_hole, VERT_FACE_X(anchor_id), base_hole->separators[VERT_FACE_X(anchor_id)]);
-    }
+void hole_instance (struct closet_t *cl, uint32_t id, struct cuboid_instance_t *res)
+{
+    cuboid_instance_set (&cl->holes[id].h, FVEC3(1,1,1), res);
+}
 
-    if (VERT_FACE_Y(anchor_id) != opposite_face (face)) {
-        extend_separator (cl, new_hole, VERT_FACE_Y(anchor_id), base_hole->separators[VERT_FACE_Y(anchor_id)]);
-    }
+void sep_part_instance (struct closet_t *cl, uint32_t id, struct cuboid_instance_t *res)
+{
+    cuboid_instance_set (&cl->sep_parts[id].c, cl->sep_parts[id].color, res);
+}
 
-    if (VERT_FACE_Z(anchor_id) != opposite_face (face)) {
-        extend_separator (cl, new_hole, VERT_FACE_Z(anchor_id), base_hole->separators[VERT_FACE_Z(anchor_id)]);
+// Uploads to _vbo_ the instances whose ids are in _dirty_. Runs of contiguous
+// ids are coalesced into a single glBufferSubData() call, so the cost is
+// proportional to the number of changed instances. The buffer is only
+// reallocated (doubling its capacity) when num_instances doesn't fit.
+//
+// NOTE: This sorts _dirty_ in place.
+void closet_scene_update_instances (GLuint vbo, uint32_t *capacity, uint32_t num_instances,
+                                    int_dyn_arr_t *dirty, struct closet_t *cl,
+                                    void (*get_instance)(struct closet_t*, uint32_t, struct cuboid_instance_t*))
+{
+    if (dirty->len == 0) {
+        return;
     }
 
-    if (VERT_FACE_X(moving_vertex_id) != face) {
-        switch (dim->x.type) {
-            case DIMENSION_DIRECT:
-                set_new_separator (cl, new_hole, VERT_FACE_X(moving_vertex_id), DEFAULT_SEPARATION);
-                break;
-            case DIMENSION_COPY:
-                extend_separator (cl, new_hole,
-                                  VERT_FACE_X(moving_vertex_id),
-                                  base_hole->separators[VERT_FACE_X(moving_vertex_id)]);
-                break;
-            case DIMENSION_RELATIVE:
-                {
-                    struct relative_dimension_t rval = dim->x.rval;
-                    struct separator_t *rel_sep = cl->holes[rval.hole_id].separators[rval.face];
-                    extend_separator (cl, new_hole, VERT_FACE_X(moving_vertex_id), rel_sep);
-                } break;
-            default:
-                invalid_code_path;
-        }
-    }
+    mem_pool_t pool = {0};
+    glBindBuffer (GL_ARRAY_BUFFER, vbo);
 
-    if (VERT_FACE_Y(moving_vertex_id) != face) {
-        switch (dim->y.type) {
-            case DIMENSION_DIRECT:
-                set_new_separator (cl, new_hole, VERT_FACE_Y(moving_vertex_id), DEFAULT_SEPARATION);
-                break;
-            case DIMENSION_COPY:
-                extend_separator (cl, new_hole,
-                                  VERT_FACE_Y(moving_vertex_id),
-                                  base_hole->separators[VERT_FACE_Y(moving_vertex_id)]);
-                break;
-            case DIMENSION_RELATIVE:
-                {
-                    struct relative_dimension_t rval = dim->y.rval;
-                    struct separator_t *rel_sep = cl->holes[rval.hole_id].separators[rval.face];
-                    extend_separator (cl, new_hole, VERT_FACE_Y(moving_vertex_id), rel_sep);
-                } break;
-            default:
-                invalid_code_path;
+    bool full_upload = false;
+    if (num_instances > *capacity) {
+        uint32_t new_capacity = MAX (64, *capacity);
+        while (new_capacity < num_instances) {
+            new_capacity *= 2;
         }
+        *capacity = new_capacity;
+        glBufferData (GL_ARRAY_BUFFER, sizeof(struct cuboid_instance_t)*new_capacity,
+                      NULL, GL_DYNAMIC_DRAW);
+        full_upload = true;
+
+    } else if (dirty->len > num_instances/2) {
+        // NOTE: Most instances changed, one big upload is cheaper than sorting
+        // and splitting it into many small ones.
+        full_upload = true;
     }
 
-    if (VERT_FACE_Z(moving_vertex_id) != face) {
-        switch (dim->z.type) {
-            case DIMENSION_DIRECT:
-                set_new_separator (cl, new_hole, VERT_FACE_Z(moving_vertex_id), DEFAULT_SEPARATION);
-                break;
-            case DIMENSION_COPY:
-                extend_separator (cl, new_hole,
-                                  VERT_FACE_Z(moving_vertex_id),
-                                  base_hole->separators[VERT_FACE_Z(moving_vertex_id)]);
-                break;
-            case DIMENSION_RELATIVE:
-                {
-                    struct relative_dimension_t rval = dim->z.rval;
-                    struct separator_t *rel_sep = cl->holes[rval.hole_id].separators[rval.face];
-                    extend_separator (cl, new_hole, VERT_FACE_Z(moving_vertex_id), rel_sep);
-                } break;
-            default:
-                invalid_code_path;
+    if (full_upload) {
+        struct cuboid_instance_t *instances =
+            mem_pool_push_size (&pool, sizeof(struct cuboid_instance_t)*num_instances);
+        uint32_t i;
+        for (i=0; i<num_instances; i++) {
+            get_instance (cl, i, &instances[i]);
         }
-    }
+        glBufferSubData (GL_ARRAY_BUFFER, 0, sizeof(struct cuboid_instance_t)*num_instances, instances);
 
-    // TODO: What happens if the distance between the faces of new_hole parallel
-    // to face was set using relative dimensioning? Then the separator may
-    // already exist, in which case we want to use extend_separator() here.
-    set_new_separator (cl, new_hole, face, DEFAULT_SEPARATION);
-}
+    } else {
+        int_sort (dirty->data, dirty->len);
+
+        struct cuboid_instance_t *instances =
+            mem_pool_push_size (&pool, sizeof(struct cuboid_instance_t)*dirty->len);
+        uint32_t run_start = 0;
+        while (run_start < dirty->len) {
+            uint32_t run_end = run_start + 1;
+            while (run_end < dirty->len && dirty->data[run_end] == dirty->data[run_end-1] + 1) {
+                run_end++;
+            }
 
-struct closet_scene_t init_closet_scene ()
-{
-    struct closet_scene_t scene = {0};
+            uint32_t i;
+            for (i=run_start; i<run_end; i++) {
+                get_instance (cl, dirty->data[i], &instances[i]);
+            }
 
-    scene.program_id = gl_program ("vertex_shader.glsl", "fragment_shader.glsl");
-    if (!scene.program_id) {
-        return scene;
+            glBufferSubData (GL_ARRAY_BUFFER,
+                             sizeof(struct cuboid_instance_t)*dirty->data[run_start],
+                             sizeof(struct cuboid_instance_t)*(run_end - run_start),
+                             &instances[run_start]);
+            run_start = run_end;
+        }
     }
 
-    glGenVertexArrays (1, &scene.holes_vao);
-    glGenVertexArrays (1, &scene.seps_vao);
-
-    scene.model_loc = glGetUniformLocation (scene.program_id, "model");
-    scene.view_loc = glGetUniformLocation (scene.program_id, "view");
-    scene.proj_loc = glGetUniformLocation (scene.program_id, "proj");
-    scene.color_loc = glGetUniformLocation (scene.program_id, "color");
-
-    return scene;
+    mem_pool_destroy (&pool);
 }
 
+// Uploads the holes and separator parts that changed since the last call.
+// This is cheap when nothing changed so it's called every frame.
+//
+// NOTE: This clears the dirty state of _cl_, the scene is expected to be the
+// only consumer of it.
 void update_closet_scene (struct closet_scene_t *scene, struct closet_t *cl)
 {
-    mem_pool_t pool = {0};
-    float *vertices = mem_pool_push_size (&pool, VA_CUBOID_SIZE*cl->num_holes);
-    float *vert_ptr = vertices;
-    int i;
-    for (i = 0; i<cl->num_holes; i++) {
-        vert_ptr = put_cuboid_in_vertex_array (&cl->holes[i].h, vert_ptr);
-        scene->holes_vao_size += 36;
-    }
+    closet_scene_update_instances (scene->holes_instance_vbo, &scene->holes_capacity,
+                                   cl->num_holes, &cl->dirty_holes, cl, hole_instance);
+    scene->num_holes = cl->num_holes;
 
-    GLint pos_attr = glGetAttribLocation (scene->program_id, "position");
-    GLint normal_attr = glGetAttribLocation (scene->program_id, "in_normal");
-
-    glBindVertexArray (scene->holes_vao);
-
-      GLuint vbo;
-      glGenBuffers (1, &vbo);
-      glBindBuffer (GL_ARRAY_BUFFER, vbo);
-      glBufferData (GL_ARRAY_BUFFER, VA_CUBOID_SIZE*cl->num_holes, vertices, GL_STATIC_DRAW);
-
-      glEnableVertexAttribArray (pos_attr);
-      glVertexAttribPointer (pos_attr, 3, GL_FLOAT, GL_FALSE, 6*sizeof(float), 0);
+    closet_scene_update_instances (scene->seps_instance_vbo, &scene->sep_parts_capacity,
+                                   cl->num_sep_parts, &cl->dirty_sep_parts, cl, sep_part_instance);
+    scene->num_sep_parts = cl->num_sep_parts;
 
-      glEnableVertexAttribArray (normal_attr);
-      glVertexAttribPointer (normal_attr, 3, GL_FLOAT, GL_FALSE, 6*sizeof(float), (void*)(3*sizeof(float)));
-
-    vertices = mem_pool_push_size (&pool, VA_CUBOID_SIZE*cl->num_sep_parts);
-    vert_ptr = vertices;
-    for (i = 0; i<cl->num_sep_parts; i++) {
-        vert_ptr = put_cuboid_in_vertex_array (&cl->sep_parts[i].c, vert_ptr);
-        scene->seps_vao_size += 36;
-    }
-
-    glBindVertexArray (scene->seps_vao);
-
-      glGenBuffers (1, &vbo);
-      glBindBuffer (GL_ARRAY_BUFFER, vbo);
-      glBufferData (GL_ARRAY_BUFFER, VA_CUBOID_SIZE*cl->num_sep_parts, vertices, GL_STATIC_DRAW);
-
-      glEnableVertexAttribArray (pos_attr);
-      glVertexAttribPointer (pos_attr, 3, GL_FLOAT, GL_FALSE, 6*sizeof(float), 0);
-
-      glEnableVertexAttribArray (normal_attr);
-      glVertexAttribPointer (normal_attr, 3, GL_FLOAT, GL_FALSE, 6*sizeof(float), (void*)(3*sizeof(float)));
-
-    mem_pool_destroy (&pool);
+    closet_clear_dirty (cl);
 }
 
 void closet_scene_set_camera (struct closet_scene_t *closet_scene, struct camera_t *camera)
 {
-    glUseProgram (closet_scene->program_id);
-
     mat4f model = rotation_y (0);
-    glUniformMatrix4fv (closet_scene->model_loc, 1, GL_TRUE, model.E);
 
     dvec3 camera_pos = camera_compute_pos (camera);
     mat4f view = look_at (camera_pos,
                           DVEC3(0,0,0),
                           DVEC3(0,1,0));
-    glUniformMatrix4fv (closet_scene->view_loc, 1, GL_TRUE, view.E);
 
     mat4f projection = perspective_projection (-camera->width_m/2, camera->width_m/2,
                                                -camera->height_m/2, camera->height_m/2,
                                                camera->near_plane, camera->far_plane);
+
+    closet_scene->view_projection = mat4f_mult (projection, mat4f_mult (view, model));
+
+    glUseProgram (closet_scene->program_id);
+    glUniformMatrix4fv (closet_scene->model_loc, 1, GL_TRUE, model.E);
+    glUniformMatrix4fv (closet_scene->view_loc, 1, GL_TRUE, view.E);
     glUniformMatrix4fv (closet_scene->proj_loc, 1, GL_TRUE, projection.E);
+
+    if (closet_scene->wboit_program_id) {
+        glUseProgram (closet_scene->wboit_program_id);
+        glUniformMatrix4fv (closet_scene->wboit_model_loc, 1, GL_TRUE, model.E);
+        glUniformMatrix4fv (closet_scene->wboit_view_loc, 1, GL_TRUE, view.E);
+        glUniformMatrix4fv (closet_scene->wboit_proj_loc, 1, GL_TRUE, projection.E);
+    }
+}
+
+// Computes the window coordinates, in pixels from the top left corner, where
+// _p_ is rendered. Returns false if it's behind the camera.
+bool project_to_window (mat4f *view_projection, fvec3 p, app_graphics_t *graphics, dvec2 *res)
+{
+    double clip[4];
+    int i;
+    for (i=0; i<4; i++) {
+        clip[i] = view_projection->M[i][0]*p.x + view_projection->M[i][1]*p.y +
+            view_projection->M[i][2]*p.z + view_projection->M[i][3];
+    }
+
+    if (clip[3] <= 0) {
+        return false;
+    }
+
+    res->x = (clip[0]/clip[3] + 1)/2*graphics->width;
+    res->y = (1 - clip[1]/clip[3])/2*graphics->height;
+    return true;
+}
+
+void push_label (struct text_renderer_t *tr, struct closet_scene_t *closet_scene,
+                 app_graphics_t *graphics, fvec3 p1, fvec3 p2, float length_m)
+{
+    dvec2 pos;
+    fvec3 middle = FVEC3 ((p1.x + p2.x)/2, (p1.y + p2.y)/2, (p1.z + p2.z)/2);
+    if (!project_to_window (&closet_scene->view_projection, middle, graphics, &pos)) {
+        return;
+    }
+
+    char str[32];
+    snprintf (str, ARRAY_SIZE(str), "%.1f cm", length_m*100);
+    float width = text_renderer_str_width (tr, str);
+    float height = tr->atlas.ascent + tr->atlas.descent;
+    text_renderer_push_str (tr, pos.x - width/2, pos.y - height/2, str, DVEC4(1,1,1,1));
+}
+
+// Queues labels with the width, height and depth of each hole, placed at the
+// middle of its front bottom, front left and bottom left edges.
+void push_dimension_labels (struct text_renderer_t *tr, struct closet_scene_t *closet_scene,
+                            struct closet_t *cl, app_graphics_t *graphics)
+{
+    uint32_t i;
+    for (i=0; i<cl->num_holes; i++) {
+        struct cuboid_t *h = &cl->holes[i].h;
+        push_label (tr, closet_scene, graphics, h->v[1], h->v[5], CUBOID_SIZE_X(*h));
+        push_label (tr, closet_scene, graphics, h->v[1], h->v[3], CUBOID_SIZE_Y(*h));
+        push_label (tr, closet_scene, graphics, h->v[0], h->v[1], CUBOID_SIZE_Z(*h));
+    }
 }
 
 void render_closet_opaque (struct closet_scene_t *closet_scene)
@@ -826,22 +424,44 @@ void render_closet_opaque (struct closet_scene_t *closet_scene)
 
     glEnable (GL_DEPTH_TEST);
     glBindVertexArray (closet_scene->holes_vao);
-    glUniform4f (closet_scene->color_loc, 1, 1, 1, 1);
-    glDrawArrays (GL_TRIANGLES, 0, closet_scene->holes_vao_size);
+    glUniform1f (closet_scene->alpha_loc, 1);
+    gl_draw_arrays_instanced (GL_TRIANGLES, 0, 36, closet_scene->num_holes);
 }
 
-void render_closet_transparent (struct closet_scene_t *closet_scene, struct closet_t *cl)
+void render_closet_transparent (struct closet_scene_t *closet_scene)
 {
     glUseProgram (closet_scene->program_id);
 
     glBindVertexArray (closet_scene->seps_vao);
+    glUniform1f (closet_scene->alpha_loc, 0.8);
+    gl_draw_arrays_instanced (GL_TRIANGLES, 0, 36, closet_scene->num_sep_parts);
+}
 
-    int i;
-    for (i=0; i<cl->num_sep_parts; i++) {
-        fvec3 c = cl->sep_parts[i].color;
-        glUniform4f (closet_scene->color_loc, c.r, c.g, c.b, 0.8);
-        glDrawArrays (GL_TRIANGLES, i*36, 36);
-    }
+// Renders all transparent geometry into the accum and revealage targets of the
+// currently bound framebuffer. Expects blending to be already configured.
+void render_closet_transparent_wboit (struct closet_scene_t *closet_scene)
+{
+    glUseProgram (closet_scene->wboit_program_id);
+
+    glBindVertexArray (closet_scene->seps_vao);
+    glUniform1f (closet_scene->wboit_alpha_loc, 0.8);
+    gl_draw_arrays_instanced (GL_TRIANGLES, 0, 36, closet_scene->num_sep_parts);
+}
+
+// Writes the premultiplied result of weighted blended OIT into the currently
+// bound framebuffer.
+void render_wboit_composite (struct closet_scene_t *closet_scene,
+                             GLuint accum_texture, GLuint revealage_texture)
+{
+    glUseProgram (closet_scene->wboit_composite_program_id);
+
+    glActiveTexture (GL_TEXTURE0);
+    glBindTexture (GL_TEXTURE_2D_MULTISAMPLE, accum_texture);
+    glActiveTexture (GL_TEXTURE1);
+    glBindTexture (GL_TEXTURE_2D_MULTISAMPLE, revealage_texture);
+
+    glBindVertexArray (closet_scene->empty_vao);
+    gl_draw_arrays (GL_TRIANGLES, 0, 3);
 }
 
 void depth_peel_set_shader_slots (GLuint program_id,
@@ -866,6 +486,127 @@ void depth_peel_set_shader_slots (GLuint program_id,
     glUniform1i (glGetUniformLocation (program_id, "opaque_depth_map"), 1);
 }
 
+#define MAX_PEEL_PASSES 32
+
+// Depth peeling renders one layer of transparent geometry per pass. In
+// adaptive mode peeling stops once a pass doesn't write any fragment, using
+// occlusion queries. In both modes at most max_passes are rendered.
+struct depth_peel_config_t {
+    bool adaptive;
+    int max_passes;
+    int last_num_passes; // Passes rendered in the last frame.
+    GLuint queries[MAX_PEEL_PASSES];
+};
+
+struct depth_peel_config_t depth_peel = {.adaptive = true, .max_passes = 8};
+
+void depth_peel_config_print (struct depth_peel_config_t *cfg)
+{
+    printf ("Depth peeling: %s, max %d passes\n",
+            cfg->adaptive ? "adaptive" : "fixed", cfg->max_passes);
+}
+
+enum transparency_mode_t {
+    TRANSPARENCY_DEPTH_PEELING,
+    TRANSPARENCY_WBOIT,
+    TRANSPARENCY_COMPARE, // Depth peeling on the left half, WBOIT on the right.
+
+    NUM_TRANSPARENCY_MODES
+};
+
+char *transparency_mode_names[] = {
+    "depth peeling",
+    "weighted blended OIT",
+    "compare (left: depth peeling, right: weighted blended OIT)"
+};
+
+enum transparency_mode_t transparency_mode = TRANSPARENCY_DEPTH_PEELING;
+
+enum transparency_technique_t {
+    TECHNIQUE_DEPTH_PEELING,
+    TECHNIQUE_WBOIT,
+
+    NUM_TRANSPARENCY_TECHNIQUES
+};
+
+// GPU time spent rendering transparent geometry with each technique, measured
+// with GL_TIME_ELAPSED queries. Queries are double buffered, results are read
+// one frame late so we don't stall waiting for them.
+#define TRANSPARENCY_TIMING_FRAMES 60
+struct transparency_timing_t {
+    GLuint queries[NUM_TRANSPARENCY_TECHNIQUES][2];
+    bool pending[NUM_TRANSPARENCY_TECHNIQUES][2];
+    int curr;
+
+    double total_ms[NUM_TRANSPARENCY_TECHNIQUES];
+    int num_samples[NUM_TRANSPARENCY_TECHNIQUES];
+    double last_ms[NUM_TRANSPARENCY_TECHNIQUES];
+};
+
+struct transparency_timing_t transparency_timing;
+
+void transparency_timer_begin (struct transparency_timing_t *t, enum transparency_technique_t tech)
+{
+    glBeginQuery (GL_TIME_ELAPSED, t->queries[tech][t->curr]);
+    t->pending[tech][t->curr] = true;
+}
+
+void transparency_timer_end ()
+{
+    glEndQuery (GL_TIME_ELAPSED);
+}
+
+// Collects the results of the previous frame and prints the average times
+// every TRANSPARENCY_TIMING_FRAMES frames if _print_ is true.
+void transparency_timing_end_frame (struct transparency_timing_t *t, bool print)
+{
+    t->curr = (t->curr + 1)%2;
+
+    int tech;
+    for (tech=0; tech<NUM_TRANSPARENCY_TECHNIQUES; tech++) {
+        if (t->pending[tech][t->curr]) {
+            GLuint64 elapsed_ns;
+            glGetQueryObjectui64v (t->queries[tech][t->curr], GL_QUERY_RESULT, &elapsed_ns);
+            t->pending[tech][t->curr] = false;
+
+            t->last_ms[tech] = (double)elapsed_ns/1000000;
+            t->total_ms[tech] += t->last_ms[tech];
+            t->num_samples[tech]++;
+        }
+    }
+
+    if (t->num_samples[TECHNIQUE_DEPTH_PEELING] >= TRANSPARENCY_TIMING_FRAMES ||
+        t->num_samples[TECHNIQUE_WBOIT] >= TRANSPARENCY_TIMING_FRAMES) {
+        if (print) {
+            printf ("Transparency GPU time:");
+            if (t->num_samples[TECHNIQUE_DEPTH_PEELING] > 0) {
+                printf (" depth peeling %.3f ms",
+                        t->total_ms[TECHNIQUE_DEPTH_PEELING]/t->num_samples[TECHNIQUE_DEPTH_PEELING]);
+            }
+            if (t->num_samples[TECHNIQUE_WBOIT] > 0) {
+                printf (" weighted blended OIT %.3f ms",
+                        t->total_ms[TECHNIQUE_WBOIT]/t->num_samples[TECHNIQUE_WBOIT]);
+            }
+            printf ("\n");
+        }
+
+        for (tech=0; tech<NUM_TRANSPARENCY_TECHNIQUES; tech++) {
+            t->total_ms[tech] = 0;
+            t->num_samples[tech] = 0;
+        }
+    }
+}
+
+// Toggled with F2, draws the last frames recorded by the profiler on top of
+// the scene. F3 dumps them to profile.tsv.
+#define PROFILER_OVERLAY_WIDTH 480
+#define PROFILER_OVERLAY_HEIGHT 220
+bool show_profiler = false;
+
+// Toggled with L, draws the dimensions of each hole.
+#define LABEL_FONT_SIZE 13
+bool show_labels = false;
+
 fvec3 undefined_color = FVEC3 (1,1,0);
 fvec3 selected_color = FVEC3(0.93,0.5,0.1);
 
@@ -875,15 +616,63 @@ bool update_and_render (struct app_state_t *st, app_graphics_t *graphics, app_in
     st->gui_st.gr = *graphics;
     if (!st->is_initialized) {
         st->end_execution = false;
+        // NOTE: The GUI's work queue isn't started, its only work is blurring
+        // CSS box shadows and we don't draw any. css_blur() blurs in this
+        // thread when the queue has no workers.
+        global_gui_st = &st->gui_st;
         st->is_initialized = true;
     }
 
     update_input (&st->gui_st, input);
 
+    // NOTE: Rendering is skipped unless something visible changed. Code that
+    // changes what's displayed must set this.
+    bool redraw = input.force_redraw;
+
     switch (st->gui_st.input.keycode) {
         case 24: //KEY_Q
             st->end_execution = true;
             break;
+        case 40: //KEY_D
+            gl_frame_stats_print (&gl_frame_stats);
+            printf ("Peel passes: %d\n", depth_peel.last_num_passes);
+            printf ("Transparency GPU time: depth peeling %.3f ms, weighted blended OIT %.3f ms\n",
+                    transparency_timing.last_ms[TECHNIQUE_DEPTH_PEELING],
+                    transparency_timing.last_ms[TECHNIQUE_WBOIT]);
+            break;
+        case 33: //KEY_P
+            depth_peel.adaptive = !depth_peel.adaptive;
+            redraw = true;
+            depth_peel_config_print (&depth_peel);
+            break;
+        case 34: //KEY_LEFT_BRACKET
+            depth_peel.max_passes = CLAMP (depth_peel.max_passes - 1, 1, MAX_PEEL_PASSES);
+            redraw = true;
+            depth_peel_config_print (&depth_peel);
+            break;
+        case 35: //KEY_RIGHT_BRACKET
+            depth_peel.max_passes = CLAMP (depth_peel.max_passes + 1, 1, MAX_PEEL_PASSES);
+            redraw = true;
+            depth_peel_config_print (&depth_peel);
+            break;
+        case 68: //KEY_F2
+            show_profiler = !show_profiler;
+            redraw = true;
+            break;
+        case 69: //KEY_F3
+            if (prof_dump (&global_profiler, "profile.tsv")) {
+                printf ("Wrote profile.tsv\n");
+            }
+            break;
+        case 46: //KEY_L
+            show_labels = !show_labels;
+            redraw = true;
+            break;
+        case 96: //KEY_F12
+            if (trace_dump ("trace.json")) {
+                printf ("Wrote trace.json\n");
+            }
+            break;
         default:
             //if (input.keycode >= 8) {
             //    printf ("%" PRIu8 "\n", input.keycode);
@@ -894,9 +683,11 @@ bool update_and_render (struct app_state_t *st, app_graphics_t *graphics, app_in
 
     static struct closet_scene_t closet_scene;
     static struct quad_renderer_t quad_renderer;
+    static struct text_renderer_t text_renderer;
     static struct closet_t cl;
     static bool run_once = false;
     static struct camera_t main_camera;
+    static struct camera_t last_camera;
 
     static GLuint fb;
     static GLuint color_texture;
@@ -905,8 +696,16 @@ bool update_and_render (struct app_state_t *st, app_graphics_t *graphics, app_in
     static GLuint peel_depth_map;
     static GLuint opaque_depth_map;
 
+    static GLuint wboit_fb;
+    static GLuint accum_texture;
+    static GLuint revealage_texture;
+
+    static cairo_surface_t *profiler_surface;
+    static GLuint profiler_texture;
+
     if (!run_once) {
         run_once = true;
+        redraw = true;
 
         closet_scene = init_closet_scene ();
         if (closet_scene.program_id == 0) {
@@ -928,6 +727,43 @@ bool update_and_render (struct app_state_t *st, app_graphics_t *graphics, app_in
         create_depth_texture (&depth_texture, width, height, 4);
 
         quad_renderer = init_quad_renderer ();
+        text_renderer = init_text_renderer ("Sans", LABEL_FONT_SIZE);
+        glGenQueries (MAX_PEEL_PASSES, depth_peel.queries);
+        glGenQueries (2*NUM_TRANSPARENCY_TECHNIQUES, &transparency_timing.queries[0][0]);
+
+        // Weighted blended OIT framebuffer. It shares the opaque depth buffer
+        // so transparent fragments behind opaque ones get rejected by the
+        // depth test.
+        glGenFramebuffers (1, &wboit_fb);
+        glBindFramebuffer (GL_FRAMEBUFFER, wboit_fb);
+        create_color_texture_format (&accum_texture, GL_RGBA16F, width, height, 4);
+        create_color_texture_format (&revealage_texture, GL_R16F, width, height, 4);
+        glFramebufferTexture2D (
+            GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+            GL_TEXTURE_2D_MULTISAMPLE, accum_texture, 0
+        );
+        glFramebufferTexture2D (
+            GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1,
+            GL_TEXTURE_2D_MULTISAMPLE, revealage_texture, 0
+        );
+        glFramebufferTexture2D (
+            GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+            GL_TEXTURE_2D_MULTISAMPLE, opaque_depth_map, 0
+        );
+        GLenum wboit_draw_buffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+        glDrawBuffers (2, wboit_draw_buffers);
+        glBindFramebuffer (GL_FRAMEBUFFER, fb);
+
+        profiler_surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+                                                       PROFILER_OVERLAY_WIDTH,
+                                                       PROFILER_OVERLAY_HEIGHT);
+        glGenTextures (1, &profiler_texture);
+        glBindTexture (GL_TEXTURE_2D, profiler_texture);
+        glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexImage2D (GL_TEXTURE_2D, 0, GL_RGBA8,
+                      PROFILER_OVERLAY_WIDTH, PROFILER_OVERLAY_HEIGHT, 0,
+                      GL_BGRA, GL_UNSIGNED_BYTE, NULL);
 
         float separation = 0.025;
         struct hole_dimensions_t dim = HOLE_DIM_F (0.9, 0.4, 0.7);
@@ -939,8 +775,7 @@ bool update_and_render (struct app_state_t *st, app_graphics_t *graphics, app_in
         dim = HOLE_DIM (DIM_F(0.3), DIM_UNTIL(0, DOWN_FACE), DIM_COPY);
         push_hole (&cl, &dim, 1, RIGHT_FACE, RUF, separation);
 
-        update_closet_scene (&closet_scene, &cl);
-        color_separator (&cl.separators[0], selected_color);
+        color_separator (&cl, 0, selected_color);
 
         main_camera.near_plane = 0.1;
         main_camera.far_plane = 100;
@@ -952,14 +787,29 @@ bool update_and_render (struct app_state_t *st, app_graphics_t *graphics, app_in
     static int selected_separator = 0;
     switch (st->gui_st.input.keycode) {
         case 23: //KEY_TAB
-            color_separator (&cl.separators[selected_separator], undefined_color);
+            if (selected_separator != -1) {
+                color_separator (&cl, selected_separator, undefined_color);
+            }
             selected_separator++;
-            selected_separator = WRAP (selected_separator, 0, cl.num_seps - 1);
-            color_separator (&cl.separators[selected_separator], selected_color);
+            selected_separator = WRAP (selected_separator, 0, (int)cl.num_seps - 1);
+            color_separator (&cl, selected_separator, selected_color);
+            redraw = true;
             break;
         case 9: //KEY_ESC
-            color_separator (&cl.separators[selected_separator], undefined_color);
+            if (selected_separator != -1) {
+                color_separator (&cl, selected_separator, undefined_color);
+            }
             selected_separator = -1;
+            redraw = true;
+            break;
+        case 28: //KEY_T
+            if (closet_scene.wboit_program_id) {
+                transparency_mode = (transparency_mode + 1)%NUM_TRANSPARENCY_MODES;
+                printf ("Transparency: %s\n", transparency_mode_names[transparency_mode]);
+                redraw = true;
+            } else {
+                printf ("Weighted blended OIT is not available.\n");
+            }
             break;
         default:
             break;
@@ -978,7 +828,37 @@ bool update_and_render (struct app_state_t *st, app_graphics_t *graphics, app_in
     main_camera.width_m = px_to_m_x (graphics, graphics->width);
     main_camera.height_m = px_to_m_y (graphics, graphics->height);
 
+    // NOTE: A window resize changes the camera's width_m and height_m.
+    if (!camera_equal (&main_camera, &last_camera) ||
+        cl.dirty_holes.len > 0 || cl.dirty_sep_parts.len > 0) {
+        redraw = true;
+    }
+
+    // NOTE: Compare mode is used to measure GPU times, keep rendering so they
+    // stay up to date.
+    if (transparency_mode == TRANSPARENCY_COMPARE) {
+        redraw = true;
+    }
+
+    // NOTE: The profiler overlay shows the timing of the frames being rendered,
+    // it's only useful if we keep rendering.
+    if (show_profiler) {
+        redraw = true;
+    }
+
+    st->idle = !redraw && !st->gui_st.click_timer_pending;
+    if (!redraw) {
+        return false;
+    }
+
+    gl_frame_stats_begin ();
+    PROF_BEGIN ("scene upload");
+    update_closet_scene (&closet_scene, &cl);
+    PROF_END;
     closet_scene_set_camera (&closet_scene, &main_camera);
+    // NOTE: This is stored after closet_scene_set_camera() because it clamps
+    // the camera's values.
+    last_camera = main_camera;
 
     glEnable (GL_DEPTH_TEST);
     glEnable (GL_SAMPLE_SHADING);
@@ -1038,46 +918,127 @@ bool update_and_render (struct app_state_t *st, app_graphics_t *graphics, app_in
                                  opaque_color_texture, opaque_depth_map,
                                  peel_depth_map, depth_texture);
     glDisable (GL_BLEND);
+    GPU_PROF_BEGIN ("opaque");
     render_closet_opaque (&closet_scene);
+    GPU_PROF_END;
 
-    int num_pass = 8;
-
-    // Transparent passes fragment shader slot content:
-    //
-    // COLOR BUFFER: color_texture
-    // DEPTH BUFFER: depth_texture
-    // uniform peel_depth_map: peel_depth_map
-    // uniform opaque_depth_map: opaque_depth_map
-    depth_peel_set_shader_slots (closet_scene.program_id,
-                                 color_texture, depth_texture,
-                                 peel_depth_map, opaque_depth_map);
+    int half_width = graphics->width/2;
 
-    glDisable (GL_BLEND);
-    render_closet_transparent (&closet_scene, &cl);
+    if (transparency_mode != TRANSPARENCY_WBOIT) {
+        if (transparency_mode == TRANSPARENCY_COMPARE) {
+            glScissor (0, 0, half_width, graphics->height);
+        }
+        PROF_BEGIN ("depth peeling");
+        transparency_timer_begin (&transparency_timing, TECHNIQUE_DEPTH_PEELING);
+
+        int num_pass = depth_peel.max_passes;
+
+        // Transparent passes fragment shader slot content:
+        //
+        // COLOR BUFFER: color_texture
+        // DEPTH BUFFER: depth_texture
+        // uniform peel_depth_map: peel_depth_map
+        // uniform opaque_depth_map: opaque_depth_map
+        depth_peel_set_shader_slots (closet_scene.program_id,
+                                     color_texture, depth_texture,
+                                     peel_depth_map, opaque_depth_map);
+
+        glDisable (GL_BLEND);
+        GPU_PROF_BEGIN ("peel pass");
+        glBeginQuery (GL_ANY_SAMPLES_PASSED, depth_peel.queries[0]);
+        render_closet_transparent (&closet_scene);
+        glEndQuery (GL_ANY_SAMPLES_PASSED);
+        GPU_PROF_END;
+        depth_peel.last_num_passes = 1;
+
+        glEnable (GL_BLEND);
+        int i;
+        for (i = 1; i < num_pass; i++) {
+            // Swap the depth buffer with peel_depth_map shader slot
+            GLuint tmp = peel_depth_map;
+            peel_depth_map = depth_texture;
+            depth_texture = tmp;
+
+            glFramebufferTexture2D (
+                GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                GL_TEXTURE_2D_MULTISAMPLE, depth_texture, 0
+            );
+
+            glActiveTexture (GL_TEXTURE0);
+            glBindTexture (GL_TEXTURE_2D_MULTISAMPLE, peel_depth_map);
+            glUniform1i (glGetUniformLocation (closet_scene.program_id, "peel_depth_map"), 0);
+
+            glClear(GL_DEPTH_BUFFER_BIT);
+
+            // Render scene using UNDER blending operator
+            glBlendFunc (GL_ONE_MINUS_SRC_ALPHA, GL_ONE);
+            GPU_PROF_BEGIN ("peel pass");
+            glBeginQuery (GL_ANY_SAMPLES_PASSED, depth_peel.queries[i]);
+            render_closet_transparent (&closet_scene);
+            glEndQuery (GL_ANY_SAMPLES_PASSED);
+            GPU_PROF_END;
+            depth_peel.last_num_passes++;
+
+            // NOTE: We wait for the result of the previous pass, not this one, so
+            // the GPU always has work queued while we block. If the previous pass
+            // wrote nothing then the peel depth map of this one was all 1's, so
+            // every fragment was discarded and this pass didn't change anything.
+            if (depth_peel.adaptive) {
+                GLuint any_samples_passed;
+                glGetQueryObjectuiv (depth_peel.queries[i-1], GL_QUERY_RESULT, &any_samples_passed);
+                if (!any_samples_passed) {
+                    break;
+                }
+            }
+        }
 
-    glEnable (GL_BLEND);
-    int i;
-    for (i = 0; i < num_pass-1; i++) {
-        // Swap the depth buffer with peel_depth_map shader slot
-        GLuint tmp = peel_depth_map;
-        peel_depth_map = depth_texture;
-        depth_texture = tmp;
+        transparency_timer_end ();
+        PROF_END;
+    }
 
+    if (transparency_mode != TRANSPARENCY_DEPTH_PEELING) {
+        if (transparency_mode == TRANSPARENCY_COMPARE) {
+            glScissor (half_width, 0, graphics->width - half_width, graphics->height);
+        }
+        PROF_BEGIN ("wboit");
+        transparency_timer_begin (&transparency_timing, TECHNIQUE_WBOIT);
+
+        // Accumulate all transparent fragments in a single pass. Depth writes
+        // are disabled so opaque_depth_map is only used for testing.
+        glBindFramebuffer (GL_FRAMEBUFFER, wboit_fb);
+        float accum_clear[] = {0, 0, 0, 0};
+        float revealage_clear[] = {1, 1, 1, 1};
+        glClearBufferfv (GL_COLOR, 0, accum_clear);
+        glClearBufferfv (GL_COLOR, 1, revealage_clear);
+
+        glEnable (GL_DEPTH_TEST);
+        glDepthMask (GL_FALSE);
+        glEnable (GL_BLEND);
+        glBlendFunci (0, GL_ONE, GL_ONE);
+        glBlendFunci (1, GL_ZERO, GL_ONE_MINUS_SRC_COLOR);
+        GPU_PROF_BEGIN ("wboit accumulate");
+        render_closet_transparent_wboit (&closet_scene);
+        GPU_PROF_END;
+        glDepthMask (GL_TRUE);
+
+        // Resolve into color_texture, so it's composited the same way as the
+        // result of depth peeling.
+        glBindFramebuffer (GL_FRAMEBUFFER, fb);
         glFramebufferTexture2D (
-            GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
-            GL_TEXTURE_2D_MULTISAMPLE, depth_texture, 0
+            GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+            GL_TEXTURE_2D_MULTISAMPLE, color_texture, 0
         );
-
-        glActiveTexture (GL_TEXTURE0);
-        glBindTexture (GL_TEXTURE_2D_MULTISAMPLE, peel_depth_map);
-        glUniform1i (glGetUniformLocation (closet_scene.program_id, "peel_depth_map"), 0);
-
-        glClear(GL_DEPTH_BUFFER_BIT);
-
-        // Render scene using UNDER blending operator
-        glBlendFunc (GL_ONE_MINUS_SRC_ALPHA, GL_ONE);
-        render_closet_transparent (&closet_scene, &cl);
+        glDisable (GL_DEPTH_TEST);
+        glDisable (GL_BLEND);
+        GPU_PROF_BEGIN ("wboit composite");
+        render_wboit_composite (&closet_scene, accum_texture, revealage_texture);
+        GPU_PROF_END;
+        glEnable (GL_DEPTH_TEST);
+
+        transparency_timer_end ();
+        PROF_END;
     }
+    transparency_timing_end_frame (&transparency_timing, transparency_mode == TRANSPARENCY_COMPARE);
 
     // Blend resulting color buffers into the window using the OVER operator
     glBlendFunc (GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
@@ -1091,6 +1052,35 @@ bool update_and_render (struct app_state_t *st, app_graphics_t *graphics, app_in
     blend_premul_quad (&quad_renderer, color_texture, true, graphics,
                         0, 0, graphics->width, graphics->height);
 
+    if (show_labels) {
+        PROF_BEGIN ("labels");
+        text_renderer_begin (&text_renderer);
+        push_dimension_labels (&text_renderer, &closet_scene, &cl, graphics);
+        text_renderer_flush (&text_renderer, graphics);
+        PROF_END;
+    }
+
+    if (show_profiler) {
+        PROF_BEGIN ("profiler overlay");
+        cairo_t *cr = cairo_create (profiler_surface);
+        prof_draw_overlay (cr, &global_profiler, PROFILER_OVERLAY_WIDTH, PROFILER_OVERLAY_HEIGHT);
+        cairo_destroy (cr);
+        cairo_surface_flush (profiler_surface);
+
+        glBindTexture (GL_TEXTURE_2D, profiler_texture);
+        glTexSubImage2D (GL_TEXTURE_2D, 0, 0, 0,
+                         PROFILER_OVERLAY_WIDTH, PROFILER_OVERLAY_HEIGHT,
+                         GL_BGRA, GL_UNSIGNED_BYTE,
+                         cairo_image_surface_get_data (profiler_surface));
+
+        // NOTE: Cairo's first row is the top one, GL's is the bottom one.
+        set_texture_clip (&quad_renderer, PROFILER_OVERLAY_WIDTH, PROFILER_OVERLAY_HEIGHT,
+                          0, PROFILER_OVERLAY_HEIGHT, PROFILER_OVERLAY_WIDTH, -PROFILER_OVERLAY_HEIGHT);
+        blend_premul_quad (&quad_renderer, profiler_texture, false, graphics,
+                           10, 10, PROFILER_OVERLAY_WIDTH, PROFILER_OVERLAY_HEIGHT);
+        PROF_END;
+    }
+
     return true;
 }
 
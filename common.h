@@ -1651,60 +1651,199 @@ void cont_buff_destroy (cont_buff_t *buff)
 }
 
 // Memory pool that grows as needed, and can be freed easily.
+//
+// Each new bin is twice the size of the previous one, up to
+// MEM_POOL_MAX_GROWTH_BIN_SIZE, so a pool that grows a lot makes few calls to
+// malloc(). Bins released by mem_pool_end_temporary_memory() are kept in a
+// free list and reused, pools flushed every frame end up not allocating at
+// all. Bins made for a single push bigger than the pool would grow to on its
+// own are freed instead, so one big push doesn't stay allocated. Bins of at least MEM_POOL_MMAP_THRESHOLD bytes are mapped directly with
+// mmap() and can be backed by huge pages.
+#include <sys/mman.h>
+
 #define MEM_POOL_MIN_BIN_SIZE 1024u
-typedef struct {
-    uint32_t min_bin_size;
-    uint32_t size;
-    uint32_t used;
-    void *base;
+#define MEM_POOL_MAX_GROWTH_BIN_SIZE megabyte(8)
+#define MEM_POOL_MAX_FREE_BINS 8
 
-    uint32_t total_used;
-    uint32_t num_bins;
-} mem_pool_t;
+#if !defined(MEM_POOL_MMAP_THRESHOLD)
+#define MEM_POOL_MMAP_THRESHOLD megabyte(1)
+#endif
+#define MEM_POOL_HUGE_PAGE_SIZE megabyte(2)
 
 struct _bin_info_t {
     void *base;
-    uint32_t size;
+    uint64_t size;
     struct _bin_info_t *prev_bin_info;
+    bool is_mmapped;
+    bool is_oversized; // Made for a push that doesn't fit in a normal bin
 };
 
 typedef struct _bin_info_t bin_info_t;
 
+typedef struct {
+    uint64_t min_bin_size;
+    uint64_t size;
+    uint64_t used;
+    void *base;
+
+    uint64_t total_used;
+    uint64_t total_padding; // Included in total_used
+    uint32_t num_bins;
+
+    // Released bins, linked through prev_bin_info.
+    bin_info_t *free_bins;
+    uint32_t num_free_bins;
+} mem_pool_t;
+
+// Number of bins allocated and freed by all pools, to measure malloc churn.
+uint64_t mem_pool_bins_allocated = 0;
+uint64_t mem_pool_bins_freed = 0;
+
 enum alloc_opts {
     POOL_UNINITIALIZED,
     POOL_ZERO_INIT
 };
 
-#define mem_pool_push_struct(pool, type) mem_pool_push_size(pool, sizeof(type))
-#define mem_pool_push_array(pool, n, type) mem_pool_push_size(pool, (n)*sizeof(type))
-#define mem_pool_push_size(pool, size) mem_pool_push_size_full(pool, size, POOL_UNINITIALIZED)
-void* mem_pool_push_size_full (mem_pool_t *pool, uint32_t size, enum alloc_opts opts)
+bin_info_t* mem_pool_bin_alloc (uint64_t size)
 {
-    if (pool->used + size >= pool->size) {
-        pool->num_bins++;
-        int new_bin_size = MAX (MAX (MEM_POOL_MIN_BIN_SIZE, pool->min_bin_size), size);
-        void *new_bin;
-        bin_info_t *new_info;
-        if ((new_bin = malloc (new_bin_size + sizeof(bin_info_t)))) {
-            new_info = (bin_info_t*)((uint8_t*)new_bin + new_bin_size);
-        } else {
-            printf ("Malloc failed.\n");
+    // NOTE: Sizes are rounded so the bin_info_t at the end is aligned.
+    size = (size + 15) & ~(uint64_t)15;
+
+    void *new_bin;
+    bool is_mmapped = false;
+    if (size + sizeof(bin_info_t) >= MEM_POOL_MMAP_THRESHOLD) {
+        uint64_t page_size = sysconf (_SC_PAGESIZE);
+        uint64_t map_size = (size + sizeof(bin_info_t) + page_size - 1)/page_size*page_size;
+        new_bin = mmap (NULL, map_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (new_bin == MAP_FAILED) {
+            printf ("mmap failed.\n");
             return NULL;
         }
+#if defined(MADV_HUGEPAGE)
+        if (map_size >= MEM_POOL_HUGE_PAGE_SIZE) {
+            madvise (new_bin, map_size, MADV_HUGEPAGE);
+        }
+#endif
+        // The rounding to pages is usable space too.
+        size = map_size - sizeof(bin_info_t);
+        size = size & ~(uint64_t)15;
+        is_mmapped = true;
 
-        new_info->base = new_bin;
-        new_info->size = new_bin_size;
+    } else if (!(new_bin = malloc (size + sizeof(bin_info_t)))) {
+        printf ("Malloc failed.\n");
+        return NULL;
+    }
+    __atomic_add_fetch (&mem_pool_bins_allocated, 1, __ATOMIC_RELAXED);
 
-        if (pool->base == NULL) {
-            new_info->prev_bin_info = NULL;
-        } else {
-            bin_info_t *prev_info = (bin_info_t*)((uint8_t*)pool->base + pool->size);
-            new_info->prev_bin_info = prev_info;
+    bin_info_t *info = (bin_info_t*)((uint8_t*)new_bin + size);
+    info->base = new_bin;
+    info->size = size;
+    info->prev_bin_info = NULL;
+    info->is_mmapped = is_mmapped;
+    info->is_oversized = false;
+    return info;
+}
+
+void mem_pool_bin_free (bin_info_t *info)
+{
+    __atomic_add_fetch (&mem_pool_bins_freed, 1, __ATOMIC_RELAXED);
+    if (info->is_mmapped) {
+        munmap (info->base, info->size + sizeof(bin_info_t));
+    } else {
+        free (info->base);
+    }
+}
+
+// Puts the bin in the free list of _pool_. If it's full the smallest bin,
+// which could be _info_ itself, is freed. Oversized bins are always freed.
+void mem_pool_bin_release (mem_pool_t *pool, bin_info_t *info)
+{
+    if (info->is_oversized) {
+        mem_pool_bin_free (info);
+        return;
+    }
+
+    info->prev_bin_info = pool->free_bins;
+    pool->free_bins = info;
+    pool->num_free_bins++;
+
+    if (pool->num_free_bins > MEM_POOL_MAX_FREE_BINS) {
+        bin_info_t **smallest = &pool->free_bins;
+        bin_info_t **curr = &pool->free_bins;
+        while (*curr != NULL) {
+            if ((*curr)->size < (*smallest)->size) {
+                smallest = curr;
+            }
+            curr = &(*curr)->prev_bin_info;
         }
 
-        pool->used = 0;
-        pool->size = new_bin_size;
-        pool->base = new_bin;
+        bin_info_t *to_free = *smallest;
+        *smallest = to_free->prev_bin_info;
+        pool->num_free_bins--;
+        mem_pool_bin_free (to_free);
+    }
+}
+
+// Makes _pool_ push to a new bin with room for at least _size_ bytes. The
+// smallest free bin where they fit is reused before allocating a new one.
+bool mem_pool_new_bin (mem_pool_t *pool, uint64_t size)
+{
+    uint64_t new_bin_size = MAX (MEM_POOL_MIN_BIN_SIZE, pool->min_bin_size);
+    if (pool->base != NULL) {
+        new_bin_size = MAX (new_bin_size, MIN (2*pool->size, MEM_POOL_MAX_GROWTH_BIN_SIZE));
+    }
+    // NOTE: The bin must have room for at least one more byte, see the
+    // condition in mem_pool_push_size_full().
+    uint64_t min_size = size + 1;
+
+    // Take the smallest free bin where _size_ fits, so small pushes don't
+    // use up the big bins.
+    bin_info_t *new_info = NULL;
+    bin_info_t **best = NULL;
+    bin_info_t **curr = &pool->free_bins;
+    while (*curr != NULL) {
+        if ((*curr)->size >= min_size && (best == NULL || (*curr)->size < (*best)->size)) {
+            best = curr;
+        }
+        curr = &(*curr)->prev_bin_info;
+    }
+
+    if (best != NULL) {
+        new_info = *best;
+        *best = new_info->prev_bin_info;
+        pool->num_free_bins--;
+
+    } else {
+        new_info = mem_pool_bin_alloc (MAX (new_bin_size, min_size));
+        if (new_info == NULL) {
+            return false;
+        }
+        new_info->is_oversized = min_size > MAX (new_bin_size, MEM_POOL_MAX_GROWTH_BIN_SIZE);
+    }
+
+    pool->num_bins++;
+    if (pool->base == NULL) {
+        new_info->prev_bin_info = NULL;
+    } else {
+        bin_info_t *prev_info = (bin_info_t*)((uint8_t*)pool->base + pool->size);
+        new_info->prev_bin_info = prev_info;
+    }
+
+    pool->used = 0;
+    pool->size = new_info->size;
+    pool->base = new_info->base;
+    return true;
+}
+
+#define mem_pool_push_struct(pool, type) mem_pool_push_size(pool, sizeof(type))
+#define mem_pool_push_array(pool, n, type) mem_pool_push_size(pool, (n)*sizeof(type))
+#define mem_pool_push_size(pool, size) mem_pool_push_size_full(pool, size, POOL_UNINITIALIZED)
+void* mem_pool_push_size_full (mem_pool_t *pool, uint64_t size, enum alloc_opts opts)
+{
+    if (pool->used + size >= pool->size) {
+        if (!mem_pool_new_bin (pool, size)) {
+            return NULL;
+        }
     }
 
     void *ret = (uint8_t*)pool->base + pool->used;
@@ -1717,26 +1856,68 @@ void* mem_pool_push_size_full (mem_pool_t *pool, uint32_t size, enum alloc_opts
     return ret;
 }
 
+static inline
+uint64_t mem_pool_align_padding (mem_pool_t *pool, uint32_t alignment)
+{
+    uintptr_t next = (uintptr_t)pool->base + pool->used;
+    return (alignment - next%alignment)%alignment;
+}
+
+// Like mem_pool_push_size_full() but the result is a multiple of _alignment_,
+// which must be a power of 2. The padding is at most _alignment_-1 bytes, and
+// 0 when the next free byte is already aligned.
+//
+// NOTE: malloc()ed bins start at 16 byte boundaries, mmap()ed ones at page
+// boundaries.
+#define mem_pool_push_struct_aligned(pool, type, alignment) mem_pool_push_size_aligned(pool, sizeof(type), alignment)
+#define mem_pool_push_array_aligned(pool, n, type, alignment) mem_pool_push_size_aligned(pool, (n)*sizeof(type), alignment)
+#define mem_pool_push_size_aligned(pool, size, alignment) mem_pool_push_size_aligned_full(pool, size, alignment, POOL_UNINITIALIZED)
+void* mem_pool_push_size_aligned_full (mem_pool_t *pool, uint64_t size, uint32_t alignment,
+                                       enum alloc_opts opts)
+{
+    assert (alignment > 0 && (alignment & (alignment-1)) == 0 && "Alignment must be a power of 2");
+
+    uint64_t padding = mem_pool_align_padding (pool, alignment);
+    if (pool->base == NULL || pool->used + padding + size >= pool->size) {
+        // Room for the worst case padding in the new bin.
+        if (!mem_pool_new_bin (pool, size + alignment - 1)) {
+            return NULL;
+        }
+        padding = mem_pool_align_padding (pool, alignment);
+    }
+
+    pool->used += padding;
+    pool->total_used += padding;
+    pool->total_padding += padding;
+    return mem_pool_push_size_full (pool, size, opts);
+}
+
 // NOTE: Do NOT use _pool_ again after calling this. We don't reset pool because
 // it could have been bootstrapped into itself. Reusing is better hendled by
 // mem_pool_end_temporary_memory().
 void mem_pool_destroy (mem_pool_t *pool)
 {
+    bin_info_t *free_bins = pool->free_bins;
     if (pool->base != NULL) {
         bin_info_t *curr_info = (bin_info_t*)((uint8_t*)pool->base + pool->size);
 
-        void *to_free = curr_info->base;
-        curr_info = curr_info->prev_bin_info;
+        // NOTE: The pool may live in one of its bins, everything we need from
+        // it must be read before freeing them.
         while (curr_info != NULL) {
-            free (to_free);
-            to_free = curr_info->base;
-            curr_info = curr_info->prev_bin_info;
+            bin_info_t *prev_info = curr_info->prev_bin_info;
+            mem_pool_bin_free (curr_info);
+            curr_info = prev_info;
         }
-        free (to_free);
+    }
+
+    while (free_bins != NULL) {
+        bin_info_t *prev_info = free_bins->prev_bin_info;
+        mem_pool_bin_free (free_bins);
+        free_bins = prev_info;
     }
 }
 
-uint32_t mem_pool_allocated (mem_pool_t *pool)
+uint64_t mem_pool_allocated (mem_pool_t *pool)
 {
     uint64_t allocated = 0;
     if (pool->base != NULL) {
@@ -1751,12 +1932,14 @@ uint32_t mem_pool_allocated (mem_pool_t *pool)
 
 void mem_pool_print (mem_pool_t *pool)
 {
-    uint32_t allocated = mem_pool_allocated(pool);
-    printf ("Allocated: %u bytes\n", allocated);
-    printf ("Available: %u bytes\n", pool->size-pool->used);
-    printf ("Used: %u bytes (%.2f%%)\n", pool->total_used, ((double)pool->total_used*100)/allocated);
+    uint64_t allocated = mem_pool_allocated(pool);
+    printf ("Allocated: %" PRIu64 " bytes\n", allocated);
+    printf ("Available: %" PRIu64 " bytes\n", pool->size-pool->used);
+    printf ("Used: %" PRIu64 " bytes (%.2f%%)\n", pool->total_used, ((double)pool->total_used*100)/allocated);
     uint64_t info_size = pool->num_bins*sizeof(bin_info_t);
-    printf ("Info: %lu bytes (%.2f%%)\n", info_size, ((double)info_size*100)/allocated);
+    printf ("Info: %" PRIu64 " bytes (%.2f%%)\n", info_size, ((double)info_size*100)/allocated);
+    printf ("Alignment padding: %" PRIu64 " bytes (%.2f%%)\n", pool->total_padding,
+            ((double)pool->total_padding*100)/allocated);
 
     // NOTE: This is the amount of space left empty in previous bins
     uint64_t left_empty;
@@ -1767,51 +1950,61 @@ void mem_pool_print (mem_pool_t *pool)
     else {
         left_empty = 0;
     }
-    printf ("Left empty: %lu bytes (%.2f%%)\n", left_empty, ((double)left_empty*100)/allocated);
+    printf ("Left empty: %" PRIu64 " bytes (%.2f%%)\n", left_empty, ((double)left_empty*100)/allocated);
     printf ("Bins: %u\n", pool->num_bins);
+    printf ("Free bins: %u\n", pool->num_free_bins);
 }
 
 typedef struct {
     mem_pool_t *pool;
     void* base;
-    uint32_t used;
-    uint32_t total_used;
+    uint64_t used;
+    uint64_t total_used;
+    uint64_t total_padding;
 } mem_pool_temp_marker_t;
 
 mem_pool_temp_marker_t mem_pool_begin_temporary_memory (mem_pool_t *pool)
 {
     mem_pool_temp_marker_t res;
     res.total_used = pool->total_used;
+    res.total_padding = pool->total_padding;
     res.used = pool->used;
     res.base = pool->base;
     res.pool = pool;
     return res;
 }
 
+// Bins allocated after _mrkr_ was taken are kept in the pool's free list,
+// except oversized ones, see mem_pool_bin_release().
 void mem_pool_end_temporary_memory (mem_pool_temp_marker_t mrkr)
 {
+    mem_pool_t *pool = mrkr.pool;
+    if (pool->base == NULL) {
+        return;
+    }
+
+    bin_info_t *curr_info = (bin_info_t*)((uint8_t*)pool->base + pool->size);
+    while (curr_info != NULL && curr_info->base != mrkr.base) {
+        bin_info_t *prev_info = curr_info->prev_bin_info;
+        mem_pool_bin_release (pool, curr_info);
+        curr_info = prev_info;
+        pool->num_bins--;
+    }
+
     if (mrkr.base != NULL) {
-        bin_info_t *curr_info = (bin_info_t*)((uint8_t*)mrkr.pool->base + mrkr.pool->size);
-        while (curr_info->base != mrkr.base) {
-            void *to_free = curr_info->base;
-            curr_info = curr_info->prev_bin_info;
-            free (to_free);
-            mrkr.pool->num_bins--;
-        }
-        mrkr.pool->size = curr_info->size;
-        mrkr.pool->base = mrkr.base;
-        mrkr.pool->used = mrkr.used;
-        mrkr.pool->total_used = mrkr.total_used;
+        pool->size = curr_info->size;
+        pool->base = mrkr.base;
+        pool->used = mrkr.used;
+        pool->total_used = mrkr.total_used;
+        pool->total_padding = mrkr.total_padding;
     } else {
-        // NOTE: Here mrkr was created before the pool was initialized, so we
-        // destroy everything.
-        mem_pool_destroy (mrkr.pool);
-
-        // This assumes pool wasn't bootstrapped after taking mrkr
-        mrkr.pool->size = 0;
-        mrkr.pool->base = NULL;
-        mrkr.pool->used = 0;
-        mrkr.pool->total_used = 0;
+        // NOTE: Here mrkr was created before the pool was initialized, all
+        // bins were released.
+        pool->size = 0;
+        pool->base = NULL;
+        pool->used = 0;
+        pool->total_used = 0;
+        pool->total_padding = 0;
     }
 }
 
@@ -1820,6 +2013,23 @@ void mem_pool_end_temporary_memory (mem_pool_temp_marker_t mrkr)
 #define pom_push_array(pool, n, type) pom_push_size(pool, (n)*sizeof(type))
 #define pom_push_size(pool, size) (pool==NULL? malloc(size) : mem_pool_push_size(pool,size))
 
+#define pom_push_struct_aligned(pool, type, alignment) pom_push_size_aligned(pool, sizeof(type), alignment)
+#define pom_push_array_aligned(pool, n, type, alignment) pom_push_size_aligned(pool, (n)*sizeof(type), alignment)
+#define pom_push_size_aligned(pool, size, alignment) \
+    (pool==NULL? pom_aligned_malloc(size,alignment) : mem_pool_push_size_aligned(pool,size,alignment))
+
+// NOTE: Free the result with free().
+static inline
+void* pom_aligned_malloc (uint64_t size, uint32_t alignment)
+{
+    void *res;
+    if (posix_memalign (&res, MAX (alignment, sizeof(void*)), size) != 0) {
+        printf ("Malloc failed.\n");
+        return NULL;
+    }
+    return res;
+}
+
 static inline
 void* pom_strndup (mem_pool_t *pool, void *str, uint32_t str_len)
 {
@@ -2258,16 +2468,502 @@ bool download_file (const char *url, char *path)
 ///////////////
 //
 //  THREADING
+//
+// Locks first spin for a while and then sleep on a futex, so short critical
+// sections don't pay for a syscall and long ones don't burn a core. The zero
+// value of mutex_t and rwlock_t is an unlocked lock.
+//
+// Defining LOCK_STATS before including this file makes locks count how often
+// they were contended, spun, slept and for how long they were held. Print
+// them with lock_stats_print().
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__ ("yield" ::: "memory")
+#else
+#define cpu_relax()
+#endif
+
+// Iterations a lock spins before sleeping, each one executes cpu_relax().
+#define LOCK_SPIN_COUNT 128
 
-//  Handmade busywait mutex for GCC
+static inline
+void futex_wait (uint32_t *addr, uint32_t val)
+{
+    syscall (SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline
+void futex_wake (uint32_t *addr, int count)
+{
+    syscall (SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+struct lock_stats_t {
+    uint64_t acquisitions;
+    uint64_t contended; // Acquisitions that didn't get the lock at once
+    uint64_t spins;
+    uint64_t waits;     // Times a thread slept on the futex
+    uint64_t hold_ns;   // Exclusive acquisitions only
+    uint64_t max_hold_ns;
+};
+
+#if defined(LOCK_STATS)
+#include <time.h>
+
+static inline
+uint64_t lock_stats_now_ns ()
+{
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+// NOTE: Shared acquisitions of a rwlock_t update stats concurrently, so all
+// counters are updated atomically.
+static inline
+void lock_stats_acquired (struct lock_stats_t *stats, uint64_t spins, uint64_t waits)
+{
+    __atomic_add_fetch (&stats->acquisitions, 1, __ATOMIC_RELAXED);
+    if (spins > 0 || waits > 0) {
+        __atomic_add_fetch (&stats->contended, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch (&stats->spins, spins, __ATOMIC_RELAXED);
+        __atomic_add_fetch (&stats->waits, waits, __ATOMIC_RELAXED);
+    }
+}
+
+// Must be called while the lock is still held exclusively.
+static inline
+void lock_stats_released (struct lock_stats_t *stats, uint64_t lock_time)
+{
+    uint64_t hold = lock_stats_now_ns () - lock_time;
+    stats->hold_ns += hold;
+    stats->max_hold_ns = MAX (stats->max_hold_ns, hold);
+}
+#endif
+
+void lock_stats_print (char *name, struct lock_stats_t *stats)
+{
+#if defined(LOCK_STATS)
+    printf ("%s: %" PRIu64 " acquisitions, %" PRIu64 " contended (%.2f%%), "
+            "%" PRIu64 " spins, %" PRIu64 " waits, "
+            "hold %.3f ms total %.3f ms max\n",
+            name, stats->acquisitions, stats->contended,
+            stats->acquisitions ? (double)stats->contended*100/stats->acquisitions : 0,
+            stats->spins, stats->waits,
+            (double)stats->hold_ns/1e6, (double)stats->max_hold_ns/1e6);
+#else
+    printf ("%s: Compile with -DLOCK_STATS to get lock statistics.\n", name);
+#endif
+}
+
+// Mutex as described in "Futexes Are Tricky" by Ulrich Drepper. State is 0
+// when unlocked, 1 when locked and 2 when locked and some thread may be
+// sleeping on it, only then unlocking makes a syscall.
+struct mutex_t {
+    uint32_t state;
+
+#if defined(LOCK_STATS)
+    uint64_t lock_time;
+#endif
+    struct lock_stats_t stats;
+};
+
+bool mutex_trylock (struct mutex_t *mtx)
+{
+    uint32_t c = 0;
+    bool success = __atomic_compare_exchange_n (&mtx->state, &c, 1, false,
+                                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+#if defined(LOCK_STATS)
+    if (success) {
+        lock_stats_acquired (&mtx->stats, 0, 0);
+        mtx->lock_time = lock_stats_now_ns ();
+    }
+#endif
+    return success;
+}
+
+void mutex_lock (struct mutex_t *mtx)
+{
+    uint32_t c = 0;
+    uint64_t spins = 0, waits = 0;
+    if (!__atomic_compare_exchange_n (&mtx->state, &c, 1, false,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        bool locked = false;
+        while (spins < LOCK_SPIN_COUNT) {
+            cpu_relax ();
+            spins++;
+
+            // NOTE: Only try the CAS when it can succeed, so spinning threads
+            // don't keep stealing the cache line from the owner.
+            c = 0;
+            if (__atomic_load_n (&mtx->state, __ATOMIC_RELAXED) == 0 &&
+                __atomic_compare_exchange_n (&mtx->state, &c, 1, false,
+                                             __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                locked = true;
+                break;
+            }
+        }
+
+        if (!locked) {
+            // We don't know if there are other sleepers, so the lock is taken
+            // in the contended state. It costs a spurious wake at most.
+            c = __atomic_exchange_n (&mtx->state, 2, __ATOMIC_ACQUIRE);
+            while (c != 0) {
+                futex_wait (&mtx->state, 2);
+                waits++;
+                c = __atomic_exchange_n (&mtx->state, 2, __ATOMIC_ACQUIRE);
+            }
+        }
+    }
+
+#if defined(LOCK_STATS)
+    lock_stats_acquired (&mtx->stats, spins, waits);
+    mtx->lock_time = lock_stats_now_ns ();
+#endif
+}
+
+void mutex_unlock (struct mutex_t *mtx)
+{
+#if defined(LOCK_STATS)
+    lock_stats_released (&mtx->stats, mtx->lock_time);
+#endif
+
+    if (__atomic_exchange_n (&mtx->state, 0, __ATOMIC_RELEASE) == 2) {
+        futex_wake (&mtx->state, 1);
+    }
+}
+
+// Reader-writer lock, any number of readers or a single writer. Writers have
+// preference, once one is waiting new readers wait too.
+//
+// NOTE: This means taking a read lock recursively can deadlock.
+//
+// NOTE: Nothing in closet_maker uses it yet. The scene is only read and written
+// by the frame thread, work queue jobs only touch the buffers they are given.
+// See lock_bench.c for how it's tested.
+#define RWLOCK_WRITER 0x80000000u
+
+struct rwlock_t {
+    uint32_t state; // Number of readers, or RWLOCK_WRITER
+    uint32_t writers_waiting;
+
+    // Futex word, incremented by each unlock. Sleepers are counted so unlocks
+    // without anyone to wake don't make a syscall.
+    uint32_t seq;
+    uint32_t num_sleeping;
+
+#if defined(LOCK_STATS)
+    uint64_t lock_time;
+#endif
+    struct lock_stats_t stats;
+};
+
+static inline
+bool rwlock_try_read (struct rwlock_t *rw)
+{
+    uint32_t s = __atomic_load_n (&rw->state, __ATOMIC_SEQ_CST);
+    return !(s & RWLOCK_WRITER) &&
+           __atomic_load_n (&rw->writers_waiting, __ATOMIC_SEQ_CST) == 0 &&
+           __atomic_compare_exchange_n (&rw->state, &s, s+1, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static inline
+bool rwlock_try_write (struct rwlock_t *rw)
+{
+    uint32_t s = 0;
+    return __atomic_load_n (&rw->state, __ATOMIC_SEQ_CST) == 0 &&
+           __atomic_compare_exchange_n (&rw->state, &s, RWLOCK_WRITER, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+// Spins, then sleeps until _try_ succeeds. Returns the number of spins and
+// waits for the stats.
+static inline
+void rwlock_wait (struct rwlock_t *rw, bool (*try)(struct rwlock_t *rw),
+                  uint64_t *spins, uint64_t *waits)
+{
+    while (*spins < LOCK_SPIN_COUNT) {
+        cpu_relax ();
+        (*spins)++;
+        if (try (rw)) {
+            return;
+        }
+    }
+
+    while (true) {
+        __atomic_add_fetch (&rw->num_sleeping, 1, __ATOMIC_SEQ_CST);
+        uint32_t seq = __atomic_load_n (&rw->seq, __ATOMIC_SEQ_CST);
+        if (try (rw)) {
+            __atomic_sub_fetch (&rw->num_sleeping, 1, __ATOMIC_SEQ_CST);
+            return;
+        }
+        futex_wait (&rw->seq, seq);
+        (*waits)++;
+        __atomic_sub_fetch (&rw->num_sleeping, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static inline
+void rwlock_wake (struct rwlock_t *rw)
+{
+    __atomic_add_fetch (&rw->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&rw->num_sleeping, __ATOMIC_SEQ_CST) > 0) {
+        futex_wake (&rw->seq, INT_MAX);
+    }
+}
+
+void rwlock_read_lock (struct rwlock_t *rw)
+{
+    uint64_t spins = 0, waits = 0;
+    if (!rwlock_try_read (rw)) {
+        rwlock_wait (rw, rwlock_try_read, &spins, &waits);
+    }
+
+#if defined(LOCK_STATS)
+    lock_stats_acquired (&rw->stats, spins, waits);
+#endif
+}
+
+void rwlock_read_unlock (struct rwlock_t *rw)
+{
+    uint32_t s = __atomic_sub_fetch (&rw->state, 1, __ATOMIC_SEQ_CST);
+    if (s == 0 && __atomic_load_n (&rw->writers_waiting, __ATOMIC_SEQ_CST) > 0) {
+        rwlock_wake (rw);
+    }
+}
+
+void rwlock_write_lock (struct rwlock_t *rw)
+{
+    uint64_t spins = 0, waits = 0;
+    if (!rwlock_try_write (rw)) {
+        __atomic_add_fetch (&rw->writers_waiting, 1, __ATOMIC_SEQ_CST);
+        rwlock_wait (rw, rwlock_try_write, &spins, &waits);
+        __atomic_sub_fetch (&rw->writers_waiting, 1, __ATOMIC_SEQ_CST);
+    }
+
+#if defined(LOCK_STATS)
+    lock_stats_acquired (&rw->stats, spins, waits);
+    rw->lock_time = lock_stats_now_ns ();
+#endif
+}
+
+void rwlock_write_unlock (struct rwlock_t *rw)
+{
+#if defined(LOCK_STATS)
+    lock_stats_released (&rw->stats, rw->lock_time);
+#endif
+
+    __atomic_store_n (&rw->state, 0, __ATOMIC_SEQ_CST);
+    rwlock_wake (rw);
+}
+
+// Spinlock for very short critical sections where a mutex_t doesn't fit.
 void start_mutex (volatile int *lock) {
-    while (__sync_val_compare_and_swap (lock, 0, 1) == 1) {
-        // Busy wait
+    while (__atomic_exchange_n (lock, 1, __ATOMIC_ACQUIRE) == 1) {
+        // Wait with plain loads so the cache line isn't bounced between cores.
+        while (__atomic_load_n (lock, __ATOMIC_RELAXED) == 1) {
+            cpu_relax ();
+        }
     }
 }
 
 void end_mutex (volatile int *lock) {
-    *lock = 0;
+    __atomic_store_n (lock, 0, __ATOMIC_RELEASE);
+}
+
+///////////////////////////
+//
+//  CONCURRENT MEMORY POOL
+//
+// Memory pool that can be pushed to from several threads at once. Each thread
+// gets its own mem_pool_t the first time it pushes, after that pushes are
+// plain bump allocations without any synchronization. The lock is only taken
+// to create a thread's pool and by markers.
+//
+// Threads find their pool through a small thread local cache indexed by the
+// pool's id, ids are never reused so a destroyed pool can't be confused with
+// a new one at the same address.
+//
+// Markers work like mem_pool_begin_temporary_memory(), ending one frees what
+// every thread pushed after it was taken.
+//
+// NOTE: Memory pushed by a thread can be used by any thread, but markers and
+// mem_pool_concurrent_destroy() must only be called when no thread is pushing.
+
+#define MEM_POOL_CONCURRENT_MAX_MARKERS 8
+#define MEM_POOL_CONCURRENT_THREAD_CACHE 4 // Must be a power of 2
+
+struct mem_pool_thread_t {
+    struct mem_pool_thread_t *next;
+    pid_t tid;
+    mem_pool_t pool;
+
+    // Markers taken before this pool was created are left unset, ending them
+    // frees the whole pool.
+    mem_pool_temp_marker_t markers[MEM_POOL_CONCURRENT_MAX_MARKERS];
+};
+
+typedef struct {
+    uint64_t min_bin_size; // Used for each thread's pool
+
+    uint64_t id;
+    struct mutex_t lock;
+    struct mem_pool_thread_t *threads;
+    uint32_t num_markers;
+} mem_pool_concurrent_t;
+
+typedef struct {
+    mem_pool_concurrent_t *pool;
+    uint32_t depth;
+} mem_pool_concurrent_marker_t;
+
+uint64_t mem_pool_concurrent_next_id = 1;
+
+struct mem_pool_thread_cache_t {
+    uint64_t pool_id;
+    struct mem_pool_thread_t *thread;
+};
+__thread struct mem_pool_thread_cache_t mem_pool_thread_cache[MEM_POOL_CONCURRENT_THREAD_CACHE];
+__thread pid_t mem_pool_thread_tid = 0;
+
+struct mem_pool_thread_t* mem_pool_concurrent_get_thread_slow (mem_pool_concurrent_t *pool)
+{
+    if (mem_pool_thread_tid == 0) {
+        mem_pool_thread_tid = syscall (SYS_gettid);
+    }
+
+    mutex_lock (&pool->lock);
+    // NOTE: The id is assigned lazily so a zero initialized pool is valid.
+    if (pool->id == 0) {
+        uint64_t id = __atomic_fetch_add (&mem_pool_concurrent_next_id, 1, __ATOMIC_RELAXED);
+        __atomic_store_n (&pool->id, id, __ATOMIC_RELEASE);
+    }
+
+    struct mem_pool_thread_t *thread = pool->threads;
+    while (thread != NULL && thread->tid != mem_pool_thread_tid) {
+        thread = thread->next;
+    }
+
+    if (thread == NULL) {
+        thread = calloc (1, sizeof (struct mem_pool_thread_t));
+        if (thread == NULL) {
+            printf ("Malloc failed.\n");
+            mutex_unlock (&pool->lock);
+            return NULL;
+        }
+        thread->tid = mem_pool_thread_tid;
+        thread->pool.min_bin_size = pool->min_bin_size;
+
+        uint32_t i;
+        for (i=0; i<pool->num_markers; i++) {
+            thread->markers[i] = mem_pool_begin_temporary_memory (&thread->pool);
+        }
+
+        thread->next = pool->threads;
+        pool->threads = thread;
+    }
+
+    struct mem_pool_thread_cache_t *entry =
+        &mem_pool_thread_cache[pool->id & (MEM_POOL_CONCURRENT_THREAD_CACHE-1)];
+    entry->pool_id = pool->id;
+    entry->thread = thread;
+    mutex_unlock (&pool->lock);
+
+    return thread;
+}
+
+static inline
+mem_pool_t* mem_pool_concurrent_get (mem_pool_concurrent_t *pool)
+{
+    uint64_t id = __atomic_load_n (&pool->id, __ATOMIC_ACQUIRE);
+    struct mem_pool_thread_cache_t *entry =
+        &mem_pool_thread_cache[id & (MEM_POOL_CONCURRENT_THREAD_CACHE-1)];
+    if (id != 0 && entry->pool_id == id) {
+        return &entry->thread->pool;
+    }
+
+    struct mem_pool_thread_t *thread = mem_pool_concurrent_get_thread_slow (pool);
+    return thread != NULL ? &thread->pool : NULL;
+}
+
+#define mem_pool_concurrent_push_struct(pool, type) mem_pool_concurrent_push_size(pool, sizeof(type))
+#define mem_pool_concurrent_push_array(pool, n, type) mem_pool_concurrent_push_size(pool, (n)*sizeof(type))
+#define mem_pool_concurrent_push_size(pool, size) mem_pool_concurrent_push_size_full(pool, size, POOL_UNINITIALIZED)
+void* mem_pool_concurrent_push_size_full (mem_pool_concurrent_t *pool, uint64_t size, enum alloc_opts opts)
+{
+    mem_pool_t *thread_pool = mem_pool_concurrent_get (pool);
+    if (thread_pool == NULL) {
+        return NULL;
+    }
+    return mem_pool_push_size_full (thread_pool, size, opts);
+}
+
+mem_pool_concurrent_marker_t mem_pool_concurrent_begin_temporary_memory (mem_pool_concurrent_t *pool)
+{
+    mutex_lock (&pool->lock);
+    assert (pool->num_markers < MEM_POOL_CONCURRENT_MAX_MARKERS && "Too many markers");
+
+    mem_pool_concurrent_marker_t res;
+    res.pool = pool;
+    res.depth = pool->num_markers++;
+
+    struct mem_pool_thread_t *thread;
+    for (thread = pool->threads; thread != NULL; thread = thread->next) {
+        thread->markers[res.depth] = mem_pool_begin_temporary_memory (&thread->pool);
+    }
+    mutex_unlock (&pool->lock);
+    return res;
+}
+
+// NOTE: Markers must be ended in the reverse order they were taken.
+void mem_pool_concurrent_end_temporary_memory (mem_pool_concurrent_marker_t mrkr)
+{
+    mem_pool_concurrent_t *pool = mrkr.pool;
+    mutex_lock (&pool->lock);
+    assert (mrkr.depth == pool->num_markers-1 && "Markers ended out of order");
+
+    struct mem_pool_thread_t *thread;
+    for (thread = pool->threads; thread != NULL; thread = thread->next) {
+        mem_pool_end_temporary_memory (thread->markers[mrkr.depth]);
+    }
+    pool->num_markers--;
+    mutex_unlock (&pool->lock);
+}
+
+uint64_t mem_pool_concurrent_allocated (mem_pool_concurrent_t *pool)
+{
+    uint64_t allocated = 0;
+    mutex_lock (&pool->lock);
+    struct mem_pool_thread_t *thread;
+    for (thread = pool->threads; thread != NULL; thread = thread->next) {
+        allocated += mem_pool_allocated (&thread->pool);
+    }
+    mutex_unlock (&pool->lock);
+    return allocated;
+}
+
+// NOTE: The pool can be used again after this.
+void mem_pool_concurrent_destroy (mem_pool_concurrent_t *pool)
+{
+    struct mem_pool_thread_t *thread = pool->threads;
+    while (thread != NULL) {
+        struct mem_pool_thread_t *next = thread->next;
+        mem_pool_destroy (&thread->pool);
+        free (thread);
+        thread = next;
+    }
+
+    // The next push assigns a new id, so thread caches miss instead of
+    // returning freed pools.
+    uint64_t min_bin_size = pool->min_bin_size;
+    *pool = ZERO_INIT (mem_pool_concurrent_t);
+    pool->min_bin_size = min_bin_size;
 }
 
 
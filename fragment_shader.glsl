@@ -1,9 +1,9 @@
 #version 400 core
 flat in vec3 normal;
 
-out vec4 out_color;
+flat in vec4 color;
 
-uniform vec4 color;
+out vec4 out_color;
 
 uniform sampler2DMS peel_depth_map;
 uniform sampler2DMS opaque_depth_map;
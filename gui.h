@@ -53,6 +53,7 @@ typedef struct {
     //dvec2 pos; // Is this useful? so far there are no usecases
     double width;
     double height;
+    struct css_box_t *sized_style; // Style used to compute width and height
 } layout_content_t;
 
 typedef enum {
@@ -109,6 +110,7 @@ struct text_shadow_t {
     double h_offset;
     double v_offset;
     double blur_radius;
+    enum blur_mode_t blur_mode;
     dvec4 color;
 };
 
@@ -118,10 +120,73 @@ struct box_shadow_t {
     double h_offset;
     double v_offset;
     double blur_radius;
+    enum blur_mode_t blur_mode;
     double spread_distance;
     dvec4 color;
 };
 
+// Cache of blurred shadow surfaces, so static boxes don't blur anything when
+// they are redrawn. Entries are kept in a list ordered from most to least
+// recently used, when the memory budget is exceeded the least recently used
+// ones are evicted.
+//
+// NOTE: Lookups are linear, but compare a hash first. There are at most a few
+// hundred shadows in a window and a miss costs a blur.
+#define SHADOW_CACHE_DEFAULT_BUDGET (8*1024*1024)
+
+enum shadow_cache_kind_t {
+    SHADOW_OUTSET,
+    SHADOW_INSET,
+    SHADOW_TEXT
+};
+
+// Everything that changes the pixels of a shadow's surface. Fields that only
+// change where it's painted are left as 0.
+struct shadow_cache_key_t {
+    enum shadow_cache_kind_t kind;
+    double width;
+    double height;
+    double radius;
+
+    double h_offset;
+    double v_offset;
+    double blur_radius;
+    double spread_distance;
+    enum blur_mode_t blur_mode;
+    dvec4 color;
+
+    // Only for text shadows
+    const char *font_family;
+    int font_size;
+    int font_weight;
+    char *str;
+    int len;
+};
+
+struct shadow_cache_entry_t {
+    struct shadow_cache_entry_t *prev;
+    struct shadow_cache_entry_t *next;
+
+    uint64_t hash;
+    struct shadow_cache_key_t key;
+    cairo_surface_t *surface;
+    uint64_t size;
+};
+
+struct shadow_cache_t {
+    uint64_t budget;
+    uint64_t used;
+    uint32_t num_entries;
+
+    // Most recently used first
+    struct shadow_cache_entry_t *first;
+    struct shadow_cache_entry_t *last;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
 struct css_box_t {
     css_property_t property_mask;
     struct css_box_t *selector_active;
@@ -179,6 +244,12 @@ struct layout_box_t {
     bool content_changed;
     struct behavior_t *behavior;
     layout_content_t content;
+
+    // Set while the box is in the pool's free list.
+    bool is_free;
+    // Neighbors in z-order. While the box is free, _next_ links the free list.
+    layout_box_t *prev;
+    layout_box_t *next;
 };
 
 typedef struct {
@@ -230,7 +301,125 @@ struct font_style_t {
 #define FONT_STYLE_CSS(css_box) \
     FONT_STYLE_FSW((css_box)->font_family,(css_box)->font_size,(css_box)->font_weight)
 
-#define NUM_LAYOUT_BOXES_ALLOCATED 30
+// Cache of Pango font descriptions and of shaped layouts, so drawing the same
+// strings every frame doesn't create and shape a new PangoLayout each time.
+// Layouts are keyed by their string and resolved font style, and kept in a
+// list ordered from most to least recently used.
+//
+// NOTE: Pango types are only forward declared so the GUI still builds
+// without Pango.
+#define TEXT_CACHE_MAX_FONTS 16
+#define TEXT_CACHE_MAX_LAYOUTS 256
+
+struct _PangoContext;
+struct _PangoFontDescription;
+struct _PangoLayout;
+
+struct text_cache_font_t {
+    struct font_style_t style;
+    struct _PangoFontDescription *desc;
+};
+
+struct text_cache_layout_t {
+    struct text_cache_layout_t *prev;
+    struct text_cache_layout_t *next;
+
+    uint64_t hash;
+    struct font_style_t style;
+    char *str;
+    size_t len;
+
+    struct _PangoLayout *layout;
+    int width; // Logical extents, in pixels
+    int height;
+};
+
+struct text_cache_t {
+    struct _PangoContext *context;
+
+    uint32_t num_fonts;
+    struct text_cache_font_t fonts[TEXT_CACHE_MAX_FONTS];
+
+    uint32_t num_layouts;
+    // Most recently used first
+    struct text_cache_layout_t *first;
+    struct text_cache_layout_t *last;
+
+    uint64_t font_hits;
+    uint64_t font_misses;
+    uint64_t layout_hits;
+    uint64_t layout_misses;
+    uint64_t layout_evictions;
+};
+
+// Regions of the window that need to be repainted, in whole pixels. Adding a
+// rectangle that overlaps an existing one merges them, when there is no space
+// left it's merged with the rectangle whose area grows the least.
+#define DAMAGE_MAX_RECTS 16
+
+struct damage_t {
+    int num_rects;
+    box_t rects[DAMAGE_MAX_RECTS];
+};
+
+// Uniform grid over the layout boxes used for hit testing. Each cell lists the
+// boxes that overlap it in z-order, so the topmost hit is the last one that
+// contains the point.
+//
+// It keeps a copy of the boxes it was built from and is rebuilt when they
+// don't match, so boxes can be moved by setting their box directly. Calling
+// layout_boxes_changed() rebuilds it without comparing.
+#define HIT_GRID_CELL_SIZE 64
+#define HIT_GRID_MAX_CELLS 4096
+
+struct hit_grid_t {
+    mem_pool_t pool;
+    bool valid;
+
+    dvec2 origin;
+    double cell_size;
+    int cols;
+    int rows;
+    // Boxes in cell i are cell_items[cell_start[i]] to cell_items[cell_start[i+1]-1].
+    uint32_t *cell_start;
+    layout_box_t **cell_items;
+
+    // Boxes in iteration order and their box when the grid was built.
+    uint32_t num_boxes;
+    layout_box_t **boxes;
+    box_t *rects;
+
+    // Box that got the pointer during the last update_selectors(), or NULL.
+    layout_box_t *last_hit;
+};
+
+// Layout boxes are allocated in chunks that never move, so pointers to them
+// held by behaviors, the focus chain and the selection stay valid. Freed boxes
+// are kept in a free list and reused by next_layout_box().
+//
+// Live boxes are also linked in z-order, which is creation order. A box that
+// reuses a freed slot goes on top, like any other new box. Drawing and the hit
+// grid iterate this list.
+#define LAYOUT_BOX_CHUNK_SIZE 256
+
+struct layout_box_chunk_t {
+    uint32_t num_used; // Boxes ever allocated from this chunk
+    layout_box_t boxes[LAYOUT_BOX_CHUNK_SIZE];
+};
+
+struct layout_box_pool_t {
+    struct layout_box_chunk_t *chunk; // Where boxes not in the free list come from
+    layout_box_t *free_list;
+    uint32_t num_boxes; // Not counting free ones
+
+    // Live boxes from bottom to top.
+    layout_box_t *first;
+    layout_box_t *last;
+};
+
+// NOTE: Boxes must not be freed while iterating.
+#define LAYOUT_BOX_FOREACH(pool,lay) \
+    for (layout_box_t *lay = (pool)->first; lay != NULL; lay = lay->next)
 
 struct gui_state_t {
     mem_pool_t pool;
@@ -239,10 +428,8 @@ struct gui_state_t {
     app_graphics_t gr;
     struct font_style_t default_font_style;
 
-    // TODO: convert this into a work queue.
-    pthread_t thread;
-    mem_pool_t thread_pool;
-    mem_pool_temp_marker_t thread_mem_flush;
+    // Runs heavy work like shadow blurs outside the frame thread.
+    struct work_queue_t work_queue;
 
     char dragging[3];
     dvec2 ptr_delta;
@@ -252,10 +439,10 @@ struct gui_state_t {
     float time_since_last_click[3]; // in ms
     float double_click_time; // in ms
     float min_distance_for_drag; // in pixels
+    bool click_timer_pending; // Waiting for a possible double click to time out.
 
     int focused_layout_box;
-    int num_layout_boxes;
-    struct layout_box_t *layout_boxes;
+    struct layout_box_pool_t layout_boxes;
     struct css_box_t css_styles[CSS_NUM_STYLES];
 
     struct selection_t selection;
@@ -267,6 +454,12 @@ struct gui_state_t {
 
     bool clipboard_ready;
     char *clipboard_str;
+
+    struct shadow_cache_t shadow_cache;
+    struct text_cache_t text_cache;
+
+    struct damage_t damage;
+    struct hit_grid_t hit_grid;
 };
 
 struct gui_state_t *global_gui_st;
@@ -311,9 +504,8 @@ void init_title_label (mem_pool_t *pool, struct css_box_t *box);
 
 void default_gui_init (struct gui_state_t *gui_st)
 {
-    gui_st->layout_boxes =
-        (layout_box_t*)mem_pool_push_array (&gui_st->pool, NUM_LAYOUT_BOXES_ALLOCATED, layout_box_t);
     gui_st->focused_layout_box = -1;
+    work_queue_init (&gui_st->work_queue, work_queue_default_num_workers ());
 
     gui_st->default_font_style.family = "Open Sans";
     gui_st->default_font_style.size = 9;
@@ -351,43 +543,124 @@ void default_gui_init (struct gui_state_t *gui_st)
 
     gui_st->selection.color = selected_fg_color;
     gui_st->selection.background_color = selected_bg_color;
+
+    gui_st->shadow_cache.budget = SHADOW_CACHE_DEFAULT_BUDGET;
 }
 
+void shadow_cache_destroy (struct shadow_cache_t *cache);
+void text_cache_destroy (struct text_cache_t *cache);
 void gui_destroy (struct gui_state_t *gui_st)
 {
+    mem_pool_destroy (&gui_st->hit_grid.pool);
+    shadow_cache_destroy (&gui_st->shadow_cache);
+    text_cache_destroy (&gui_st->text_cache);
+    work_queue_destroy (&gui_st->work_queue);
     mem_pool_destroy (&gui_st->pool);
-    mem_pool_destroy (&gui_st->thread_pool);
 }
 
 /////////////////
 // FONT BACKEND
 
-#ifdef __PANGO_H__
-PangoLayout* new_pango_layout_from_style (cairo_t *cr, struct font_style_t *font_style)
+// Replaces unset fields of _font_style_ with the default font style.
+struct font_style_t font_style_resolve (struct font_style_t *font_style)
 {
-    const char *font_family;
-    if (font_style->family == NULL) {
-        font_family = global_gui_st->default_font_style.family;
+    struct font_style_t res = *font_style;
+    if (res.family == NULL) {
+        res.family = global_gui_st->default_font_style.family;
+    }
+
+    if (res.size == 0) {
+        res.size = global_gui_st->default_font_style.size;
+    }
+
+    if (res.weight == CSS_FONT_WEIGHT_NONE) {
+        res.weight = global_gui_st->default_font_style.weight;
+    }
+    return res;
+}
+
+static inline
+bool font_style_equal (struct font_style_t *s1, struct font_style_t *s2)
+{
+    return s1->size == s2->size && s1->weight == s2->weight &&
+        (s1->family == s2->family ||
+         (s1->family != NULL && s2->family != NULL && strcmp (s1->family, s2->family) == 0));
+}
+
+uint64_t text_cache_hash (struct font_style_t *style, char *str, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+#define HASH_BYTES(data,size) \
+    { \
+        uint8_t *bytes = (uint8_t*)(data); \
+        size_t i; \
+        for (i=0; i<(size); i++) { \
+            hash = (hash ^ bytes[i])*1099511628211ULL; \
+        } \
+    }
+
+    if (style->family != NULL) {
+        HASH_BYTES (style->family, strlen(style->family));
+    }
+    HASH_BYTES (&style->size, sizeof(style->size));
+    HASH_BYTES (&style->weight, sizeof(style->weight));
+    HASH_BYTES (str, len);
+#undef HASH_BYTES
+
+    return hash;
+}
+
+void text_cache_unlink (struct text_cache_t *cache, struct text_cache_layout_t *entry)
+{
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
     } else {
-        font_family = font_style->family;
+        cache->first = entry->next;
     }
 
-    int font_size;
-    if (font_style->size == 0) {
-        font_size = global_gui_st->default_font_style.size;
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
     } else {
-        font_size = font_style->size;
+        cache->last = entry->prev;
     }
+    entry->prev = NULL;
+    entry->next = NULL;
+}
 
-    css_font_weight_t css_font_weight;
-    if (font_style->weight == CSS_FONT_WEIGHT_NONE) {
-        css_font_weight = global_gui_st->default_font_style.weight;
+void text_cache_push_front (struct text_cache_t *cache, struct text_cache_layout_t *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->first;
+    if (cache->first != NULL) {
+        cache->first->prev = entry;
     } else {
-        css_font_weight = font_style->weight;
+        cache->last = entry;
+    }
+    cache->first = entry;
+}
+
+void text_cache_print_stats (struct text_cache_t *cache)
+{
+    printf ("Text cache: %" PRIu32 " fonts, %" PRIu64 " hits, %" PRIu64 " misses; "
+            "%" PRIu32 " layouts, %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " evictions\n",
+            cache->num_fonts, cache->font_hits, cache->font_misses,
+            cache->num_layouts, cache->layout_hits, cache->layout_misses, cache->layout_evictions);
+}
+
+#ifdef __PANGO_H__
+PangoFontDescription* text_cache_get_font (struct text_cache_t *cache, struct font_style_t *style)
+{
+    uint32_t i;
+    for (i=0; i<cache->num_fonts; i++) {
+        if (font_style_equal (&cache->fonts[i].style, style)) {
+            cache->font_hits++;
+            return cache->fonts[i].desc;
+        }
     }
+    cache->font_misses++;
 
     PangoWeight font_weight = PANGO_WEIGHT_NORMAL;
-    switch (css_font_weight) {
+    switch (style->weight) {
         case CSS_FONT_WEIGHT_BOLD:
             font_weight = PANGO_WEIGHT_BOLD;
             break;
@@ -400,35 +673,122 @@ PangoLayout* new_pango_layout_from_style (cairo_t *cr, struct font_style_t *font
     }
 
     PangoFontDescription *font_desc = pango_font_description_new ();
-    pango_font_description_set_family (font_desc, font_family);
-    pango_font_description_set_size (font_desc, font_size*PANGO_SCALE);
+    pango_font_description_set_family (font_desc, style->family);
+    pango_font_description_set_size (font_desc, style->size*PANGO_SCALE);
     pango_font_description_set_weight (font_desc, font_weight);
 
-    PangoLayout *text_layout = pango_cairo_create_layout (cr);
-    pango_layout_set_font_description (text_layout, font_desc);
-    pango_font_description_free(font_desc);
-    return text_layout;
+    // NOTE: There are only a handful of font styles in the GUI, if we run out
+    // of space the oldest one is replaced. Layouts keep their own copy of the
+    // description so they aren't affected.
+    struct text_cache_font_t *font;
+    if (cache->num_fonts < ARRAY_SIZE(cache->fonts)) {
+        font = &cache->fonts[cache->num_fonts++];
+    } else {
+        pango_font_description_free (cache->fonts[0].desc);
+        memmove (cache->fonts, cache->fonts + 1, (ARRAY_SIZE(cache->fonts) - 1)*sizeof(cache->fonts[0]));
+        font = &cache->fonts[ARRAY_SIZE(cache->fonts) - 1];
+    }
+    font->style = *style;
+    font->desc = font_desc;
+    return font_desc;
+}
+
+void text_cache_evict (struct text_cache_t *cache, struct text_cache_layout_t *entry)
+{
+    text_cache_unlink (cache, entry);
+    cache->num_layouts--;
+    g_object_unref (entry->layout);
+    free (entry->str);
+    free (entry);
 }
 
-dvec2 compute_string_size (char *str, struct font_style_t *style)
+// Returns the shaped layout for _str_ with _font_style_, owned by the cache.
+// The first call creates the Pango context from _cr_.
+//
+// NOTE: len == -1 means the string is null terminated.
+struct text_cache_layout_t* text_cache_get_layout (struct text_cache_t *cache, cairo_t *cr,
+                                                   struct font_style_t *font_style,
+                                                   char *str, size_t len)
 {
-    dvec2 res;
-    PangoLayout *text_layout =
-        new_pango_layout_from_style (global_gui_st->gr.cr, style);
+    if (len == (size_t)-1) {
+        len = strlen (str);
+    }
 
-    // NOTE: I have the hunch that calls into Pango will be slow, so we ideally
-    // would like to call this function just once for each string that needs to
-    // be computed.
-    // TODO: Time this function and check if it's really a problem.
-    pango_layout_set_text (text_layout, str, -1);
+    struct font_style_t style = font_style_resolve (font_style);
+    uint64_t hash = text_cache_hash (&style, str, len);
+    struct text_cache_layout_t *entry = cache->first;
+    while (entry != NULL) {
+        if (entry->hash == hash && entry->len == len &&
+            font_style_equal (&entry->style, &style) &&
+            memcmp (entry->str, str, len) == 0) {
+            break;
+        }
+        entry = entry->next;
+    }
+
+    if (entry != NULL) {
+        cache->layout_hits++;
+        if (entry != cache->first) {
+            text_cache_unlink (cache, entry);
+            text_cache_push_front (cache, entry);
+        }
+        return entry;
+    }
+    cache->layout_misses++;
+
+    if (cache->context == NULL) {
+        cache->context = pango_cairo_create_context (cr);
+    }
+
+    if (cache->num_layouts == TEXT_CACHE_MAX_LAYOUTS) {
+        text_cache_evict (cache, cache->last);
+        cache->layout_evictions++;
+    }
+
+    entry = calloc (1, sizeof(struct text_cache_layout_t));
+    entry->hash = hash;
+    entry->style = style;
+    entry->str = malloc (len);
+    memcpy (entry->str, str, len);
+    entry->len = len;
+
+    entry->layout = pango_layout_new (cache->context);
+    pango_layout_set_font_description (entry->layout, text_cache_get_font (cache, &style));
+    pango_layout_set_text (entry->layout, str, len);
 
     PangoRectangle logical;
-    pango_layout_get_pixel_extents (text_layout, NULL, &logical);
+    pango_layout_get_pixel_extents (entry->layout, NULL, &logical);
+    entry->width = logical.width;
+    entry->height = logical.height;
 
-    res.x = logical.width;
-    res.y = logical.height;
-    g_object_unref (text_layout);
-    return res;
+    text_cache_push_front (cache, entry);
+    cache->num_layouts++;
+    return entry;
+}
+
+void text_cache_destroy (struct text_cache_t *cache)
+{
+    while (cache->first != NULL) {
+        text_cache_evict (cache, cache->first);
+    }
+
+    uint32_t i;
+    for (i=0; i<cache->num_fonts; i++) {
+        pango_font_description_free (cache->fonts[i].desc);
+    }
+    cache->num_fonts = 0;
+
+    if (cache->context != NULL) {
+        g_object_unref (cache->context);
+        cache->context = NULL;
+    }
+}
+
+dvec2 compute_string_size (char *str, struct font_style_t *style)
+{
+    struct text_cache_layout_t *entry =
+        text_cache_get_layout (&global_gui_st->text_cache, global_gui_st->gr.cr, style, str, -1);
+    return DVEC2 (entry->width, entry->height);
 }
 
 // NOTE: len == -1 means the string is null terminated.
@@ -436,29 +796,34 @@ void render_text (cairo_t *cr, dvec2 pos, struct font_style_t *font_style,
                   char *str, size_t len, dvec4 *color, dvec4 *bg_color,
                   dvec2 *out_pos)
 {
-    PangoLayout *text_layout = new_pango_layout_from_style (cr, font_style);
-    pango_layout_set_text (text_layout, str, len);
+    struct text_cache_layout_t *entry =
+        text_cache_get_layout (&global_gui_st->text_cache, cr, font_style, str, len);
 
-    PangoRectangle logical;
-    pango_layout_get_pixel_extents (text_layout, NULL, &logical);
     dvec2_floor (&pos);
     if (bg_color != NULL) {
         cairo_set_source_rgba (cr, ARGS_RGBA(*bg_color));
-        cairo_rectangle (cr, pos.x, pos.y, logical.width, logical.height);
+        cairo_rectangle (cr, pos.x, pos.y, entry->width, entry->height);
         cairo_fill (cr);
     }
 
     if (out_pos != NULL ) {
-        out_pos->x = pos.x + logical.width;
+        out_pos->x = pos.x + entry->width;
     }
 
     cairo_set_source_rgba (cr, ARGS_RGBA(*color));
     cairo_move_to (cr, pos.x, pos.y);
-    pango_cairo_show_layout (cr, text_layout);
-    g_object_unref (text_layout);
+    // NOTE: The layout may have been created for a different cairo context,
+    // this only reshapes it if the transformation or font options changed.
+    pango_cairo_update_layout (cr, entry->layout);
+    pango_cairo_show_layout (cr, entry->layout);
 }
 
 #else
+void text_cache_destroy (struct text_cache_t *cache)
+{
+    return;
+}
+
 dvec2 compute_string_size (char *str, struct font_style_t *style)
 {
     return DVEC2(0,0);
@@ -623,6 +988,30 @@ bool is_point_in_box (double p_x, double p_y, double x, double y, double width,
     }
 }
 
+static inline
+double box_area (box_t *b)
+{
+    return BOX_WIDTH(*b)*BOX_HEIGHT(*b);
+}
+
+static inline
+bool box_overlaps (box_t *b1, box_t *b2)
+{
+    return b1->min.x < b2->max.x && b2->min.x < b1->max.x &&
+        b1->min.y < b2->max.y && b2->min.y < b1->max.y;
+}
+
+static inline
+box_t box_union (box_t *b1, box_t *b2)
+{
+    box_t res;
+    res.min.x = MIN (b1->min.x, b2->min.x);
+    res.min.y = MIN (b1->min.y, b2->min.y);
+    res.max.x = MAX (b1->max.x, b2->max.x);
+    res.max.y = MAX (b1->max.y, b2->max.y);
+    return res;
+}
+
 bool is_box_visible (box_t *box, app_graphics_t *gr)
 {
     return
@@ -681,6 +1070,9 @@ void update_input (struct gui_state_t *gui_st, app_input_t input)
         default:
             invalid_code_path;
     }
+    // NOTE: State 2 is the only one that changes with time instead of input
+    // events, the app can't stop updating while it's in it.
+    gui_st->click_timer_pending = (state == 2);
 
     // Detect dragging with minimum distance threshold
     if (input.mouse_down[0]) {
@@ -874,38 +1266,220 @@ void focus_chain_remove (struct gui_state_t *gui_st, layout_box_t *lay_box)
     }
 }
 
-void update_selectors (struct gui_state_t *gui_st, layout_box_t *layout_boxes, int num_layout_boxes)
+//////////////////
+// HIT TESTING
+
+// Forces the hit grid to be rebuilt. Not necessary after moving, adding or
+// freeing boxes, it's detected by hit_grid_is_stale().
+void layout_boxes_changed (struct gui_state_t *gui_st)
 {
-    int i;
-    for (i=0; i<num_layout_boxes; i++) {
-        layout_box_t *curr_box = layout_boxes + i;
-        // TODO: is_ptr_inside should consider z-axis so that only visible boxes are
-        // triggered.
-        bool is_ptr_inside = is_dvec2_in_box (global_gui_st->input.ptr, curr_box->box);
-        bool click_started_inside = is_dvec2_in_box (global_gui_st->click_coord[0], curr_box->box);
-
-        css_selector_t old = curr_box->active_selectors;
-        if (!(curr_box->active_selectors & CSS_SEL_DISABLED)) {
-            if (gui_st->input.mouse_down[0] && is_ptr_inside && click_started_inside) {
-                curr_box->active_selectors = (css_selector_t)(curr_box->active_selectors | CSS_SEL_ACTIVE);
-            } else {
-                curr_box->active_selectors = (css_selector_t)(curr_box->active_selectors & ~CSS_SEL_ACTIVE);
+    gui_st->hit_grid.valid = false;
+}
+
+static inline
+bool hit_grid_box_is_valid (box_t *box)
+{
+    // NOTE: Uninitialized boxes have NAN coordinates, these comparisons are
+    // false for them.
+    return box->min.x <= box->max.x && box->min.y <= box->max.y;
+}
+
+static inline
+void hit_grid_cell_range (struct hit_grid_t *grid, box_t *box,
+                          int *x0, int *y0, int *x1, int *y1)
+{
+    *x0 = CLAMP ((int)floor ((box->min.x - grid->origin.x)/grid->cell_size), 0, grid->cols - 1);
+    *y0 = CLAMP ((int)floor ((box->min.y - grid->origin.y)/grid->cell_size), 0, grid->rows - 1);
+    *x1 = CLAMP ((int)floor ((box->max.x - grid->origin.x)/grid->cell_size), 0, grid->cols - 1);
+    *y1 = CLAMP ((int)floor ((box->max.y - grid->origin.y)/grid->cell_size), 0, grid->rows - 1);
+}
+
+void hit_grid_build (struct hit_grid_t *grid, struct layout_box_pool_t *layout_boxes)
+{
+    mem_pool_destroy (&grid->pool);
+    grid->pool = ZERO_INIT (mem_pool_t);
+    grid->valid = true;
+
+    box_t bounds = {{{INFINITY, INFINITY}}, {{-INFINITY, -INFINITY}}};
+    LAYOUT_BOX_FOREACH (layout_boxes, lay) {
+        if (hit_grid_box_is_valid (&lay->box)) {
+            bounds = box_union (&bounds, &lay->box);
+        }
+    }
+
+    if (!hit_grid_box_is_valid (&bounds)) {
+        bounds = (box_t){{{0, 0}}, {{0, 0}}};
+    }
+
+    grid->origin = bounds.min;
+    grid->cell_size = HIT_GRID_CELL_SIZE;
+    do {
+        grid->cols = BOX_WIDTH(bounds)/grid->cell_size + 1;
+        grid->rows = BOX_HEIGHT(bounds)/grid->cell_size + 1;
+        if (grid->cols*grid->rows > HIT_GRID_MAX_CELLS) {
+            grid->cell_size *= 2;
+        } else {
+            break;
+        }
+    } while (true);
+
+    uint32_t num_boxes = 0;
+    LAYOUT_BOX_FOREACH (layout_boxes, lay) {
+        num_boxes++;
+    }
+    grid->num_boxes = 0;
+    grid->boxes = mem_pool_push_array_aligned (&grid->pool, MAX(num_boxes, 1), layout_box_t*, sizeof(void*));
+    grid->rects = mem_pool_push_array_aligned (&grid->pool, MAX(num_boxes, 1), box_t, sizeof(double));
+    LAYOUT_BOX_FOREACH (layout_boxes, lay) {
+        grid->boxes[grid->num_boxes] = lay;
+        grid->rects[grid->num_boxes] = lay->box;
+        grid->num_boxes++;
+    }
+
+    uint32_t num_cells = grid->cols*grid->rows;
+    grid->cell_start = mem_pool_push_size_full (&grid->pool, (num_cells+1)*sizeof(uint32_t), POOL_ZERO_INIT);
+
+    // Count boxes per cell, turn counts into offsets, then fill cells. Boxes
+    // are visited in order so each cell ends up sorted by z-order.
+    uint32_t num_items = 0;
+    LAYOUT_BOX_FOREACH (layout_boxes, lay) {
+        if (!hit_grid_box_is_valid (&lay->box)) {
+            continue;
+        }
+
+        int x0, y0, x1, y1;
+        hit_grid_cell_range (grid, &lay->box, &x0, &y0, &x1, &y1);
+        int x, y;
+        for (y=y0; y<=y1; y++) {
+            for (x=x0; x<=x1; x++) {
+                grid->cell_start[y*grid->cols + x + 1]++;
+                num_items++;
+            }
+        }
+    }
+
+    uint32_t c;
+    for (c=0; c<num_cells; c++) {
+        grid->cell_start[c+1] += grid->cell_start[c];
+    }
+
+    grid->cell_items = mem_pool_push_array_aligned (&grid->pool, MAX(num_items, 1), layout_box_t*, sizeof(void*));
+    uint32_t *cell_fill = mem_pool_push_size (&grid->pool, num_cells*sizeof(uint32_t));
+    memcpy (cell_fill, grid->cell_start, num_cells*sizeof(uint32_t));
+    LAYOUT_BOX_FOREACH (layout_boxes, lay) {
+        if (!hit_grid_box_is_valid (&lay->box)) {
+            continue;
+        }
+
+        int x0, y0, x1, y1;
+        hit_grid_cell_range (grid, &lay->box, &x0, &y0, &x1, &y1);
+        int x, y;
+        for (y=y0; y<=y1; y++) {
+            for (x=x0; x<=x1; x++) {
+                grid->cell_items[cell_fill[y*grid->cols + x]++] = lay;
             }
         }
+    }
+}
+
+// Returns true if boxes were added, freed or moved since the grid was built.
+//
+// NOTE: This compares every box each frame, which is still much cheaper than
+// updating the selectors of every box, the work the grid avoids. Boxes are
+// compared with memcmp() so uninitialized ones, with NAN coordinates, match.
+bool hit_grid_is_stale (struct hit_grid_t *grid, struct layout_box_pool_t *layout_boxes)
+{
+    if (!grid->valid) {
+        return true;
+    }
+
+    uint32_t i = 0;
+    LAYOUT_BOX_FOREACH (layout_boxes, lay) {
+        if (i == grid->num_boxes || grid->boxes[i] != lay ||
+            memcmp (&grid->rects[i], &lay->box, sizeof(box_t)) != 0) {
+            return true;
+        }
+        i++;
+    }
+    return i != grid->num_boxes;
+}
 
-        if (is_ptr_inside) {
-            curr_box->active_selectors = (css_selector_t)(curr_box->active_selectors | CSS_SEL_HOVER);
+// Returns the topmost layout box that contains _p_, or NULL.
+layout_box_t* hit_grid_query (struct hit_grid_t *grid, dvec2 p)
+{
+    int x = floor ((p.x - grid->origin.x)/grid->cell_size);
+    int y = floor ((p.y - grid->origin.y)/grid->cell_size);
+    if (x < 0 || x >= grid->cols || y < 0 || y >= grid->rows) {
+        return NULL;
+    }
+
+    uint32_t cell = y*grid->cols + x;
+    uint32_t i;
+    for (i=grid->cell_start[cell+1]; i>grid->cell_start[cell]; i--) {
+        layout_box_t *lay = grid->cell_items[i-1];
+        if (is_dvec2_in_box (p, lay->box)) {
+            return lay;
+        }
+    }
+    return NULL;
+}
+
+void update_box_selectors (struct gui_state_t *gui_st, layout_box_t *curr_box,
+                           bool is_ptr_inside, bool click_started_inside)
+{
+    css_selector_t old = curr_box->active_selectors;
+    if (!(curr_box->active_selectors & CSS_SEL_DISABLED)) {
+        if (gui_st->input.mouse_down[0] && is_ptr_inside && click_started_inside) {
+            curr_box->active_selectors = (css_selector_t)(curr_box->active_selectors | CSS_SEL_ACTIVE);
         } else {
-            curr_box->active_selectors = (css_selector_t)(curr_box->active_selectors & ~CSS_SEL_HOVER);
+            curr_box->active_selectors = (css_selector_t)(curr_box->active_selectors & ~CSS_SEL_ACTIVE);
         }
+    }
+
+    if (is_ptr_inside) {
+        curr_box->active_selectors = (css_selector_t)(curr_box->active_selectors | CSS_SEL_HOVER);
+    } else {
+        curr_box->active_selectors = (css_selector_t)(curr_box->active_selectors & ~CSS_SEL_HOVER);
+    }
+
+    if (gui_st->mouse_clicked[0] && is_ptr_inside) {
+        focus_set (gui_st, curr_box);
+    }
 
-        if (gui_st->mouse_clicked[0] && is_ptr_inside) {
-            focus_set (gui_st, curr_box);
+    curr_box->changed_selectors =
+        (css_selector_t)(curr_box->changed_selectors | (old ^ curr_box->active_selectors));
+}
+
+// Only the topmost box under the pointer gets hover, active and focus. Boxes
+// are found with the hit grid, so only the box under the pointer and the one
+// that was under it before are updated. After the layout changes, all boxes
+// are updated once.
+void update_selectors (struct gui_state_t *gui_st)
+{
+    struct hit_grid_t *grid = &gui_st->hit_grid;
+    bool rebuilt = false;
+    if (hit_grid_is_stale (grid, &gui_st->layout_boxes)) {
+        hit_grid_build (grid, &gui_st->layout_boxes);
+        rebuilt = true;
+    }
+
+    layout_box_t *ptr_hit = hit_grid_query (grid, gui_st->input.ptr);
+    layout_box_t *click_hit = hit_grid_query (grid, gui_st->click_coord[0]);
+
+    if (rebuilt) {
+        LAYOUT_BOX_FOREACH (&gui_st->layout_boxes, lay) {
+            update_box_selectors (gui_st, lay, lay == ptr_hit, lay == click_hit);
+        }
+    } else {
+        if (grid->last_hit != NULL && grid->last_hit != ptr_hit) {
+            update_box_selectors (gui_st, grid->last_hit, false, grid->last_hit == click_hit);
         }
 
-        curr_box->changed_selectors =
-            (css_selector_t)(curr_box->changed_selectors | (old ^ curr_box->active_selectors));
+        if (ptr_hit != NULL) {
+            update_box_selectors (gui_st, ptr_hit, true, ptr_hit == click_hit);
+        }
     }
+    grid->last_hit = ptr_hit;
 }
 
 #define update_layout_box_style(gui_st,box,style_id) {(box)->style=&((gui_st)->css_styles[style_id]);}
@@ -930,28 +1504,201 @@ void layout_box_uninitialize (layout_box_t *lay)
 
 layout_box_t* next_layout_box (css_style_t style_id)
 {
-    assert (global_gui_st->num_layout_boxes+1 < NUM_LAYOUT_BOXES_ALLOCATED);
-
     struct gui_state_t *gui_st = global_gui_st;
-    layout_box_t *layout_box = &gui_st->layout_boxes[gui_st->num_layout_boxes];
+    struct layout_box_pool_t *boxes = &gui_st->layout_boxes;
+
+    layout_box_t *layout_box;
+    if (boxes->free_list != NULL) {
+        layout_box = boxes->free_list;
+        boxes->free_list = layout_box->next;
+    } else {
+        if (boxes->chunk == NULL || boxes->chunk->num_used == LAYOUT_BOX_CHUNK_SIZE) {
+            boxes->chunk = mem_pool_push_size_aligned (&gui_st->pool, sizeof(struct layout_box_chunk_t),
+                                                       sizeof(double));
+            boxes->chunk->num_used = 0;
+        }
+        layout_box = &boxes->chunk->boxes[boxes->chunk->num_used++];
+    }
 
     layout_box_uninitialize(layout_box);
 
-    gui_st->num_layout_boxes++;
+    // NOTE: New boxes always go on top, even when they reuse a freed one.
+    layout_box->prev = boxes->last;
+    if (boxes->last != NULL) {
+        boxes->last->next = layout_box;
+    } else {
+        boxes->first = layout_box;
+    }
+    boxes->last = layout_box;
+
+    boxes->num_boxes++;
+    layout_boxes_changed (gui_st);
 
     init_layout_box_style (gui_st, layout_box, style_id);
 
     return layout_box;
 }
 
-void update_layout_boxes (struct gui_state_t *gui_st, layout_box_t *layout_boxes,
-                          int num_layout_boxes, bool *changed)
+//////////////////
+// DAMAGE TRACKING
+
+void damage_add (struct damage_t *damage, box_t rect)
+{
+    rect.min.x = floor (rect.min.x);
+    rect.min.y = floor (rect.min.y);
+    rect.max.x = ceil (rect.max.x);
+    rect.max.y = ceil (rect.max.y);
+    if (rect.min.x >= rect.max.x || rect.min.y >= rect.max.y) {
+        return;
+    }
+
+    // NOTE: A merged rectangle may now overlap others, keep merging until it
+    // doesn't.
+    int i = 0;
+    while (i < damage->num_rects) {
+        if (box_overlaps (&damage->rects[i], &rect)) {
+            rect = box_union (&damage->rects[i], &rect);
+            damage->rects[i] = damage->rects[--damage->num_rects];
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+
+    if (damage->num_rects < DAMAGE_MAX_RECTS) {
+        damage->rects[damage->num_rects++] = rect;
+        return;
+    }
+
+    int best = 0;
+    double best_growth = INFINITY;
+    for (i=0; i<damage->num_rects; i++) {
+        box_t merged = box_union (&damage->rects[i], &rect);
+        double growth = box_area (&merged) - box_area (&damage->rects[i]);
+        if (growth < best_growth) {
+            best_growth = growth;
+            best = i;
+        }
+    }
+    rect = box_union (&damage->rects[best], &rect);
+    damage->rects[best] = damage->rects[--damage->num_rects];
+    damage_add (damage, rect);
+}
+
+void damage_add_window (struct damage_t *damage, app_graphics_t *gr)
+{
+    box_t window = {{{0, 0}}, {{gr->width, gr->height}}};
+    damage_add (damage, window);
+}
+
+void damage_clear (struct damage_t *damage)
 {
-    update_selectors (gui_st, layout_boxes, num_layout_boxes);
+    damage->num_rects = 0;
+}
+
+bool damage_intersects (struct damage_t *damage, box_t *box)
+{
+    int i;
+    for (i=0; i<damage->num_rects; i++) {
+        if (box_overlaps (&damage->rects[i], box)) {
+            return true;
+        }
+    }
+    return false;
+}
 
+// Restricts drawing in _cr_ to the damaged region. Use cairo_save() and
+// cairo_restore() around it to remove the clip.
+void damage_clip (cairo_t *cr, struct damage_t *damage)
+{
     int i;
-    for (i=0; i<num_layout_boxes; i++) {
-        layout_box_t *curr_box = layout_boxes + i;
+    for (i=0; i<damage->num_rects; i++) {
+        box_t *r = &damage->rects[i];
+        cairo_rectangle (cr, r->min.x, r->min.y, BOX_WIDTH(*r), BOX_HEIGHT(*r));
+    }
+    cairo_clip (cr);
+}
+
+// Area touched when drawing _lay_ with _style_, outset shadows can paint
+// outside of the layout box.
+box_t layout_box_paint_extents (layout_box_t *lay, struct css_box_t *style)
+{
+    box_t res = lay->box;
+    if (style == NULL) {
+        return res;
+    }
+
+    struct box_shadow_t *shadow = style->outset_shadows;
+    while (shadow != NULL) {
+        double extent = shadow->blur_radius + shadow->spread_distance;
+        res.min.x = MIN (res.min.x, lay->box.min.x + shadow->h_offset - extent);
+        res.min.y = MIN (res.min.y, lay->box.min.y + shadow->v_offset - extent);
+        res.max.x = MAX (res.max.x, lay->box.max.x + shadow->h_offset + extent);
+        res.max.y = MAX (res.max.y, lay->box.max.y + shadow->v_offset + extent);
+        shadow = shadow->next;
+    }
+    return res;
+}
+
+void damage_add_layout_box (struct damage_t *damage, app_graphics_t *gr,
+                            layout_box_t *lay, struct css_box_t *style)
+{
+    box_t extents = layout_box_paint_extents (lay, style);
+    if (!is_box_visible (&extents, gr)) {
+        return;
+    }
+
+    extents.min.x = MAX (extents.min.x, 0);
+    extents.min.y = MAX (extents.min.y, 0);
+    extents.max.x = MIN (extents.max.x, gr->width);
+    extents.max.y = MIN (extents.max.y, gr->height);
+    damage_add (damage, extents);
+}
+
+void css_box_draw (app_graphics_t *gr, struct css_box_t *box, layout_box_t *layout);
+// Repaints the damaged region of the window, only layout boxes that touch it
+// are drawn. Boxes are drawn in order, so later ones are on top. Returns false
+// if nothing was damaged.
+//
+// NOTE: The damage is not cleared, because callers still need it to upload the
+// same region to the screen. It's cleared by layout_boxes_end_frame().
+bool draw_damaged_layout_boxes (struct gui_state_t *gui_st)
+{
+    struct damage_t *damage = &gui_st->damage;
+    if (damage->num_rects == 0) {
+        return false;
+    }
+
+    app_graphics_t *gr = &gui_st->gr;
+    cairo_t *cr = gr->cr;
+    cairo_save (cr);
+    damage_clip (cr, damage);
+    cairo_clear (cr);
+
+    LAYOUT_BOX_FOREACH (&gui_st->layout_boxes, lay) {
+        box_t extents = layout_box_paint_extents (lay, lay->style);
+        if (!damage_intersects (damage, &extents)) {
+            continue;
+        }
+
+        if (lay->draw != NULL) {
+            lay->draw (gr, lay);
+        } else if (lay->style != NULL) {
+            css_box_draw (gr, lay->style, lay);
+        }
+    }
+    cairo_restore (cr);
+    return true;
+}
+
+// NOTE: Boxes whose style or content changed are added to the damage, both
+// with their old and new style because shadows may have changed size.
+void update_layout_boxes (struct gui_state_t *gui_st, bool *changed)
+{
+    update_selectors (gui_st);
+
+    LAYOUT_BOX_FOREACH (&gui_st->layout_boxes, curr_box) {
+        struct css_box_t *old_style = curr_box->style;
 
         struct css_box_t *active_style =
             gui_st->css_styles[curr_box->base_style_id].selector_active;
@@ -985,18 +1732,30 @@ void update_layout_boxes (struct gui_state_t *gui_st, layout_box_t *layout_boxes
             }
             *changed = true;
         }
+
+        if (curr_box->style != old_style) {
+            damage_add_layout_box (&gui_st->damage, &gui_st->gr, curr_box, old_style);
+            damage_add_layout_box (&gui_st->damage, &gui_st->gr, curr_box, curr_box->style);
+        } else if (curr_box->content_changed) {
+            damage_add_layout_box (&gui_st->damage, &gui_st->gr, curr_box, curr_box->style);
+            *changed = true;
+        }
     }
 }
 
-void layout_boxes_end_frame (layout_box_t *layout_boxes, int len)
+// NOTE: Damage is cleared here, call this every frame after the damaged region
+// was drawn and uploaded, even if nothing was drawn. Otherwise it keeps growing
+// until it covers the whole window.
+void layout_boxes_end_frame (struct gui_state_t *gui_st)
 {
-    int i;
-    for (i=0; i<len; i++) {
-        layout_boxes[i].changed_selectors = (css_selector_t)0;
-        layout_boxes[i].content_changed = false;
+    damage_clear (&gui_st->damage);
+
+    LAYOUT_BOX_FOREACH (&gui_st->layout_boxes, lay) {
+        lay->changed_selectors = (css_selector_t)0;
+        lay->content_changed = false;
 
 #if 0
-        box_t *rect = &layout_boxes[i].box;
+        box_t *rect = &lay->box;
         cairo_t *cr = global_gui_st->gr.cr;
         cairo_rectangle (cr, rect->min.x+0.5, rect->min.y+0.5, BOX_WIDTH(*rect)-1, BOX_HEIGHT(*rect)-1);
         cairo_set_source_rgba (cr, 0.5, 0.1, 0.1, 0.3);
@@ -1019,21 +1778,88 @@ void add_behavior (struct gui_state_t *gui_st, layout_box_t *box, enum behavior_
     box->behavior = new_behavior;
 }
 
+void remove_behavior (struct gui_state_t *gui_st, struct behavior_t *behavior)
+{
+    struct behavior_t **curr = &gui_st->behaviors;
+    while (*curr != NULL) {
+        if (*curr == behavior) {
+            *curr = behavior->next;
+            break;
+        }
+        curr = &(*curr)->next;
+    }
+}
+
+// Removes _lay_ from the GUI and returns it to the free list. It's also removed
+// from the focus chain, behaviors and selection, but pointers held elsewhere
+// must be dropped by the caller.
+void free_layout_box (struct gui_state_t *gui_st, layout_box_t *lay)
+{
+    assert (!lay->is_free && "Layout box freed twice");
+
+    damage_add_layout_box (&gui_st->damage, &gui_st->gr, lay, lay->style);
+
+    if (gui_st->focus != NULL) {
+        focus_chain_remove (gui_st, lay);
+    }
+
+    if (lay->behavior != NULL) {
+        remove_behavior (gui_st, lay->behavior);
+    }
+
+    if (gui_st->selection.dest == lay) {
+        unselect (gui_st);
+    }
+
+    if (gui_st->hit_grid.last_hit == lay) {
+        gui_st->hit_grid.last_hit = NULL;
+    }
+
+    struct layout_box_pool_t *boxes = &gui_st->layout_boxes;
+    if (lay->prev != NULL) {
+        lay->prev->next = lay->next;
+    } else {
+        boxes->first = lay->next;
+    }
+    if (lay->next != NULL) {
+        lay->next->prev = lay->prev;
+    } else {
+        boxes->last = lay->prev;
+    }
+
+    layout_box_uninitialize (lay);
+    lay->is_free = true;
+    lay->next = boxes->free_list;
+    boxes->free_list = lay;
+    boxes->num_boxes--;
+    layout_boxes_changed (gui_st);
+}
+
 void layout_set_content_str (layout_box_t *lay, char *str)
 {
     lay->content.type = LAYOUT_CONTENT_C_STRING;
     lay->content.str = str;
+    lay->content.sized_style = NULL;
+    lay->content_changed = true;
 }
 
+// NOTE: The size is only recomputed if the content changed or the box's style
+// is not the one it was computed with. Code that changes a string in place
+// must set content_changed.
 void compute_content_size (layout_box_t *lay)
 {
     switch (lay->content.type) {
         case LAYOUT_CONTENT_C_STRING:
             {
+                if (!lay->content_changed && lay->content.sized_style == lay->style) {
+                    break;
+                }
+
                 struct font_style_t font_style = FONT_STYLE_CSS (lay->style);
                 dvec2 size = compute_string_size (lay->content.str, &font_style);
                 lay->content.width = size.x;
                 lay->content.height = size.y;
+                lay->content.sized_style = lay->style;
             } break;
         case LAYOUT_CONTENT_NONE:
             break;
@@ -1111,10 +1937,9 @@ void print_text_shadow (struct text_shadow_t *shadow)
             shadow->color.a);
 }
 
-// TODO: How are we impacted by the slow performance of this?
-// An easy way to speed up this would be to receive a box where we can skip the
-// computation.
-void css_gaussian_blur (cairo_surface_t *image, double r)
+// TODO: An easy way to speed up this would be to receive a box where we can
+// skip the computation.
+void css_blur (cairo_surface_t *image, double r, enum blur_mode_t mode)
 {
     assert (cairo_surface_get_type (image) == CAIRO_SURFACE_TYPE_IMAGE);
     assert (cairo_image_surface_get_format (image) == CAIRO_FORMAT_ARGB32);
@@ -1124,79 +1949,247 @@ void css_gaussian_blur (cairo_surface_t *image, double r)
     }
 
     cairo_surface_flush (image);
-    int size = 2*r+1;
-    uint8_t kernel[size];
-    uint32_t i;
-    uint32_t area = 0;
-    double mu = ARRAY_SIZE(kernel)/2;
-    for (i=0; i<ARRAY_SIZE(kernel); i++) {
-        kernel[i] = (uint32_t)(255*exp(-(i-mu)*(i-mu)/(2*(r/2)*(r/2))));
-        area += kernel[i];
-    }
-
-    uint32_t *src = (uint32_t*)cairo_image_surface_get_data (image);
-    uint32_t src_width = cairo_image_surface_get_width (image);
-    uint32_t src_height = cairo_image_surface_get_height (image);
-    cairo_surface_t *tmp_surface =
-        cairo_image_surface_create (CAIRO_FORMAT_ARGB32, src_width, src_height);
-    uint32_t *tmp = (uint32_t*)cairo_image_surface_get_data (tmp_surface);
-
-    for (i=0; i<src_height; i++) {
-        uint32_t j;
-        for (j=0; j<src_width; j++) {
-            uint32_t k;
-            uint32_t a = 0, r = 0, g = 0, b = 0;
-            for (k=0; k<ARRAY_SIZE(kernel); k++) {
-                if (j - ARRAY_SIZE(kernel)/2 + k < 0) {
-                    continue;
-                } else if (j - ARRAY_SIZE(kernel)/2 + k >= src_width) {
-                    continue;
-                }
+    uint32_t *pixels = (uint32_t*)cairo_image_surface_get_data (image);
+    uint32_t width = cairo_image_surface_get_width (image);
+    uint32_t height = cairo_image_surface_get_height (image);
+    uint32_t stride = cairo_image_surface_get_stride (image)/sizeof(uint32_t);
+
+    struct work_queue_t *wq = global_gui_st != NULL ? &global_gui_st->work_queue : NULL;
+    if (wq != NULL && wq->num_workers > 0 && width*height >= BLUR_PARALLEL_MIN_PIXELS) {
+        blur_argb32_parallel (wq, pixels, width, height, stride, r, mode);
+    } else {
+        blur_argb32 (pixels, width, height, stride, r, mode);
+    }
+    cairo_surface_mark_dirty (image);
+}
 
-                uint8_t *src_px = (uint8_t*)(src + j - ARRAY_SIZE(kernel)/2 + k + i*src_width);
-                a += src_px[0]*kernel[k];
-                r += src_px[1]*kernel[k];
-                g += src_px[2]*kernel[k];
-                b += src_px[3]*kernel[k];
-            }
-            uint8_t *dest_px = (uint8_t*)(tmp + j + i*src_width);
-            dest_px[0] = a/area;
-            dest_px[1] = r/area;
-            dest_px[2] = g/area;
-            dest_px[3] = b/area;
+// Computes the nine slice template for a shadow surface of _width_ x _height_
+// pixels containing _shape_, see nine_slice_axis().
+void shadow_nine_slice_axes (double width, double height, struct rounded_box_t *shape,
+                             double blur_radius, enum blur_mode_t blur_mode,
+                             struct nine_slice_axis_t *x_axis, struct nine_slice_axis_t *y_axis)
+{
+    // NOTE: Truncated like cairo_image_surface_create() does.
+    uint32_t support = blur_support (blur_radius, blur_mode);
+    nine_slice_axis ((int)width, shape->x, shape->width, shape->radius, support, x_axis);
+    nine_slice_axis ((int)height, shape->y, shape->height, shape->radius, support, y_axis);
+}
+
+// Returns a new surface with the full shadow from a blurred template. If the
+// template is the full shadow, a new reference to it is returned instead.
+cairo_surface_t* shadow_nine_slice_expand (cairo_surface_t *tpl,
+                                           struct nine_slice_axis_t *x_axis, struct nine_slice_axis_t *y_axis)
+{
+    if (x_axis->removed == 0 && y_axis->removed == 0) {
+        return cairo_surface_reference (tpl);
+    }
+
+    cairo_surface_t *res =
+        cairo_image_surface_create (CAIRO_FORMAT_ARGB32, x_axis->size, y_axis->size);
+    cairo_surface_flush (tpl);
+    cairo_surface_flush (res);
+    nine_slice_expand_argb32 ((uint32_t*)cairo_image_surface_get_data (tpl),
+                              cairo_image_surface_get_stride (tpl)/sizeof(uint32_t),
+                              x_axis, y_axis,
+                              (uint32_t*)cairo_image_surface_get_data (res),
+                              cairo_image_surface_get_stride (res)/sizeof(uint32_t));
+    cairo_surface_mark_dirty (res);
+    return res;
+}
+
+//////////////////
+// SHADOW CACHE
+
+uint64_t shadow_cache_key_hash (struct shadow_cache_key_t *key)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+#define HASH_BYTES(ptr,size) \
+    { \
+        uint8_t *bytes = (uint8_t*)(ptr); \
+        size_t i; \
+        for (i=0; i<(size); i++) { \
+            hash = (hash ^ bytes[i])*1099511628211ULL; \
+        } \
+    }
 
+    HASH_BYTES (&key->kind, sizeof(key->kind));
+    HASH_BYTES (&key->width, sizeof(key->width));
+    HASH_BYTES (&key->height, sizeof(key->height));
+    HASH_BYTES (&key->radius, sizeof(key->radius));
+    HASH_BYTES (&key->h_offset, sizeof(key->h_offset));
+    HASH_BYTES (&key->v_offset, sizeof(key->v_offset));
+    HASH_BYTES (&key->blur_radius, sizeof(key->blur_radius));
+    HASH_BYTES (&key->spread_distance, sizeof(key->spread_distance));
+    HASH_BYTES (&key->blur_mode, sizeof(key->blur_mode));
+    HASH_BYTES (key->color.E, sizeof(key->color.E));
+    if (key->kind == SHADOW_TEXT) {
+        if (key->font_family != NULL) {
+            HASH_BYTES (key->font_family, strlen(key->font_family));
         }
+        HASH_BYTES (&key->font_size, sizeof(key->font_size));
+        HASH_BYTES (&key->font_weight, sizeof(key->font_weight));
+        HASH_BYTES (key->str, key->len);
     }
+#undef HASH_BYTES
+
+    return hash;
+}
+
+bool shadow_cache_key_equal (struct shadow_cache_key_t *k1, struct shadow_cache_key_t *k2)
+{
+    bool res = k1->kind == k2->kind &&
+        k1->width == k2->width &&
+        k1->height == k2->height &&
+        k1->radius == k2->radius &&
+        k1->h_offset == k2->h_offset &&
+        k1->v_offset == k2->v_offset &&
+        k1->blur_radius == k2->blur_radius &&
+        k1->spread_distance == k2->spread_distance &&
+        k1->blur_mode == k2->blur_mode &&
+        memcmp (k1->color.E, k2->color.E, sizeof(k1->color.E)) == 0;
+
+    if (res && k1->kind == SHADOW_TEXT) {
+        res = k1->font_size == k2->font_size &&
+            k1->font_weight == k2->font_weight &&
+            k1->len == k2->len &&
+            memcmp (k1->str, k2->str, k1->len) == 0 &&
+            (k1->font_family == k2->font_family ||
+             (k1->font_family != NULL && k2->font_family != NULL &&
+              strcmp (k1->font_family, k2->font_family) == 0));
+    }
+    return res;
+}
 
-    uint32_t j;
-    for (j=0; j<src_width; j++) {
-        uint32_t i;
-        for (i=0; i<src_height; i++) {
-            uint32_t k;
-            uint32_t a = 0, r = 0, g = 0, b = 0;
-            for (k=0; k<ARRAY_SIZE(kernel); k++) {
-                if (i - ARRAY_SIZE(kernel)/2 + k < 0) {
-                    continue;
-                } else if (i - ARRAY_SIZE(kernel)/2 + k >= src_height) {
-                    continue;
-                }
+void shadow_cache_unlink (struct shadow_cache_t *cache, struct shadow_cache_entry_t *entry)
+{
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        cache->first = entry->next;
+    }
 
-                uint8_t *src_px = (uint8_t*)(tmp + j + (i - ARRAY_SIZE(kernel)/2 + k)*src_width);
-                a += src_px[0]*kernel[k];
-                r += src_px[1]*kernel[k];
-                g += src_px[2]*kernel[k];
-                b += src_px[3]*kernel[k];
-            }
-            uint8_t *dest_px = (uint8_t*)(src + j + i*src_width);
-            dest_px[0] = a/area;
-            dest_px[1] = r/area;
-            dest_px[2] = g/area;
-            dest_px[3] = b/area;
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        cache->last = entry->prev;
+    }
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+void shadow_cache_push_front (struct shadow_cache_t *cache, struct shadow_cache_entry_t *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->first;
+    if (cache->first != NULL) {
+        cache->first->prev = entry;
+    } else {
+        cache->last = entry;
+    }
+    cache->first = entry;
+}
+
+void shadow_cache_evict (struct shadow_cache_t *cache, struct shadow_cache_entry_t *entry)
+{
+    shadow_cache_unlink (cache, entry);
+    cache->used -= entry->size;
+    cache->num_entries--;
+    cairo_surface_destroy (entry->surface);
+    free (entry->key.str);
+    free (entry);
+}
+
+// Returns a new reference to the cached surface for _key_, or NULL if it's not
+// in the cache. The caller must destroy it.
+cairo_surface_t* shadow_cache_lookup (struct shadow_cache_t *cache, struct shadow_cache_key_t *key)
+{
+    uint64_t hash = shadow_cache_key_hash (key);
+    struct shadow_cache_entry_t *entry = cache->first;
+    while (entry != NULL) {
+        if (entry->hash == hash && shadow_cache_key_equal (&entry->key, key)) {
+            break;
         }
+        entry = entry->next;
     }
 
-    cairo_surface_destroy (tmp_surface);
-    cairo_surface_mark_dirty (image);
+    if (entry == NULL) {
+        cache->misses++;
+        return NULL;
+    }
+
+    cache->hits++;
+    if (entry != cache->first) {
+        shadow_cache_unlink (cache, entry);
+        shadow_cache_push_front (cache, entry);
+    }
+    return cairo_surface_reference (entry->surface);
+}
+
+// Adds a reference to _surface_ into the cache. Surfaces bigger than the whole
+// budget are not stored.
+void shadow_cache_store (struct shadow_cache_t *cache, struct shadow_cache_key_t *key,
+                         cairo_surface_t *surface)
+{
+    uint64_t size = (uint64_t)cairo_image_surface_get_stride (surface)*
+        cairo_image_surface_get_height (surface);
+    if (size > cache->budget) {
+        return;
+    }
+
+    while (cache->used + size > cache->budget && cache->last != NULL) {
+        shadow_cache_evict (cache, cache->last);
+        cache->evictions++;
+    }
+
+    // NOTE: The cache is only an optimization, if we run out of memory the
+    // surface is just not stored.
+    struct shadow_cache_entry_t *entry = calloc (1, sizeof(struct shadow_cache_entry_t));
+    if (entry == NULL) {
+        return;
+    }
+    entry->hash = shadow_cache_key_hash (key);
+    entry->key = *key;
+    if (key->kind == SHADOW_TEXT) {
+        entry->key.str = malloc (key->len);
+        if (entry->key.str == NULL && key->len > 0) {
+            free (entry);
+            return;
+        }
+        memcpy (entry->key.str, key->str, key->len);
+    } else {
+        entry->key.str = NULL;
+    }
+    // NOTE: Font family names are static strings.
+    entry->surface = cairo_surface_reference (surface);
+    entry->size = size;
+
+    shadow_cache_push_front (cache, entry);
+    cache->used += size;
+    cache->num_entries++;
+}
+
+void shadow_cache_destroy (struct shadow_cache_t *cache)
+{
+    while (cache->first != NULL) {
+        shadow_cache_evict (cache, cache->first);
+    }
+}
+
+void shadow_cache_print_stats (struct shadow_cache_t *cache)
+{
+    printf ("Shadow cache: %" PRIu32 " entries, %" PRIu64 "/%" PRIu64 " bytes, "
+            "%" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " evictions\n",
+            cache->num_entries, cache->used, cache->budget,
+            cache->hits, cache->misses, cache->evictions);
+}
+
+// NOTE: Returns NULL if the GUI state isn't set up, then shadows are blurred on
+// every draw.
+static inline
+struct shadow_cache_t* get_shadow_cache ()
+{
+    return global_gui_st != NULL ? &global_gui_st->shadow_cache : NULL;
 }
 
 void draw_outset_shadows (app_graphics_t *gr, struct css_box_t *css, layout_box_t *layout,
@@ -1232,22 +2225,48 @@ void draw_outset_shadows (app_graphics_t *gr, struct css_box_t *css, layout_box_
             shadow_box.x = curr_shadow->blur_radius;
             shadow_box.y = curr_shadow->blur_radius;
 
-            cairo_surface_t *single_shadow =
-                cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
-                                            shadow_box.width + 2*curr_shadow->blur_radius,
-                                            shadow_box.height + 2*curr_shadow->blur_radius);
-            cairo_t *shadow_cr = cairo_create (single_shadow);
-            rounded_box_path (shadow_cr, &shadow_box);
-            cairo_set_source_rgba (shadow_cr, ARGS_RGBA(curr_shadow->color));
-            cairo_fill (shadow_cr);
-            css_gaussian_blur (single_shadow, curr_shadow->blur_radius);
+            // Only blur a template as big as the corners, see nine_slice_axis().
+            struct nine_slice_axis_t x_axis, y_axis;
+            shadow_nine_slice_axes (shadow_box.width + 2*curr_shadow->blur_radius,
+                                    shadow_box.height + 2*curr_shadow->blur_radius,
+                                    &shadow_box, curr_shadow->blur_radius, curr_shadow->blur_mode,
+                                    &x_axis, &y_axis);
+            shadow_box.width -= x_axis.removed;
+            shadow_box.height -= y_axis.removed;
+
+            struct shadow_cache_key_t key = {0};
+            key.kind = SHADOW_OUTSET;
+            key.width = shadow_box.width;
+            key.height = shadow_box.height;
+            key.radius = shadow_box.radius;
+            key.blur_radius = curr_shadow->blur_radius;
+            key.blur_mode = curr_shadow->blur_mode;
+            key.color = curr_shadow->color;
+
+            struct shadow_cache_t *cache = get_shadow_cache ();
+            cairo_surface_t *tpl = cache ? shadow_cache_lookup (cache, &key) : NULL;
+            if (tpl == NULL) {
+                tpl = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+                                                  x_axis.tpl_size, y_axis.tpl_size);
+                cairo_t *shadow_cr = cairo_create (tpl);
+                rounded_box_path (shadow_cr, &shadow_box);
+                cairo_set_source_rgba (shadow_cr, ARGS_RGBA(curr_shadow->color));
+                cairo_fill (shadow_cr);
+                cairo_destroy (shadow_cr);
+                css_blur (tpl, curr_shadow->blur_radius, curr_shadow->blur_mode);
+
+                if (cache) {
+                    shadow_cache_store (cache, &key, tpl);
+                }
+            }
 
+            cairo_surface_t *single_shadow = shadow_nine_slice_expand (tpl, &x_axis, &y_axis);
             double xpos = curr_shadow->h_offset - curr_shadow->spread_distance - curr_shadow->blur_radius;
             double ypos = curr_shadow->v_offset - curr_shadow->spread_distance - curr_shadow->blur_radius;
             cairo_set_source_surface (cr, single_shadow, xpos, ypos);
             cairo_paint (cr);
             cairo_surface_destroy (single_shadow);
-            cairo_destroy (shadow_cr);
+            cairo_surface_destroy (tpl);
         }
 
         curr_shadow = curr_shadow->next;
@@ -1295,25 +2314,55 @@ void draw_inset_shadows (app_graphics_t *gr, struct css_box_t *css, layout_box_t
             shadow_box.x += curr_shadow->blur_radius;
             shadow_box.y += curr_shadow->blur_radius;
 
-            cairo_surface_t *single_shadow =
-                cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
-                                            padding_box->width + 2*curr_shadow->blur_radius,
-                                            padding_box->height + 2*curr_shadow->blur_radius);
-            cairo_t *shadow_cr = cairo_create (single_shadow);
-            cairo_set_source_rgba (shadow_cr, ARGS_RGBA(curr_shadow->color));
-            cairo_paint (shadow_cr);
-            rounded_box_path (shadow_cr, &shadow_box);
-            cairo_set_operator (shadow_cr, CAIRO_OPERATOR_CLEAR);
-            cairo_fill (shadow_cr);
-
-            css_gaussian_blur (single_shadow, curr_shadow->blur_radius);
+            // Only blur a template as big as the corners of the hole, see
+            // nine_slice_axis().
+            struct nine_slice_axis_t x_axis, y_axis;
+            shadow_nine_slice_axes (padding_box->width + 2*curr_shadow->blur_radius,
+                                    padding_box->height + 2*curr_shadow->blur_radius,
+                                    &shadow_box, curr_shadow->blur_radius, curr_shadow->blur_mode,
+                                    &x_axis, &y_axis);
+            shadow_box.width -= x_axis.removed;
+            shadow_box.height -= y_axis.removed;
+
+            // NOTE: The shadow box is drawn at the padding box's position plus
+            // the offsets, both change the surface's pixels.
+            struct shadow_cache_key_t key = {0};
+            key.kind = SHADOW_INSET;
+            key.width = padding_box->width - x_axis.removed;
+            key.height = padding_box->height - y_axis.removed;
+            key.radius = padding_box->radius;
+            key.h_offset = padding_box->x + curr_shadow->h_offset;
+            key.v_offset = padding_box->y + curr_shadow->v_offset;
+            key.blur_radius = curr_shadow->blur_radius;
+            key.spread_distance = curr_shadow->spread_distance;
+            key.blur_mode = curr_shadow->blur_mode;
+            key.color = curr_shadow->color;
+
+            struct shadow_cache_t *cache = get_shadow_cache ();
+            cairo_surface_t *tpl = cache ? shadow_cache_lookup (cache, &key) : NULL;
+            if (tpl == NULL) {
+                tpl = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+                                                  x_axis.tpl_size, y_axis.tpl_size);
+                cairo_t *shadow_cr = cairo_create (tpl);
+                cairo_set_source_rgba (shadow_cr, ARGS_RGBA(curr_shadow->color));
+                cairo_paint (shadow_cr);
+                rounded_box_path (shadow_cr, &shadow_box);
+                cairo_set_operator (shadow_cr, CAIRO_OPERATOR_CLEAR);
+                cairo_fill (shadow_cr);
+                cairo_destroy (shadow_cr);
+
+                css_blur (tpl, curr_shadow->blur_radius, curr_shadow->blur_mode);
+
+                if (cache) {
+                    shadow_cache_store (cache, &key, tpl);
+                }
+            }
 
+            cairo_surface_t *single_shadow = shadow_nine_slice_expand (tpl, &x_axis, &y_axis);
             cairo_set_source_surface (cr, single_shadow, -curr_shadow->blur_radius, -curr_shadow->blur_radius);
             cairo_paint (cr);
-
             cairo_surface_destroy (single_shadow);
-            cairo_destroy (shadow_cr);
-
+            cairo_surface_destroy (tpl);
         }
         curr_shadow = curr_shadow->next;
     }
@@ -1337,24 +2386,42 @@ void draw_text_shadows (app_graphics_t *gr, struct css_box_t *css,
             shadow_pos.y += curr_shadow->v_offset;
             render_text (cr, shadow_pos, &font_style, str, len, &curr_shadow->color, NULL, NULL);
         } else {
-            dvec2 size = compute_string_size (str, &font_style);
-
-            cairo_surface_t *single_shadow =
-                cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
-                                            size.w + 2*curr_shadow->blur_radius,
-                                            size.h + 2*curr_shadow->blur_radius);
-            cairo_t *shadow_cr = cairo_create (single_shadow);
-            dvec2 tmp_pos = DVEC2(curr_shadow->blur_radius, curr_shadow->blur_radius);
-            render_text (shadow_cr, tmp_pos, &font_style, str, len, &curr_shadow->color, NULL, NULL);
-            css_gaussian_blur (single_shadow, curr_shadow->blur_radius);
+            struct shadow_cache_key_t key = {0};
+            key.kind = SHADOW_TEXT;
+            key.blur_radius = curr_shadow->blur_radius;
+            key.blur_mode = curr_shadow->blur_mode;
+            key.color = curr_shadow->color;
+            key.font_family = font_style.family;
+            key.font_size = font_style.size;
+            key.font_weight = font_style.weight;
+            key.str = str;
+            key.len = len < 0 ? strlen (str) : len;
+
+            struct shadow_cache_t *cache = get_shadow_cache ();
+            cairo_surface_t *single_shadow = cache ? shadow_cache_lookup (cache, &key) : NULL;
+            if (single_shadow == NULL) {
+                dvec2 size = compute_string_size (str, &font_style);
+
+                single_shadow =
+                    cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+                                                size.w + 2*curr_shadow->blur_radius,
+                                                size.h + 2*curr_shadow->blur_radius);
+                cairo_t *shadow_cr = cairo_create (single_shadow);
+                dvec2 tmp_pos = DVEC2(curr_shadow->blur_radius, curr_shadow->blur_radius);
+                render_text (shadow_cr, tmp_pos, &font_style, str, len, &curr_shadow->color, NULL, NULL);
+                cairo_destroy (shadow_cr);
+                css_blur (single_shadow, curr_shadow->blur_radius, curr_shadow->blur_mode);
+
+                if (cache) {
+                    shadow_cache_store (cache, &key, single_shadow);
+                }
+            }
 
             shadow_pos.x += curr_shadow->h_offset - curr_shadow->blur_radius;
             shadow_pos.y += curr_shadow->v_offset - curr_shadow->blur_radius;
             cairo_set_source_surface (cr, single_shadow, shadow_pos.x, shadow_pos.y);
             cairo_paint (cr);
-
             cairo_surface_destroy (single_shadow);
-            cairo_destroy (shadow_cr);
         }
         curr_shadow = curr_shadow->next;
     }
@@ -1489,31 +2556,36 @@ void css_box_draw (app_graphics_t *gr, struct css_box_t *box, layout_box_t *layo
     cairo_restore (cr);
 }
 
-void css_add_text_shadow (mem_pool_t *pool, struct css_box_t *css,
-                          double h_offset, double v_offset,
-                          double blur_radius, dvec4 color)
+// NOTE: Returns the new shadow so callers can change its blur_mode, by default
+// it's BLUR_MODE_AUTO.
+struct text_shadow_t* css_add_text_shadow (mem_pool_t *pool, struct css_box_t *css,
+                                           double h_offset, double v_offset,
+                                           double blur_radius, dvec4 color)
 {
     struct text_shadow_t *new_text_shadow =
         (struct text_shadow_t*)mem_pool_push_size (pool, sizeof (struct text_shadow_t));
     new_text_shadow->h_offset = h_offset;
     new_text_shadow->v_offset = v_offset;
     new_text_shadow->blur_radius = blur_radius;
+    new_text_shadow->blur_mode = BLUR_MODE_AUTO;
     new_text_shadow->color = color;
 
     new_text_shadow->next = css->text_shadows;
     css->text_shadows = new_text_shadow;
+    return new_text_shadow;
 }
 
-void css_add_box_shadow (mem_pool_t *pool, struct css_box_t *css,
-                         bool inset, double h_offset, double v_offset,
-                         double blur_radius, double spread_distance,
-                         dvec4 color)
+struct box_shadow_t* css_add_box_shadow (mem_pool_t *pool, struct css_box_t *css,
+                                          bool inset, double h_offset, double v_offset,
+                                          double blur_radius, double spread_distance,
+                                          dvec4 color)
 {
     struct box_shadow_t *new_box_shadow =
         (struct box_shadow_t*)mem_pool_push_size (pool, sizeof (struct box_shadow_t));
     new_box_shadow->h_offset = h_offset;
     new_box_shadow->v_offset = v_offset;
     new_box_shadow->blur_radius = blur_radius;
+    new_box_shadow->blur_mode = BLUR_MODE_AUTO;
     new_box_shadow->spread_distance = spread_distance;
     new_box_shadow->color = color;
 
@@ -1526,6 +2598,7 @@ void css_add_box_shadow (mem_pool_t *pool, struct css_box_t *css,
 
     new_box_shadow->next = *box_shadow_list;
     *box_shadow_list = new_box_shadow;
+    return new_box_shadow;
 }
 
 void css_box_add_gradient_stops (struct css_box_t *box, int num_stops, dvec4 *stops)
@@ -1777,6 +2850,162 @@ void get_next_color (dvec3 *color)
     }
 }
 
+#if defined(SLO_TIMERS_H)
+//////////////////////
+// PROFILER OVERLAY
+//
+// Draws the frames recorded by the scoped profiler from slo_timers.h. The top
+// half shows a bar per frame, newest on the right, with its top level CPU zones
+// stacked in it. The bottom half is a flame graph of the last finished frame,
+// CPU zones first and GPU zones below them, on the same time axis.
+
+#define PROF_OVERLAY_NUM_BARS 60
+#define PROF_OVERLAY_ROW_HEIGHT 14
+#define PROF_OVERLAY_FRAME_BUDGET_MS (1000.0/60)
+
+// The same zone name always gets the same color.
+dvec3 prof_zone_color (const char *name)
+{
+    uint32_t hash = 5381;
+    while (*name) {
+        hash = hash*33 + (uint8_t)*name;
+        name++;
+    }
+    return color_palette[hash%ARRAY_SIZE(color_palette)];
+}
+
+static inline
+void prof_overlay_zone_rect (cairo_t *cr, struct prof_zone_t *zone,
+                             double x, double y, double width, double height)
+{
+    dvec3 color = prof_zone_color (zone->name);
+    cairo_set_source_rgb (cr, ARGS_RGB(color));
+    cairo_rectangle (cr, x, y, MAX (width, 1), height);
+    cairo_fill (cr);
+
+    // NOTE: Labels are clipped to the zone's rectangle, short zones won't show
+    // any text.
+    if (width > 20) {
+        cairo_save (cr);
+        cairo_rectangle (cr, x, y, width, height);
+        cairo_clip (cr);
+        cairo_set_source_rgb (cr, 0, 0, 0);
+        cairo_move_to (cr, x + 2, y + height - 3);
+        cairo_show_text (cr, zone->name);
+        cairo_restore (cr);
+    }
+}
+
+void prof_draw_overlay (cairo_t *cr, struct profiler_t *prof, double width, double height)
+{
+    double pad = 6;
+    double bars_height = (height - 3*pad)/2;
+
+    cairo_save (cr);
+    cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_rgba (cr, 0, 0, 0, 0.75);
+    cairo_paint (cr);
+    cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+    cairo_select_font_face (cr, "monospace", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+    cairo_set_font_size (cr, 10);
+
+    // Frame bars, scaled so the frame budget is at half the height.
+    double bar_width = (width - 2*pad)/PROF_OVERLAY_NUM_BARS;
+    double px_per_ms = bars_height/(2*PROF_OVERLAY_FRAME_BUDGET_MS);
+    double bars_bottom = pad + bars_height;
+    uint32_t n;
+    for (n=0; n<PROF_OVERLAY_NUM_BARS; n++) {
+        struct prof_frame_t *frame = prof_get_frame (prof, n);
+        if (frame == NULL) {
+            break;
+        }
+
+        double x = width - pad - (n+1)*bar_width;
+        double frame_ms = MIN ((double)frame->length_ns/1e6, 2*PROF_OVERLAY_FRAME_BUDGET_MS);
+        cairo_set_source_rgb (cr, 0.4, 0.4, 0.4);
+        cairo_rectangle (cr, x, bars_bottom - frame_ms*px_per_ms, bar_width - 1, frame_ms*px_per_ms);
+        cairo_fill (cr);
+
+        uint32_t i;
+        for (i=0; i<frame->num_zones; i++) {
+            struct prof_zone_t *zone = &frame->zones[i];
+            if (zone->depth != 0 || zone->gpu) {
+                continue;
+            }
+
+            double start_ms = MIN ((double)zone->start_ns/1e6, 2*PROF_OVERLAY_FRAME_BUDGET_MS);
+            double end_ms = MIN ((double)zone->end_ns/1e6, 2*PROF_OVERLAY_FRAME_BUDGET_MS);
+            dvec3 color = prof_zone_color (zone->name);
+            cairo_set_source_rgb (cr, ARGS_RGB(color));
+            cairo_rectangle (cr, x, bars_bottom - end_ms*px_per_ms,
+                             bar_width - 1, (end_ms - start_ms)*px_per_ms);
+            cairo_fill (cr);
+        }
+    }
+
+    cairo_set_source_rgb (cr, 1, 1, 1);
+    cairo_set_line_width (cr, 1);
+    double budget_y = floor (bars_bottom - PROF_OVERLAY_FRAME_BUDGET_MS*px_per_ms) + 0.5;
+    cairo_move_to (cr, pad, budget_y);
+    cairo_line_to (cr, width - pad, budget_y);
+    cairo_stroke (cr);
+
+    // Flame graph of the last frame.
+    struct prof_frame_t *frame = prof_get_frame (prof, 0);
+    if (frame != NULL) {
+        double flame_y = bars_bottom + pad;
+        char label[64];
+        snprintf (label, ARRAY_SIZE(label), "Frame %" PRIu64 ": %.2f ms",
+                  frame->id, (double)frame->length_ns/1e6);
+        cairo_set_source_rgb (cr, 1, 1, 1);
+        cairo_move_to (cr, pad, flame_y + PROF_OVERLAY_ROW_HEIGHT - 3);
+        cairo_show_text (cr, label);
+        flame_y += PROF_OVERLAY_ROW_HEIGHT;
+
+        // GPU zones usually end after the CPU is done with the frame, the time
+        // axis must fit both.
+        int64_t max_ns = frame->length_ns;
+        int cpu_rows = 0;
+        int gpu_min_depth = PROF_MAX_DEPTH;
+        uint32_t i;
+        for (i=0; i<frame->num_zones; i++) {
+            struct prof_zone_t *zone = &frame->zones[i];
+            if (!zone->resolved) {
+                continue;
+            }
+
+            max_ns = MAX (max_ns, zone->end_ns);
+            if (zone->gpu) {
+                gpu_min_depth = MIN (gpu_min_depth, zone->depth);
+            } else {
+                cpu_rows = MAX (cpu_rows, zone->depth + 1);
+            }
+        }
+
+        double px_per_ns = max_ns > 0 ? (width - 2*pad)/max_ns : 0;
+        for (i=0; i<frame->num_zones; i++) {
+            struct prof_zone_t *zone = &frame->zones[i];
+            if (!zone->resolved) {
+                continue;
+            }
+
+            int row = zone->gpu ? cpu_rows + zone->depth - gpu_min_depth : zone->depth;
+            double y = flame_y + row*PROF_OVERLAY_ROW_HEIGHT;
+            if (y + PROF_OVERLAY_ROW_HEIGHT > height - pad) {
+                continue;
+            }
+
+            prof_overlay_zone_rect (cr, zone,
+                                    pad + zone->start_ns*px_per_ns, y,
+                                    (zone->end_ns - zone->start_ns)*px_per_ns,
+                                    PROF_OVERLAY_ROW_HEIGHT - 1);
+        }
+    }
+
+    cairo_restore (cr);
+}
+#endif
+
 void init_button (mem_pool_t *pool, struct css_box_t *box)
 {
     *box = ZERO_INIT(struct css_box_t);
@@ -0,0 +1,366 @@
+/*
+ * Copyright (C) 2018 Santiago León O. <santileortiz@gmail.com>
+ */
+
+// Headless tests for the layout box logic in gui.h. Nothing is drawn, so it
+// doesn't need a display, but gui.h still needs the xcb and cairo headers.
+//
+// Usage:
+//   gui_test
+//
+// Checks that damage_add() merges overlapping rectangles and coalesces them
+// when the list is full, and that update_layout_boxes() damages a box with its
+// old and new style when a selector changes it. Checks that hit testing follows
+// boxes moved without calling layout_boxes_changed(), and that a box reusing a
+// freed slot is on top. Returns non zero if a check fails.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <xcb/xcb.h>
+#include <cairo/cairo.h>
+
+#include "common.h"
+#include "slo_timers.h"
+#include "work_queue.h"
+#include "blur.h"
+#include "gui.h"
+
+#define TEST_WINDOW_WIDTH 800
+#define TEST_WINDOW_HEIGHT 600
+
+void test_gui_init (struct gui_state_t *gui_st)
+{
+    *gui_st = ZERO_INIT (struct gui_state_t);
+    gui_st->gr.width = TEST_WINDOW_WIDTH;
+    gui_st->gr.height = TEST_WINDOW_HEIGHT;
+    global_gui_st = gui_st;
+}
+
+// Returns true if the union of the damaged rectangles contains all of _box_.
+// Checks each pixel center, boxes used here are small.
+bool damage_covers (struct damage_t *damage, box_t box)
+{
+    double x, y;
+    for (y=floor(box.min.y)+0.5; y<box.max.y; y++) {
+        for (x=floor(box.min.x)+0.5; x<box.max.x; x++) {
+            bool covered = false;
+            int i;
+            for (i=0; i<damage->num_rects && !covered; i++) {
+                covered = is_dvec2_in_box (DVEC2(x,y), damage->rects[i]);
+            }
+
+            if (!covered) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool damage_rects_overlap (struct damage_t *damage)
+{
+    int i, j;
+    for (i=0; i<damage->num_rects; i++) {
+        for (j=i+1; j<damage->num_rects; j++) {
+            if (box_overlaps (&damage->rects[i], &damage->rects[j])) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool check_damage_merge ()
+{
+    bool success = true;
+    struct damage_t damage = {0};
+
+    box_t a, b, c;
+    BOX_X_Y_W_H (a, 10.5, 20.2, 80, 30);
+    BOX_X_Y_W_H (b, 60, 40, 100, 100);
+    BOX_X_Y_W_H (c, 400, 400, 10, 10);
+    damage_add (&damage, a);
+    damage_add (&damage, c);
+    damage_add (&damage, b);
+
+    if (damage.num_rects != 2) {
+        printf ("Error: overlapping damage wasn't merged, got %d rectangles.\n", damage.num_rects);
+        success = false;
+    }
+
+    box_t expected;
+    BOX_X_Y_W_H (expected, 10, 20, 150, 120);
+    bool found = false;
+    int i;
+    for (i=0; i<damage.num_rects; i++) {
+        found = found || memcmp (&damage.rects[i], &expected, sizeof(box_t)) == 0;
+    }
+    if (!found) {
+        printf ("Error: merged damage isn't the union in whole pixels.\n");
+        success = false;
+    }
+
+    if (!damage_covers (&damage, a) || !damage_covers (&damage, b) || !damage_covers (&damage, c)) {
+        printf ("Error: damage doesn't cover the added rectangles.\n");
+        success = false;
+    }
+
+    box_t empty;
+    BOX_X_Y_W_H (empty, 500, 500, 0, 10);
+    damage_add (&damage, empty);
+    if (damage.num_rects != 2) {
+        printf ("Error: empty rectangle was added to the damage.\n");
+        success = false;
+    }
+
+    damage_clear (&damage);
+    if (damage.num_rects != 0) {
+        printf ("Error: damage_clear() left %d rectangles.\n", damage.num_rects);
+        success = false;
+    }
+    return success;
+}
+
+bool check_damage_overflow ()
+{
+    bool success = true;
+    struct damage_t damage = {0};
+
+    int num_added = 3*DAMAGE_MAX_RECTS;
+    box_t added[3*DAMAGE_MAX_RECTS];
+    int i;
+    for (i=0; i<num_added; i++) {
+        BOX_X_Y_W_H (added[i], 15*(i%40), 200 + 15*(i/40), 10, 10);
+        damage_add (&damage, added[i]);
+
+        if (damage.num_rects > DAMAGE_MAX_RECTS) {
+            printf ("Error: damage has %d rectangles, the maximum is %d.\n",
+                    damage.num_rects, DAMAGE_MAX_RECTS);
+            return false;
+        }
+    }
+
+    if (damage.num_rects != DAMAGE_MAX_RECTS) {
+        printf ("Error: full damage has %d rectangles, expected %d.\n", damage.num_rects, DAMAGE_MAX_RECTS);
+        success = false;
+    }
+
+    if (damage_rects_overlap (&damage)) {
+        printf ("Error: coalesced damage has overlapping rectangles.\n");
+        success = false;
+    }
+
+    for (i=0; i<num_added; i++) {
+        if (!damage_covers (&damage, added[i])) {
+            printf ("Error: coalesced damage lost rectangle %d.\n", i);
+            success = false;
+            break;
+        }
+    }
+    return success;
+}
+
+// A box whose active style has a shadow is pressed and released. Each time the
+// damage must cover the paint extents of both styles, and not touch a box
+// that didn't change.
+bool check_update_layout_boxes_damage ()
+{
+    bool success = true;
+    struct gui_state_t gui_st;
+    test_gui_init (&gui_st);
+
+    struct box_shadow_t shadow = {0};
+    shadow.h_offset = 30;
+    shadow.v_offset = 10;
+    shadow.blur_radius = 5;
+    gui_st.css_styles[CSS_BUTTON_ACTIVE].outset_shadows = &shadow;
+    gui_st.css_styles[CSS_BUTTON].selector_active = &gui_st.css_styles[CSS_BUTTON_ACTIVE];
+
+    layout_box_t *button = next_layout_box (CSS_BUTTON);
+    BOX_X_Y_W_H (button->box, 100, 100, 80, 30);
+    layout_box_t *other = next_layout_box (CSS_BUTTON);
+    BOX_X_Y_W_H (other->box, 500, 400, 80, 30);
+    layout_boxes_changed (&gui_st);
+
+    bool changed = false;
+    update_layout_boxes (&gui_st, &changed);
+    layout_boxes_end_frame (&gui_st);
+
+    box_t base_extents = layout_box_paint_extents (button, &gui_st.css_styles[CSS_BUTTON]);
+    box_t active_extents = layout_box_paint_extents (button, &gui_st.css_styles[CSS_BUTTON_ACTIVE]);
+
+    int i;
+    for (i=0; i<2; i++) {
+        bool pressed = (i == 0);
+        gui_st.input.ptr = DVEC2 (120, 110);
+        gui_st.input.mouse_down[0] = pressed;
+        gui_st.click_coord[0] = gui_st.input.ptr;
+
+        changed = false;
+        update_layout_boxes (&gui_st, &changed);
+
+        struct css_box_t *expected_style = pressed ?
+            &gui_st.css_styles[CSS_BUTTON_ACTIVE] : &gui_st.css_styles[CSS_BUTTON];
+        if (!changed || button->style != expected_style) {
+            printf ("Error: %s the button didn't change its style.\n", pressed ? "pressing" : "releasing");
+            success = false;
+        }
+
+        if (!damage_covers (&gui_st.damage, base_extents) ||
+            !damage_covers (&gui_st.damage, active_extents)) {
+            printf ("Error: %s the button didn't damage its old and new style extents.\n",
+                    pressed ? "pressing" : "releasing");
+            success = false;
+        }
+
+        int j;
+        for (j=0; j<gui_st.damage.num_rects; j++) {
+            if (box_overlaps (&gui_st.damage.rects[j], &other->box)) {
+                printf ("Error: a box that didn't change was damaged.\n");
+                success = false;
+            }
+        }
+
+        layout_boxes_end_frame (&gui_st);
+        if (gui_st.damage.num_rects != 0) {
+            printf ("Error: layout_boxes_end_frame() didn't clear the damage.\n");
+            success = false;
+        }
+    }
+
+    gui_destroy (&gui_st);
+    return success;
+}
+
+// Moves the pointer to _p_ and returns the box that got it.
+layout_box_t* hit (struct gui_state_t *gui_st, dvec2 p)
+{
+    gui_st->input.ptr = p;
+    update_selectors (gui_st);
+    return gui_st->hit_grid.last_hit;
+}
+
+// Boxes are moved by setting their box directly, without calling
+// layout_boxes_changed(). Hit testing must follow them.
+bool check_hit_follows_moved_box ()
+{
+    bool success = true;
+    struct gui_state_t gui_st;
+    test_gui_init (&gui_st);
+
+    layout_box_t *box = next_layout_box (CSS_BUTTON);
+    BOX_X_Y_W_H (box->box, 0, 0, 100, 100);
+    if (hit (&gui_st, DVEC2 (50, 50)) != box) {
+        printf ("Error: box wasn't hit before moving it.\n");
+        success = false;
+    }
+
+    BOX_X_Y_W_H (box->box, 300, 300, 100, 100);
+    if (hit (&gui_st, DVEC2 (350, 350)) != box) {
+        printf ("Error: hit testing didn't follow a moved box.\n");
+        success = false;
+    }
+    if (hit (&gui_st, DVEC2 (50, 50)) != NULL) {
+        printf ("Error: box was hit at its old position.\n");
+        success = false;
+    }
+    if (box->active_selectors & CSS_SEL_HOVER) {
+        printf ("Error: box kept hover after the pointer left it.\n");
+        success = false;
+    }
+
+    // Scroll a long list of rows, the pointer stays still.
+    int num_rows = 2000;
+    double row_height = 20;
+    layout_box_t **rows = malloc (num_rows*sizeof(layout_box_t*));
+    int i;
+    for (i=0; i<num_rows; i++) {
+        rows[i] = next_layout_box (CSS_BUTTON);
+        BOX_X_Y_W_H (rows[i]->box, 500, i*row_height, 200, row_height);
+    }
+
+    dvec2 p = DVEC2 (600, 5*row_height + row_height/2);
+    int scroll;
+    for (scroll=0; scroll<40; scroll+=7) {
+        for (i=0; i<num_rows; i++) {
+            BOX_X_Y_W_H (rows[i]->box, 500, (i - scroll)*row_height, 200, row_height);
+        }
+
+        layout_box_t *expected = rows[5 + scroll];
+        if (hit (&gui_st, p) != expected || !(expected->active_selectors & CSS_SEL_HOVER)) {
+            printf ("Error: hit testing didn't follow rows scrolled by %d.\n", scroll);
+            success = false;
+            break;
+        }
+    }
+
+    free (rows);
+    gui_destroy (&gui_st);
+    return success;
+}
+
+// A box that reuses the slot of a freed one must be on top of the boxes that
+// were created before it.
+bool check_reused_box_is_on_top ()
+{
+    bool success = true;
+    struct gui_state_t gui_st;
+    test_gui_init (&gui_st);
+
+    layout_box_t *boxes[3];
+    int i;
+    for (i=0; i<ARRAY_SIZE(boxes); i++) {
+        boxes[i] = next_layout_box (CSS_BUTTON);
+        BOX_X_Y_W_H (boxes[i]->box, 10*i, 10*i, 100, 100);
+    }
+
+    free_layout_box (&gui_st, boxes[0]);
+    layout_box_t *popup = next_layout_box (CSS_BUTTON);
+    BOX_X_Y_W_H (popup->box, 50, 50, 100, 100);
+    if (popup != boxes[0]) {
+        printf ("Error: freed layout box wasn't reused.\n");
+        success = false;
+    }
+
+    struct hit_grid_t *grid = &gui_st.hit_grid;
+    hit_grid_build (grid, &gui_st.layout_boxes);
+    if (hit_grid_query (grid, DVEC2 (60, 60)) != popup) {
+        printf ("Error: box reusing a freed slot isn't the topmost hit.\n");
+        success = false;
+    }
+
+    layout_box_t *expected_order[] = {boxes[1], boxes[2], popup};
+    i = 0;
+    LAYOUT_BOX_FOREACH (&gui_st.layout_boxes, lay) {
+        if (i >= ARRAY_SIZE(expected_order) || lay != expected_order[i]) {
+            printf ("Error: layout boxes aren't iterated in creation order.\n");
+            success = false;
+            break;
+        }
+        i++;
+    }
+
+    if (gui_st.layout_boxes.num_boxes != ARRAY_SIZE(expected_order)) {
+        printf ("Error: pool counts %" PRIu32 " boxes, expected %d.\n",
+                gui_st.layout_boxes.num_boxes, (int)ARRAY_SIZE(expected_order));
+        success = false;
+    }
+
+    gui_destroy (&gui_st);
+    return success;
+}
+
+int main (int argc, char **argv)
+{
+    bool success = true;
+    success = check_damage_merge () && success;
+    success = check_damage_overflow () && success;
+    success = check_update_layout_boxes_damage () && success;
+    success = check_hit_follows_moved_box () && success;
+    success = check_reused_box_is_on_top () && success;
+
+    printf ("%s\n", success ? "All checks passed." : "Some checks failed.");
+    return success ? 0 : 1;
+}
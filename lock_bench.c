@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2018 Santiago León O. <santileortiz@gmail.com>
+ */
+
+// Stress test and benchmark for the locks in common.h. Build it with and
+// without -DLOCK_STATS, the lock_bench pymk target builds both.
+//
+// Usage:
+//   lock_bench [-t THREADS] [-n ITERATIONS]
+//
+// THREADS threads each take every lock ITERATIONS times:
+//
+//  - mutex_t protects a counter that must end up at THREADS*ITERATIONS.
+//  - rwlock_t protects a pair of values that writers keep equal. Readers check
+//    they are equal and that no writer is inside, writers check they are
+//    alone.
+//  - start_mutex() and end_mutex() protect another counter.
+//
+// Reports the time per acquisition of each lock, and lock statistics when
+// built with -DLOCK_STATS. Returns non zero if a lock let two threads in at
+// once, or if the statistics don't count every acquisition.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "slo_timers.h"
+
+// One in this many rwlock acquisitions is a write.
+#define RWLOCK_WRITE_PERIOD 16
+
+struct lock_bench_t {
+    uint32_t iterations;
+
+    struct mutex_t mutex;
+    uint64_t mutex_counter;
+
+    struct rwlock_t rwlock;
+    uint64_t rw_a, rw_b;
+    uint32_t readers_inside;
+    uint32_t writers_inside;
+    uint64_t rw_writes;
+    uint64_t rw_reads;
+    uint64_t rw_errors;
+
+    volatile int spinlock;
+    uint64_t spinlock_counter;
+};
+
+void* mutex_thread (void *arg)
+{
+    struct lock_bench_t *bench = (struct lock_bench_t*)arg;
+    uint32_t i;
+    for (i=0; i<bench->iterations; i++) {
+        mutex_lock (&bench->mutex);
+        bench->mutex_counter++;
+        mutex_unlock (&bench->mutex);
+    }
+    return NULL;
+}
+
+void* rwlock_thread (void *arg)
+{
+    struct lock_bench_t *bench = (struct lock_bench_t*)arg;
+    uint32_t i;
+    for (i=0; i<bench->iterations; i++) {
+        if (i % RWLOCK_WRITE_PERIOD == 0) {
+            rwlock_write_lock (&bench->rwlock);
+            uint32_t writers = __atomic_add_fetch (&bench->writers_inside, 1, __ATOMIC_RELAXED);
+            if (writers != 1 || __atomic_load_n (&bench->readers_inside, __ATOMIC_RELAXED) != 0) {
+                __atomic_add_fetch (&bench->rw_errors, 1, __ATOMIC_RELAXED);
+            }
+
+            bench->rw_a++;
+            bench->rw_b++;
+            bench->rw_writes++;
+
+            __atomic_sub_fetch (&bench->writers_inside, 1, __ATOMIC_RELAXED);
+            rwlock_write_unlock (&bench->rwlock);
+
+        } else {
+            rwlock_read_lock (&bench->rwlock);
+            __atomic_add_fetch (&bench->readers_inside, 1, __ATOMIC_RELAXED);
+            if (__atomic_load_n (&bench->writers_inside, __ATOMIC_RELAXED) != 0 ||
+                __atomic_load_n (&bench->rw_a, __ATOMIC_RELAXED) !=
+                __atomic_load_n (&bench->rw_b, __ATOMIC_RELAXED)) {
+                __atomic_add_fetch (&bench->rw_errors, 1, __ATOMIC_RELAXED);
+            }
+            __atomic_add_fetch (&bench->rw_reads, 1, __ATOMIC_RELAXED);
+            __atomic_sub_fetch (&bench->readers_inside, 1, __ATOMIC_RELAXED);
+            rwlock_read_unlock (&bench->rwlock);
+        }
+    }
+    return NULL;
+}
+
+void* spinlock_thread (void *arg)
+{
+    struct lock_bench_t *bench = (struct lock_bench_t*)arg;
+    uint32_t i;
+    for (i=0; i<bench->iterations; i++) {
+        start_mutex (&bench->spinlock);
+        bench->spinlock_counter++;
+        end_mutex (&bench->spinlock);
+    }
+    return NULL;
+}
+
+// Runs _func_ in _num_threads_ threads and returns the time it took in ms.
+double run_threads (uint32_t num_threads, void* (*func)(void*), struct lock_bench_t *bench)
+{
+    pthread_t *threads = malloc (num_threads*sizeof(pthread_t));
+    struct timespec start, end;
+    clock_gettime (CLOCK_MONOTONIC, &start);
+
+    uint32_t i;
+    for (i=0; i<num_threads; i++) {
+        pthread_create (&threads[i], NULL, func, bench);
+    }
+    for (i=0; i<num_threads; i++) {
+        pthread_join (threads[i], NULL);
+    }
+
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    free (threads);
+    return (end.tv_sec - start.tv_sec)*1000.0 + (double)(end.tv_nsec - start.tv_nsec)/1e6;
+}
+
+void print_lock_time (char *name, double ms, uint64_t acquisitions)
+{
+    printf ("%-10s %10.3f ms %10.1f ns/acquisition\n", name, ms, ms*1e6/acquisitions);
+}
+
+void print_usage ()
+{
+    printf ("Usage: lock_bench [-t THREADS] [-n ITERATIONS]\n");
+}
+
+int main (int argc, char **argv)
+{
+    uint32_t num_threads = 4;
+    uint32_t iterations = 200000;
+
+    int i;
+    for (i=1; i<argc; i++) {
+        if (strcmp (argv[i], "-t") == 0 && i+1 < argc) {
+            num_threads = strtoul (argv[++i], NULL, 10);
+        } else if (strcmp (argv[i], "-n") == 0 && i+1 < argc) {
+            iterations = strtoul (argv[++i], NULL, 10);
+        } else {
+            print_usage ();
+            return 1;
+        }
+    }
+
+    if (num_threads == 0 || iterations == 0) {
+        print_usage ();
+        return 1;
+    }
+
+    struct lock_bench_t *bench = calloc (1, sizeof(struct lock_bench_t));
+    bench->iterations = iterations;
+    uint64_t expected = (uint64_t)num_threads*iterations;
+    bool success = true;
+
+    printf ("Threads: %" PRIu32 ", Iterations: %" PRIu32 "\n", num_threads, iterations);
+    print_lock_time ("mutex", run_threads (num_threads, mutex_thread, bench), expected);
+    print_lock_time ("rwlock", run_threads (num_threads, rwlock_thread, bench), expected);
+    print_lock_time ("spinlock", run_threads (num_threads, spinlock_thread, bench), expected);
+
+    if (bench->mutex_counter != expected) {
+        printf ("Error: mutex counter is %" PRIu64 ", expected %" PRIu64 ".\n",
+                bench->mutex_counter, expected);
+        success = false;
+    }
+
+    if (bench->rw_errors != 0 || bench->rw_a != bench->rw_b ||
+        bench->rw_reads + bench->rw_writes != expected) {
+        printf ("Error: rwlock had %" PRIu64 " readers or writers inside at once, %" PRIu64
+                " reads and %" PRIu64 " writes.\n",
+                bench->rw_errors, bench->rw_reads, bench->rw_writes);
+        success = false;
+    }
+
+    if (bench->spinlock_counter != expected) {
+        printf ("Error: spinlock counter is %" PRIu64 ", expected %" PRIu64 ".\n",
+                bench->spinlock_counter, expected);
+        success = false;
+    }
+
+    lock_stats_print ("mutex", &bench->mutex.stats);
+    lock_stats_print ("rwlock", &bench->rwlock.stats);
+#if defined(LOCK_STATS)
+    if (bench->mutex.stats.acquisitions != expected ||
+        bench->rwlock.stats.acquisitions != expected) {
+        printf ("Error: lock statistics counted %" PRIu64 " mutex and %" PRIu64
+                " rwlock acquisitions, expected %" PRIu64 ".\n",
+                bench->mutex.stats.acquisitions, bench->rwlock.stats.acquisitions, expected);
+        success = false;
+    }
+
+    if (bench->mutex.stats.contended > bench->mutex.stats.acquisitions ||
+        bench->rwlock.stats.contended > bench->rwlock.stats.acquisitions) {
+        printf ("Error: lock statistics counted more contended acquisitions than acquisitions.\n");
+        success = false;
+    }
+#endif
+
+    free (bench);
+    return success ? 0 : 1;
+}
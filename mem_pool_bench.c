@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2018 Santiago León O. <santileortiz@gmail.com>
+ */
+
+// Measures malloc churn of a transient mem_pool_t flushed every frame.
+//
+// Usage:
+//   mem_pool_bench [-f FRAMES] [-n PUSHES]
+//
+// Each frame takes a marker, pushes PUSHES allocations of mixed sizes and
+// ends the marker, like the transient pool of the X11 platform. This runs
+// three times:
+//
+//  - reuse: the pool is kept across frames, so released bins are reused.
+//  - destroy: the pool is destroyed every frame, so every bin is allocated
+//    again. This is what ending a marker did before bins were reused.
+//  - big push: like reuse, but every 100 frames one push is bigger than any
+//    bin the pool grows to on its own.
+//
+// Reports the bins allocated per frame and the time per frame. Returns non
+// zero if the free bins of the pool end up holding more than
+// MEM_POOL_MAX_FREE_BINS bins or a bin made for a big push.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "slo_timers.h"
+
+#define BIG_PUSH_PERIOD 100
+#define BIG_PUSH_SIZE megabyte(256)
+
+enum bench_mode_t {
+    BENCH_REUSE,
+    BENCH_DESTROY,
+    BENCH_BIG_PUSH
+};
+
+// Deterministic sizes so runs are comparable. Most pushes are small, one in
+// ten is between 1 KB and 64 KB.
+static inline
+uint64_t bench_push_size (uint32_t *state)
+{
+    *state = *state*1664525u + 1013904223u;
+    uint32_t r = *state >> 8;
+    if (r % 10 == 0) {
+        return 1024 + r % kilobyte(63);
+    } else {
+        return 16 + r % 496;
+    }
+}
+
+uint64_t free_bins_size (mem_pool_t *pool)
+{
+    uint64_t size = 0;
+    bin_info_t *info;
+    for (info = pool->free_bins; info != NULL; info = info->prev_bin_info) {
+        size += info->size;
+    }
+    return size;
+}
+
+bool run_frames (char *name, enum bench_mode_t mode, uint32_t num_frames, uint32_t num_pushes)
+{
+    bool success = true;
+    mem_pool_t pool = {0};
+    uint32_t state = 1;
+
+    uint64_t bins_allocated = mem_pool_bins_allocated;
+    struct timespec start, end;
+    clock_gettime (CLOCK_MONOTONIC, &start);
+
+    uint32_t frame;
+    for (frame=0; frame<num_frames; frame++) {
+        mem_pool_temp_marker_t mrkr = mem_pool_begin_temporary_memory (&pool);
+
+        uint32_t i;
+        for (i=0; i<num_pushes; i++) {
+            uint64_t size = bench_push_size (&state);
+            uint8_t *data = mem_pool_push_size (&pool, size);
+            data[0] = data[size-1] = (uint8_t)i;
+        }
+
+        if (mode == BENCH_BIG_PUSH && frame % BIG_PUSH_PERIOD == 0) {
+            uint8_t *data = mem_pool_push_size (&pool, BIG_PUSH_SIZE);
+            data[0] = data[BIG_PUSH_SIZE-1] = 1;
+        }
+
+        mem_pool_end_temporary_memory (mrkr);
+
+        if (pool.num_free_bins > MEM_POOL_MAX_FREE_BINS) {
+            printf ("Error: pool kept %u free bins, at most %u are expected.\n",
+                    pool.num_free_bins, MEM_POOL_MAX_FREE_BINS);
+            success = false;
+        }
+
+        bin_info_t *info;
+        for (info = pool.free_bins; info != NULL; info = info->prev_bin_info) {
+            if (info->is_oversized) {
+                printf ("Error: pool kept a bin of %" PRIu64 " bytes made for a single push.\n",
+                        info->size);
+                success = false;
+            }
+        }
+
+        if (mode == BENCH_DESTROY) {
+            mem_pool_destroy (&pool);
+            pool = ZERO_INIT (mem_pool_t);
+        }
+    }
+
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - start.tv_sec)*1000.0 + (double)(end.tv_nsec - start.tv_nsec)/1e6;
+    bins_allocated = mem_pool_bins_allocated - bins_allocated;
+
+    printf ("%-9s %8.2f bins/frame %10.4f ms/frame, free bins hold %" PRIu64 " KB\n",
+            name, (double)bins_allocated/num_frames, ms/num_frames, free_bins_size (&pool)/1024);
+
+    mem_pool_destroy (&pool);
+    return success;
+}
+
+void print_usage ()
+{
+    printf ("Usage: mem_pool_bench [-f FRAMES] [-n PUSHES]\n");
+}
+
+int main (int argc, char **argv)
+{
+    uint32_t num_frames = 1000;
+    uint32_t num_pushes = 400;
+
+    int i;
+    for (i=1; i<argc; i++) {
+        if (strcmp (argv[i], "-f") == 0 && i+1 < argc) {
+            num_frames = strtoul (argv[++i], NULL, 10);
+        } else if (strcmp (argv[i], "-n") == 0 && i+1 < argc) {
+            num_pushes = strtoul (argv[++i], NULL, 10);
+        } else {
+            print_usage ();
+            return 1;
+        }
+    }
+
+    if (num_frames == 0) {
+        print_usage ();
+        return 1;
+    }
+
+    bool success = true;
+    printf ("Frames: %" PRIu32 ", Pushes per frame: %" PRIu32 "\n", num_frames, num_pushes);
+    success = run_frames ("reuse", BENCH_REUSE, num_frames, num_pushes) && success;
+    success = run_frames ("destroy", BENCH_DESTROY, num_frames, num_pushes) && success;
+    success = run_frames ("big push", BENCH_BIG_PUSH, num_frames, num_pushes) && success;
+
+    return success ? 0 : 1;
+}
@@ -0,0 +1,371 @@
+/*
+ * Copyright (C) 2018 Santiago León O. <santileortiz@gmail.com>
+ */
+
+// Tests for the memory pools in common.h.
+//
+// Usage:
+//   mem_pool_test
+//
+// For mem_pool_t, checks that aligned pushes are aligned also when they start
+// a new bin, and that markers restore the padding counted in total_padding.
+//
+// For mem_pool_concurrent_t, checks that pushes from several threads don't
+// overlap, that ending a marker frees what every thread pushed after it, also
+// threads that pushed for the first time after it was taken, and that a
+// destroyed pool can be used again without reaching its old thread pools.
+//
+// Returns non zero if a check fails.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "slo_timers.h"
+
+#define TEST_THREADS 4
+#define TEST_PUSHES 2000
+
+// Pushes made by a thread. Each one is filled with a byte that identifies it,
+// so a push overlapping another one is detected.
+struct test_pushes_t {
+    uint32_t num_pushes;
+    uint8_t *ptrs[TEST_PUSHES];
+    uint32_t sizes[TEST_PUSHES];
+    uint8_t fill[TEST_PUSHES];
+};
+
+static inline
+uint8_t test_fill_byte (uint32_t thread_idx, uint32_t i)
+{
+    return (uint8_t)(thread_idx*61 + i*7 + 1);
+}
+
+// Pushes _num_ blocks of varying size to _pool_ and fills them.
+bool test_push (mem_pool_concurrent_t *pool, struct test_pushes_t *pushes,
+                uint32_t thread_idx, uint32_t num)
+{
+    uint32_t i;
+    for (i=0; i<num && pushes->num_pushes < TEST_PUSHES; i++) {
+        uint32_t idx = pushes->num_pushes;
+        uint32_t size = 1 + (idx*37 + thread_idx*11)%300;
+        uint8_t *ptr = mem_pool_concurrent_push_size (pool, size);
+        if (ptr == NULL) {
+            return false;
+        }
+
+        pushes->ptrs[idx] = ptr;
+        pushes->sizes[idx] = size;
+        pushes->fill[idx] = test_fill_byte (thread_idx, idx);
+        memset (ptr, pushes->fill[idx], size);
+        pushes->num_pushes++;
+    }
+    return true;
+}
+
+// Returns false if a block was overwritten.
+bool test_pushes_intact (struct test_pushes_t *pushes)
+{
+    uint32_t i, j;
+    for (i=0; i<pushes->num_pushes; i++) {
+        for (j=0; j<pushes->sizes[i]; j++) {
+            if (pushes->ptrs[i][j] != pushes->fill[i]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Mixes unaligned pushes with pushes aligned to 16, 32 and 64 bytes. Bins
+// are small and the pool is flushed every 100 pushes, so many aligned pushes
+// are the first one of a new or reused bin.
+bool check_aligned_push ()
+{
+    bool success = true;
+    uint32_t alignments[] = {16, 32, 64};
+    mem_pool_t pool = {0};
+    pool.min_bin_size = MEM_POOL_MIN_BIN_SIZE;
+
+    struct test_pushes_t *pushes = calloc (1, sizeof(struct test_pushes_t));
+    uint32_t num_first_in_bin = 0;
+    uint32_t frame;
+    for (frame=0; frame<TEST_PUSHES/100; frame++) {
+        mem_pool_temp_marker_t mrkr = mem_pool_begin_temporary_memory (&pool);
+        pushes->num_pushes = 0;
+
+        uint32_t i;
+        for (i=0; i<100; i++) {
+            uint32_t size = 1 + (i*37 + frame*13)%300;
+            uint32_t alignment = alignments[(i + frame)%ARRAY_SIZE(alignments)];
+
+            uint8_t *ptr;
+            if (i%4 == 3) {
+                ptr = mem_pool_push_size (&pool, size);
+            } else {
+                void *base = pool.base;
+                ptr = mem_pool_push_size_aligned (&pool, size, alignment);
+                if (pool.base != base) {
+                    num_first_in_bin++;
+                }
+
+                if ((uintptr_t)ptr % alignment != 0) {
+                    printf ("Error: push aligned to %" PRIu32 " bytes returned %p%s.\n", alignment,
+                            ptr, pool.base != base ? ", at the start of a bin" : "");
+                    success = false;
+                }
+            }
+
+            pushes->ptrs[i] = ptr;
+            pushes->sizes[i] = size;
+            pushes->fill[i] = test_fill_byte (frame, i);
+            memset (ptr, pushes->fill[i], size);
+            pushes->num_pushes++;
+        }
+
+        if (!test_pushes_intact (pushes)) {
+            printf ("Error: aligned pushes overlap.\n");
+            success = false;
+        }
+        mem_pool_end_temporary_memory (mrkr);
+    }
+
+    if (num_first_in_bin < TEST_PUSHES/100) {
+        printf ("Error: expected an aligned push at the start of a bin in every flush, got %"
+                PRIu32 ".\n", num_first_in_bin);
+        success = false;
+    }
+
+    mem_pool_destroy (&pool);
+    free (pushes);
+    return success;
+}
+
+// Ends markers taken in the middle of a bin, and before the first push, after
+// aligned pushes that crossed bin boundaries.
+bool check_marker_padding ()
+{
+    bool success = true;
+    mem_pool_t pool = {0};
+    pool.min_bin_size = MEM_POOL_MIN_BIN_SIZE;
+
+    mem_pool_temp_marker_t empty_mrkr = mem_pool_begin_temporary_memory (&pool);
+
+    uint32_t round;
+    for (round=0; round<3; round++) {
+        mem_pool_push_size (&pool, 3);
+        mem_pool_push_size_aligned (&pool, 100, 64);
+        mem_pool_push_size (&pool, 5);
+
+        uint64_t total_used = pool.total_used;
+        uint64_t total_padding = pool.total_padding;
+        uint32_t num_bins = pool.num_bins;
+        mem_pool_temp_marker_t mrkr = mem_pool_begin_temporary_memory (&pool);
+
+        uint32_t i;
+        for (i=0; i<200; i++) {
+            mem_pool_push_size (&pool, 1 + i%7);
+            mem_pool_push_size_aligned (&pool, 1 + i%50, 16 << (i%3));
+        }
+
+        if (pool.total_padding <= total_padding || pool.num_bins == num_bins) {
+            printf ("Error: expected aligned pushes with padding across bins after the marker.\n");
+            success = false;
+        }
+
+        mem_pool_end_temporary_memory (mrkr);
+        if (pool.total_used != total_used || pool.total_padding != total_padding) {
+            printf ("Error: ending a marker left total_used = %" PRIu64 " and total_padding = %"
+                    PRIu64 ", expected %" PRIu64 " and %" PRIu64 ".\n",
+                    pool.total_used, pool.total_padding, total_used, total_padding);
+            success = false;
+        }
+    }
+
+    mem_pool_end_temporary_memory (empty_mrkr);
+    if (pool.total_used != 0 || pool.total_padding != 0) {
+        printf ("Error: ending a marker taken on an empty pool left total_used = %" PRIu64
+                " and total_padding = %" PRIu64 ".\n", pool.total_used, pool.total_padding);
+        success = false;
+    }
+
+    mem_pool_destroy (&pool);
+    return success;
+}
+
+struct test_thread_t {
+    mem_pool_concurrent_t *pool;
+    pthread_barrier_t *barrier;
+    uint32_t idx;
+    struct test_pushes_t pushes;
+    bool success;
+};
+
+// Pushes in three phases, the main thread takes a marker after the first one
+// and ends it after the second one.
+void* test_marker_thread (void *arg)
+{
+    struct test_thread_t *thread = (struct test_thread_t*)arg;
+    thread->success = test_push (thread->pool, &thread->pushes, thread->idx, 500);
+    pthread_barrier_wait (thread->barrier); // Marker is taken
+    pthread_barrier_wait (thread->barrier);
+
+    uint32_t num_before_marker = thread->pushes.num_pushes;
+    thread->success = test_push (thread->pool, &thread->pushes, thread->idx, 500) && thread->success;
+    pthread_barrier_wait (thread->barrier); // Marker is ended
+    pthread_barrier_wait (thread->barrier);
+
+    thread->pushes.num_pushes = num_before_marker;
+    thread->success = test_push (thread->pool, &thread->pushes, thread->idx, 500) && thread->success;
+    return NULL;
+}
+
+// Only pushes after the marker was taken, it's created during the second
+// phase of test_marker_thread().
+void* test_late_thread (void *arg)
+{
+    struct test_thread_t *thread = (struct test_thread_t*)arg;
+    thread->success = test_push (thread->pool, &thread->pushes, thread->idx, 1000);
+    return NULL;
+}
+
+bool check_concurrent_markers ()
+{
+    bool success = true;
+    mem_pool_concurrent_t pool = {0};
+    pool.min_bin_size = 4096; // Small bins so pushes cross bin boundaries
+    pthread_barrier_t barrier;
+    pthread_barrier_init (&barrier, NULL, TEST_THREADS+1);
+
+    struct test_thread_t *threads = calloc (TEST_THREADS+1, sizeof(struct test_thread_t));
+    pthread_t thread_ids[TEST_THREADS+1];
+    uint32_t i;
+    for (i=0; i<TEST_THREADS+1; i++) {
+        threads[i].pool = &pool;
+        threads[i].barrier = &barrier;
+        threads[i].idx = i;
+    }
+    struct test_thread_t *late = &threads[TEST_THREADS];
+
+    for (i=0; i<TEST_THREADS; i++) {
+        pthread_create (&thread_ids[i], NULL, test_marker_thread, &threads[i]);
+    }
+    pthread_barrier_wait (&barrier);
+
+    uint64_t allocated_before = mem_pool_concurrent_allocated (&pool);
+    mem_pool_concurrent_marker_t mrkr = mem_pool_concurrent_begin_temporary_memory (&pool);
+    pthread_barrier_wait (&barrier);
+
+    pthread_create (&thread_ids[TEST_THREADS], NULL, test_late_thread, late);
+    pthread_join (thread_ids[TEST_THREADS], NULL);
+    pthread_barrier_wait (&barrier);
+
+    uint64_t allocated_during = mem_pool_concurrent_allocated (&pool);
+    if (allocated_during <= allocated_before) {
+        printf ("Error: pushes after the marker didn't allocate, %" PRIu64 " bytes before and %"
+                PRIu64 " after.\n", allocated_before, allocated_during);
+        success = false;
+    }
+
+    for (i=0; i<TEST_THREADS+1; i++) {
+        if (!test_pushes_intact (&threads[i].pushes)) {
+            printf ("Error: pushes from different threads overlap.\n");
+            success = false;
+            break;
+        }
+    }
+
+    mem_pool_concurrent_end_temporary_memory (mrkr);
+    uint64_t allocated_after = mem_pool_concurrent_allocated (&pool);
+    if (allocated_after != allocated_before) {
+        printf ("Error: ending the marker left %" PRIu64 " bytes allocated, expected %" PRIu64 ".\n",
+                allocated_after, allocated_before);
+        success = false;
+    }
+    pthread_barrier_wait (&barrier);
+
+    for (i=0; i<TEST_THREADS; i++) {
+        pthread_join (thread_ids[i], NULL);
+    }
+
+    // Threads pushed again over the memory freed by the marker, what they
+    // pushed before it must still be there.
+    for (i=0; i<TEST_THREADS+1; i++) {
+        if (!threads[i].success) {
+            printf ("Error: push to the concurrent pool failed.\n");
+            success = false;
+            break;
+        }
+
+        if (i < TEST_THREADS && !test_pushes_intact (&threads[i].pushes)) {
+            printf ("Error: pushes after ending a marker overwrote older ones.\n");
+            success = false;
+            break;
+        }
+    }
+
+    mem_pool_concurrent_destroy (&pool);
+    pthread_barrier_destroy (&barrier);
+    free (threads);
+    return success;
+}
+
+// Pushes from the calling thread, destroys the pool and pushes again. The
+// thread's cached pool belongs to the old id, the new push must not use it.
+// Also uses more pools than entries in the thread's cache.
+bool check_concurrent_destroy ()
+{
+    bool success = true;
+    mem_pool_concurrent_t pools[2*MEM_POOL_CONCURRENT_THREAD_CACHE+1] = {0};
+
+    uint32_t round;
+    for (round=0; round<3; round++) {
+        uint64_t old_ids[ARRAY_SIZE(pools)];
+        uint32_t i;
+        for (i=0; i<ARRAY_SIZE(pools); i++) {
+            uint8_t *ptr = mem_pool_concurrent_push_size (&pools[i], 100 + i);
+            memset (ptr, i, 100 + i);
+            old_ids[i] = pools[i].id;
+        }
+
+        for (i=0; i<ARRAY_SIZE(pools); i++) {
+            mem_pool_concurrent_push_size (&pools[i], 100 + i);
+            if (mem_pool_concurrent_allocated (&pools[i]) == 0 || pools[i].threads == NULL ||
+                pools[i].threads->next != NULL) {
+                printf ("Error: a push went to the thread pool of another concurrent pool.\n");
+                success = false;
+            }
+        }
+
+        for (i=0; i<ARRAY_SIZE(pools); i++) {
+            mem_pool_concurrent_destroy (&pools[i]);
+            if (mem_pool_concurrent_allocated (&pools[i]) != 0) {
+                printf ("Error: destroyed concurrent pool has memory allocated.\n");
+                success = false;
+            }
+
+            uint8_t *ptr = mem_pool_concurrent_push_size (&pools[i], 64);
+            memset (ptr, 0xAA, 64);
+            if (pools[i].id == old_ids[i] || mem_pool_concurrent_allocated (&pools[i]) == 0) {
+                printf ("Error: push after destroying a concurrent pool used its old thread pool.\n");
+                success = false;
+            }
+            mem_pool_concurrent_destroy (&pools[i]);
+        }
+    }
+    return success;
+}
+
+int main (int argc, char **argv)
+{
+    bool success = true;
+    success = check_aligned_push () && success;
+    success = check_marker_padding () && success;
+    success = check_concurrent_markers () && success;
+    success = check_concurrent_destroy () && success;
+
+    printf ("%s\n", success ? "All checks passed." : "Some checks failed.");
+    return success ? 0 : 1;
+}
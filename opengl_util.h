@@ -19,6 +19,231 @@ void debug_message_callback( GLenum source,
 
 static char *global_shader_folder = NULL;
 
+// Counters of the GL work submitted during a frame. All draw calls should go
+// through gl_draw_arrays() or gl_draw_arrays_instanced() so they get counted.
+struct gl_frame_stats_t {
+    uint32_t draw_calls;
+    uint64_t instances;
+    uint64_t vertices;
+};
+
+// NOTE: Until gl_frame_stats_begin() is called, this holds the counters of the
+// last frame that was rendered.
+struct gl_frame_stats_t gl_frame_stats;
+
+static inline
+void gl_frame_stats_begin ()
+{
+    gl_frame_stats = ZERO_INIT(struct gl_frame_stats_t);
+}
+
+static inline
+void gl_draw_arrays (GLenum mode, GLint first, GLsizei count)
+{
+    gl_frame_stats.draw_calls++;
+    gl_frame_stats.instances++;
+    gl_frame_stats.vertices += count;
+    glDrawArrays (mode, first, count);
+}
+
+static inline
+void gl_draw_arrays_instanced (GLenum mode, GLint first, GLsizei count, GLsizei instance_count)
+{
+    gl_frame_stats.draw_calls++;
+    gl_frame_stats.instances += instance_count;
+    gl_frame_stats.vertices += (uint64_t)count*instance_count;
+    glDrawArraysInstanced (mode, first, count, instance_count);
+}
+
+void gl_frame_stats_print (struct gl_frame_stats_t *stats)
+{
+    printf ("Draw calls: %" PRIu32 ", Instances: %" PRIu64 ", Vertices: %" PRIu64 "\n",
+            stats->draw_calls, stats->instances, stats->vertices);
+}
+
+//////////////////////
+// GPU PROFILER
+//
+// Adds GPU zones to the scoped profiler from slo_timers.h. Each zone issues a
+// GL_TIMESTAMP query at its beginning and end, results are collected some
+// frames later so we never stall waiting for the GPU. Resolved times are
+// written into the profiler's frame, in the same timeline as CPU zones.
+//
+// Usage:
+//   gpu_prof_begin_frame ();   // After prof_begin_frame()
+//   GPU_PROF_BEGIN ("opaque");
+//   <GL calls to measure>
+//   GPU_PROF_END;
+//   gpu_prof_end_frame ();     // Before prof_end_frame()
+//
+// NOTE: GPU zones are also CPU zones, they can be nested with PROF_BEGIN() and
+// PROF_END but their ends must be matched with GPU_PROF_END.
+
+#define GPU_PROF_MAX_ZONES 32
+#define GPU_PROF_FRAMES_IN_FLIGHT 4
+
+struct gpu_prof_frame_t {
+    bool pending;
+    uint64_t frame_id;
+
+    // GL_TIMESTAMP at the beginning of the frame, and the CPU time (relative
+    // to the start of the frame) at which it was read.
+    int64_t gpu_base;
+    int64_t cpu_base_ns;
+
+    uint32_t num_zones;
+    uint32_t zone_ids[GPU_PROF_MAX_ZONES];
+    GLuint queries[2*GPU_PROF_MAX_ZONES];
+};
+
+struct gpu_profiler_t {
+    bool initialized;
+    bool in_frame;
+    uint32_t curr;
+    uint32_t dropped_zones;
+
+    uint32_t depth;
+    uint32_t stack[PROF_MAX_DEPTH];
+
+    struct gpu_prof_frame_t frames[GPU_PROF_FRAMES_IN_FLIGHT];
+};
+
+struct gpu_profiler_t global_gpu_profiler;
+
+// Copies the results of _gframe_ into the profiler. If _wait_ is false and the
+// results aren't available yet, returns false and nothing is copied.
+bool gpu_prof_resolve_frame (struct profiler_t *prof, struct gpu_prof_frame_t *gframe, bool wait)
+{
+    if (gframe->num_zones > 0 && !wait) {
+        GLint available;
+        glGetQueryObjectiv (gframe->queries[2*gframe->num_zones - 1],
+                            GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            return false;
+        }
+    }
+
+    // NOTE: The frame may have been overwritten in the ring buffer already.
+    struct prof_frame_t *frame = &prof->frames[gframe->frame_id%PROF_NUM_FRAMES];
+    bool frame_valid = frame->id == gframe->frame_id;
+
+    uint32_t i;
+    for (i=0; i<gframe->num_zones; i++) {
+        GLuint64 start, end;
+        glGetQueryObjectui64v (gframe->queries[2*i], GL_QUERY_RESULT, &start);
+        glGetQueryObjectui64v (gframe->queries[2*i+1], GL_QUERY_RESULT, &end);
+
+        if (frame_valid) {
+            struct prof_zone_t *zone = &frame->zones[gframe->zone_ids[i]];
+            zone->start_ns = gframe->cpu_base_ns + ((int64_t)start - gframe->gpu_base);
+            zone->end_ns = gframe->cpu_base_ns + ((int64_t)end - gframe->gpu_base);
+            zone->resolved = true;
+        }
+    }
+
+    gframe->pending = false;
+    return true;
+}
+
+void gpu_prof_begin_frame_full (struct gpu_profiler_t *gprof, struct profiler_t *prof)
+{
+    if (!prof->enabled || !prof->in_frame) {
+        return;
+    }
+
+    if (!gprof->initialized) {
+        int i;
+        for (i=0; i<GPU_PROF_FRAMES_IN_FLIGHT; i++) {
+            glGenQueries (2*GPU_PROF_MAX_ZONES, gprof->frames[i].queries);
+        }
+        gprof->initialized = true;
+    }
+
+    gprof->curr = (gprof->curr + 1)%GPU_PROF_FRAMES_IN_FLIGHT;
+    struct gpu_prof_frame_t *gframe = &gprof->frames[gprof->curr];
+    if (gframe->pending) {
+        // NOTE: The GPU is GPU_PROF_FRAMES_IN_FLIGHT frames behind, at this
+        // point waiting is the only option.
+        gpu_prof_resolve_frame (prof, gframe, true);
+    }
+
+    struct prof_frame_t *frame = prof_curr_frame (prof);
+    gframe->frame_id = frame->id;
+    gframe->num_zones = 0;
+
+    GLint64 gpu_now;
+    glGetInteger64v (GL_TIMESTAMP, &gpu_now);
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    gframe->gpu_base = gpu_now;
+    gframe->cpu_base_ns = timespec_diff_ns (&frame->start, &now);
+
+    gprof->depth = 0;
+    gprof->in_frame = true;
+}
+
+void gpu_prof_zone_begin (struct gpu_profiler_t *gprof, struct profiler_t *prof, const char *name)
+{
+    int id = prof_zone_begin (prof, name, true);
+    if (!gprof->in_frame || gprof->depth == PROF_MAX_DEPTH) {
+        return;
+    }
+
+    struct gpu_prof_frame_t *gframe = &gprof->frames[gprof->curr];
+    if (id == -1 || gframe->num_zones == GPU_PROF_MAX_ZONES) {
+        if (id != -1) {
+            gprof->dropped_zones++;
+        }
+        gprof->stack[gprof->depth++] = UINT32_MAX;
+        return;
+    }
+
+    uint32_t idx = gframe->num_zones++;
+    gframe->zone_ids[idx] = id;
+    glQueryCounter (gframe->queries[2*idx], GL_TIMESTAMP);
+    gprof->stack[gprof->depth++] = idx;
+}
+
+void gpu_prof_zone_end (struct gpu_profiler_t *gprof, struct profiler_t *prof)
+{
+    prof_zone_end (prof);
+    if (!gprof->in_frame || gprof->depth == 0) {
+        return;
+    }
+
+    uint32_t idx = gprof->stack[--gprof->depth];
+    if (idx != UINT32_MAX) {
+        struct gpu_prof_frame_t *gframe = &gprof->frames[gprof->curr];
+        glQueryCounter (gframe->queries[2*idx+1], GL_TIMESTAMP);
+    }
+}
+
+// Collects the results of all previous frames that are already available.
+void gpu_prof_end_frame_full (struct gpu_profiler_t *gprof, struct profiler_t *prof)
+{
+    if (!gprof->in_frame) {
+        return;
+    }
+
+    struct gpu_prof_frame_t *gframe = &gprof->frames[gprof->curr];
+    gframe->pending = true;
+    gprof->in_frame = false;
+
+    // Oldest frames first, they are the most likely to be available.
+    int i;
+    for (i=1; i<=GPU_PROF_FRAMES_IN_FLIGHT; i++) {
+        gframe = &gprof->frames[(gprof->curr + i)%GPU_PROF_FRAMES_IN_FLIGHT];
+        if (gframe->pending && !gpu_prof_resolve_frame (prof, gframe, false)) {
+            break;
+        }
+    }
+}
+
+#define gpu_prof_begin_frame() gpu_prof_begin_frame_full(&global_gpu_profiler,&global_profiler)
+#define gpu_prof_end_frame() gpu_prof_end_frame_full(&global_gpu_profiler,&global_profiler)
+#define GPU_PROF_BEGIN(name) gpu_prof_zone_begin(&global_gpu_profiler,&global_profiler,name)
+#define GPU_PROF_END gpu_prof_zone_end(&global_gpu_profiler,&global_profiler)
+
 GLuint gl_program (const char *vertex_shader_source, const char *fragment_shader_source)
 {
     bool compilation_failed = false;
@@ -70,21 +295,22 @@ GLuint gl_program (const char *vertex_shader_source, const char *fragment_shader
     return program_id;
 }
 
-void create_color_texture (GLuint *id, float width, float height, int num_samples)
+void create_color_texture_format (GLuint *id, GLenum internal_format,
+                                  float width, float height, int num_samples)
 {
     glGenTextures (1, id);
     if (num_samples > 0) {
         glBindTexture (GL_TEXTURE_2D_MULTISAMPLE, *id);
 
         glTexImage2DMultisample (
-            GL_TEXTURE_2D_MULTISAMPLE, num_samples, GL_RGBA,
+            GL_TEXTURE_2D_MULTISAMPLE, num_samples, internal_format,
             width, height, GL_FALSE
         );
     } else {
         glBindTexture (GL_TEXTURE_2D, *id);
 
         glTexImage2D (
-            GL_TEXTURE_2D, 0, GL_RGBA,
+            GL_TEXTURE_2D, 0, internal_format,
             width, height, 0,
             GL_RGBA, GL_UNSIGNED_BYTE, NULL
         );
@@ -94,6 +320,11 @@ void create_color_texture (GLuint *id, float width, float height, int num_sample
     }
 }
 
+void create_color_texture (GLuint *id, float width, float height, int num_samples)
+{
+    create_color_texture_format (id, GL_RGBA, width, height, num_samples);
+}
+
 void create_depth_texture (GLuint *id, float width, float height, int num_samples)
 {
     glGenTextures (1, id);
@@ -249,6 +480,39 @@ void draw_into_window (app_graphics_t *graphics)
     glScissor (0, 0, graphics->width, graphics->height);
 }
 
+// Copies the damaged rectangles of an ARGB32 _surface_ into _texture_, which
+// must have its same size. Rows are kept in cairo's order, the first one is the
+// top one.
+void upload_damaged_surface (struct damage_t *damage, cairo_surface_t *surface, GLuint texture)
+{
+    cairo_surface_flush (surface);
+    uint8_t *data = cairo_image_surface_get_data (surface);
+    int stride = cairo_image_surface_get_stride (surface);
+    int width = cairo_image_surface_get_width (surface);
+    int height = cairo_image_surface_get_height (surface);
+
+    glBindTexture (GL_TEXTURE_2D, texture);
+    glPixelStorei (GL_UNPACK_ROW_LENGTH, stride/4);
+    int i;
+    for (i=0; i<damage->num_rects; i++) {
+        box_t *r = &damage->rects[i];
+        int x = CLAMP (r->min.x, 0, width);
+        int y = CLAMP (r->min.y, 0, height);
+        int w = CLAMP (r->max.x, 0, width) - x;
+        int h = CLAMP (r->max.y, 0, height) - y;
+        if (w <= 0 || h <= 0) {
+            continue;
+        }
+
+        glPixelStorei (GL_UNPACK_SKIP_PIXELS, x);
+        glPixelStorei (GL_UNPACK_SKIP_ROWS, y);
+        glTexSubImage2D (GL_TEXTURE_2D, 0, x, y, w, h, GL_BGRA, GL_UNSIGNED_BYTE, data);
+    }
+    glPixelStorei (GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei (GL_UNPACK_SKIP_PIXELS, 0);
+    glPixelStorei (GL_UNPACK_SKIP_ROWS, 0);
+}
+
 struct quad_renderer_t {
     GLuint vao;
     GLuint program_id;
@@ -351,7 +615,7 @@ void blend_premul_quad (struct quad_renderer_t *quad_prog,
     glScissor (x, graphics->height - y - height_px, width_px, height_px);
 
     glUniform1i (glGetUniformLocation (quad_prog->program_id, "ignore_alpha"), 0);
-    glDrawArrays (GL_TRIANGLES, 0, 6);
+    gl_draw_arrays (GL_TRIANGLES, 0, 6);
 }
 
 void render_opaque_quad (struct quad_renderer_t *quad_prog,
@@ -378,7 +642,7 @@ void render_opaque_quad (struct quad_renderer_t *quad_prog,
     glScissor (x, graphics->height - y - height_px, width_px, height_px);
 
     glUniform1i (glGetUniformLocation (quad_prog->program_id, "ignore_alpha"), 1);
-    glDrawArrays (GL_TRIANGLES, 0, 6);
+    gl_draw_arrays (GL_TRIANGLES, 0, 6);
 }
 
 void render_framebuffer (struct quad_renderer_t *quad_prog,
@@ -396,5 +660,275 @@ void render_framebuffer (struct quad_renderer_t *quad_prog,
     }
 }
 
+//////////////////////
+// TEXT RENDERER
+//
+// Labels drawn on top of the scene. Printable ASCII glyphs are rasterized once
+// with cairo into a single channel atlas texture, then strings are drawn as one
+// textured quad per glyph. Quads are accumulated in a vertex array and all
+// strings pushed during a frame are drawn with a single draw call.
+//
+// Usage:
+//   text_renderer_begin (&tr);
+//   text_renderer_push_str (&tr, x, y, "12.5 cm", color); // For each label
+//   text_renderer_flush (&tr, graphics);
+#define GLYPH_ATLAS_FIRST_CHAR ' '
+#define GLYPH_ATLAS_LAST_CHAR '~'
+#define GLYPH_ATLAS_NUM_GLYPHS (GLYPH_ATLAS_LAST_CHAR - GLYPH_ATLAS_FIRST_CHAR + 1)
+#define GLYPH_ATLAS_WIDTH 256
+
+struct glyph_t {
+    // Rectangle in the atlas, in pixels
+    int x, y;
+    int width, height;
+
+    // Offset from the pen position to the top left corner of the rectangle
+    float bearing_x;
+    float bearing_y;
+    float advance;
+};
+
+struct glyph_atlas_t {
+    GLuint texture;
+    int width;
+    int height;
+    float ascent;
+    float descent;
+    struct glyph_t glyphs[GLYPH_ATLAS_NUM_GLYPHS];
+};
+
+// NOTE: Glyphs are padded by a pixel so bilinear filtering never reads from
+// their neighbors.
+struct glyph_atlas_t glyph_atlas_init (const char *font_family, double font_size_px)
+{
+    struct glyph_atlas_t atlas = {0};
+    atlas.width = GLYPH_ATLAS_WIDTH;
+
+    // Measure glyphs and pack them in rows.
+    cairo_surface_t *measure_surface = cairo_image_surface_create (CAIRO_FORMAT_A8, 1, 1);
+    cairo_t *cr = cairo_create (measure_surface);
+    cairo_select_font_face (cr, font_family, CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+    cairo_set_font_size (cr, font_size_px);
+
+    cairo_font_extents_t font_extents;
+    cairo_font_extents (cr, &font_extents);
+    atlas.ascent = font_extents.ascent;
+    atlas.descent = font_extents.descent;
+
+    int x = 1, y = 1, row_height = 0;
+    int i;
+    for (i=0; i<GLYPH_ATLAS_NUM_GLYPHS; i++) {
+        char str[] = {(char)(GLYPH_ATLAS_FIRST_CHAR + i), '\0'};
+        cairo_text_extents_t extents;
+        cairo_text_extents (cr, str, &extents);
+
+        struct glyph_t *glyph = &atlas.glyphs[i];
+        glyph->bearing_x = floor (extents.x_bearing);
+        glyph->bearing_y = floor (extents.y_bearing);
+        glyph->width = ceil (extents.x_bearing + extents.width) - glyph->bearing_x;
+        glyph->height = ceil (extents.y_bearing + extents.height) - glyph->bearing_y;
+        glyph->advance = extents.x_advance;
+
+        if (x + glyph->width + 1 > atlas.width) {
+            x = 1;
+            y += row_height + 1;
+            row_height = 0;
+        }
+        glyph->x = x;
+        glyph->y = y;
+        x += glyph->width + 1;
+        row_height = MAX (row_height, glyph->height);
+    }
+    atlas.height = y + row_height + 1;
+    cairo_destroy (cr);
+    cairo_surface_destroy (measure_surface);
+
+    // Rasterize
+    cairo_surface_t *surface = cairo_image_surface_create (CAIRO_FORMAT_A8, atlas.width, atlas.height);
+    cr = cairo_create (surface);
+    cairo_select_font_face (cr, font_family, CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+    cairo_set_font_size (cr, font_size_px);
+    cairo_set_source_rgba (cr, 1, 1, 1, 1);
+    for (i=0; i<GLYPH_ATLAS_NUM_GLYPHS; i++) {
+        char str[] = {(char)(GLYPH_ATLAS_FIRST_CHAR + i), '\0'};
+        struct glyph_t *glyph = &atlas.glyphs[i];
+        cairo_move_to (cr, glyph->x - glyph->bearing_x, glyph->y - glyph->bearing_y);
+        cairo_show_text (cr, str);
+    }
+    cairo_destroy (cr);
+    cairo_surface_flush (surface);
+
+    glGenTextures (1, &atlas.texture);
+    glBindTexture (GL_TEXTURE_2D, atlas.texture);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glPixelStorei (GL_UNPACK_ROW_LENGTH, cairo_image_surface_get_stride (surface));
+    glTexImage2D (GL_TEXTURE_2D, 0, GL_R8, atlas.width, atlas.height, 0,
+                  GL_RED, GL_UNSIGNED_BYTE, cairo_image_surface_get_data (surface));
+    glPixelStorei (GL_UNPACK_ROW_LENGTH, 0);
+    cairo_surface_destroy (surface);
+
+    return atlas;
+}
+
+struct text_vertex_t {
+    float x, y; // In pixels from the top left corner of the window
+    float u, v;
+    uint8_t color[4];
+};
+
+struct text_renderer_t {
+    GLuint vao;
+    GLuint vbo;
+    GLuint program_id;
+    GLuint viewport_size_loc;
+    uint32_t vbo_capacity; // In vertices
+
+    struct glyph_atlas_t atlas;
+
+    uint32_t num_vertices;
+    uint32_t vertices_size;
+    struct text_vertex_t *vertices;
+};
+
+struct text_renderer_t init_text_renderer (const char *font_family, double font_size_px)
+{
+    struct text_renderer_t res = {0};
+    res.program_id = gl_program ("text_vertex_shader.glsl", "text_fragment_shader.glsl");
+    if (!res.program_id) {
+        return res;
+    }
+    res.viewport_size_loc = glGetUniformLocation (res.program_id, "viewport_size");
+    glUniform1i (glGetUniformLocation (res.program_id, "atlas"), 0);
+
+    glGenVertexArrays (1, &res.vao);
+    glBindVertexArray (res.vao);
+    glGenBuffers (1, &res.vbo);
+    glBindBuffer (GL_ARRAY_BUFFER, res.vbo);
+
+    GLuint pos_loc = glGetAttribLocation (res.program_id, "position");
+    glEnableVertexAttribArray (pos_loc);
+    glVertexAttribPointer (pos_loc, 2, GL_FLOAT, GL_FALSE, sizeof(struct text_vertex_t),
+                           0);
+
+    GLuint tex_coord_loc = glGetAttribLocation (res.program_id, "tex_coord_in");
+    glEnableVertexAttribArray (tex_coord_loc);
+    glVertexAttribPointer (tex_coord_loc, 2, GL_FLOAT, GL_FALSE, sizeof(struct text_vertex_t),
+                           (void*)(2*sizeof(float)));
+
+    GLuint color_loc = glGetAttribLocation (res.program_id, "color_in");
+    glEnableVertexAttribArray (color_loc);
+    glVertexAttribPointer (color_loc, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(struct text_vertex_t),
+                           (void*)(4*sizeof(float)));
+
+    res.atlas = glyph_atlas_init (font_family, font_size_px);
+    return res;
+}
+
+void text_renderer_begin (struct text_renderer_t *tr)
+{
+    tr->num_vertices = 0;
+}
+
+static inline
+struct glyph_t* text_renderer_glyph (struct text_renderer_t *tr, char c)
+{
+    if (c < GLYPH_ATLAS_FIRST_CHAR || c > GLYPH_ATLAS_LAST_CHAR) {
+        c = '?';
+    }
+    return &tr->atlas.glyphs[c - GLYPH_ATLAS_FIRST_CHAR];
+}
+
+// Width in pixels of _str_ as drawn by text_renderer_push_str().
+float text_renderer_str_width (struct text_renderer_t *tr, char *str)
+{
+    float width = 0;
+    while (*str) {
+        width += text_renderer_glyph (tr, *str)->advance;
+        str++;
+    }
+    return width;
+}
+
+// Queues _str_ to be drawn with the top left corner of its line box at (x,y),
+// in pixels from the top left corner of the window. Returns the x coordinate
+// where the string ends.
+float text_renderer_push_str (struct text_renderer_t *tr, float x, float y,
+                              char *str, dvec4 color)
+{
+    uint32_t len = strlen (str);
+    if (tr->num_vertices + 6*len > tr->vertices_size) {
+        tr->vertices_size = MAX (2*tr->vertices_size, tr->num_vertices + 6*len);
+        tr->vertices = realloc (tr->vertices, tr->vertices_size*sizeof(struct text_vertex_t));
+    }
+
+    uint8_t c[4] = {CLAMP(color.r, 0, 1)*255, CLAMP(color.g, 0, 1)*255,
+                    CLAMP(color.b, 0, 1)*255, CLAMP(color.a, 0, 1)*255};
+    float inv_w = 1.0f/tr->atlas.width, inv_h = 1.0f/tr->atlas.height;
+
+    // NOTE: Glyphs are placed at whole pixels, otherwise bilinear filtering
+    // blurs them.
+    float baseline = roundf (y + tr->atlas.ascent);
+    float pen_x = x;
+    uint32_t i;
+    for (i=0; i<len; i++) {
+        struct glyph_t *g = text_renderer_glyph (tr, str[i]);
+        if (g->width > 0 && g->height > 0) {
+            float x0 = roundf (pen_x) + g->bearing_x;
+            float y0 = baseline + g->bearing_y;
+            float x1 = x0 + g->width;
+            float y1 = y0 + g->height;
+            float u0 = g->x*inv_w, v0 = g->y*inv_h;
+            float u1 = (g->x + g->width)*inv_w, v1 = (g->y + g->height)*inv_h;
+
+            struct text_vertex_t quad[] = {
+                {x0, y0, u0, v0, {c[0], c[1], c[2], c[3]}},
+                {x1, y1, u1, v1, {c[0], c[1], c[2], c[3]}},
+                {x1, y0, u1, v0, {c[0], c[1], c[2], c[3]}},
+
+                {x0, y0, u0, v0, {c[0], c[1], c[2], c[3]}},
+                {x0, y1, u0, v1, {c[0], c[1], c[2], c[3]}},
+                {x1, y1, u1, v1, {c[0], c[1], c[2], c[3]}},
+            };
+            memcpy (tr->vertices + tr->num_vertices, quad, sizeof(quad));
+            tr->num_vertices += ARRAY_SIZE(quad);
+        }
+        pen_x += g->advance;
+    }
+    return pen_x;
+}
+
+// Draws everything pushed since text_renderer_begin() into the window with a
+// single draw call. Expects premultiplied OVER blending to be set up.
+void text_renderer_flush (struct text_renderer_t *tr, app_graphics_t *graphics)
+{
+    if (tr->num_vertices == 0 || !tr->program_id) {
+        return;
+    }
+
+    glBindVertexArray (tr->vao);
+    glBindBuffer (GL_ARRAY_BUFFER, tr->vbo);
+    // NOTE: The buffer is only reallocated when it grows, otherwise we
+    // orphan it so we don't wait for the GPU to finish with last frame's
+    // labels.
+    if (tr->num_vertices > tr->vbo_capacity) {
+        tr->vbo_capacity = MAX (2*tr->vbo_capacity, tr->num_vertices);
+    }
+    glBufferData (GL_ARRAY_BUFFER, tr->vbo_capacity*sizeof(struct text_vertex_t), NULL, GL_STREAM_DRAW);
+    glBufferSubData (GL_ARRAY_BUFFER, 0, tr->num_vertices*sizeof(struct text_vertex_t), tr->vertices);
+
+    glUseProgram (tr->program_id);
+    glUniform2f (tr->viewport_size_loc, graphics->width, graphics->height);
+    glActiveTexture (GL_TEXTURE0);
+    glBindTexture (GL_TEXTURE_2D, tr->atlas.texture);
+
+    glDisable (GL_DEPTH_TEST);
+    glEnable (GL_BLEND);
+    draw_into_window (graphics);
+    gl_draw_arrays (GL_TRIANGLES, 0, tr->num_vertices);
+}
+
 #define OPENGL_UTIL_H
 #endif
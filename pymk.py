@@ -10,6 +10,7 @@ DEP_FLAGS = '-lGL ' \
             '-lxcb ' \
             '-lxcb-sync ' \
             '-lxcb-randr ' \
+            '-lpthread ' \
             '-lm '
 
 modes = {
@@ -29,6 +30,37 @@ def closet_maker ():
     ex ('gcc {FLAGS} -o bin/closet_maker x11_platform.c {DEP_FLAGS}')
     return
 
+def closet_bench ():
+    os.makedirs ("bin", exist_ok=True)
+    ex ('gcc {FLAGS} -o bin/closet_bench closet_bench.c -lm')
+    return
+
+def blur_bench ():
+    os.makedirs ("bin", exist_ok=True)
+    ex ('gcc {FLAGS} -o bin/blur_bench blur_bench.c -lpthread -lm')
+    return
+
+def lock_bench ():
+    os.makedirs ("bin", exist_ok=True)
+    ex ('gcc {FLAGS} -o bin/lock_bench lock_bench.c -lpthread -lm')
+    ex ('gcc {FLAGS} -DLOCK_STATS -o bin/lock_bench_stats lock_bench.c -lpthread -lm')
+    return
+
+def gui_test ():
+    os.makedirs ("bin", exist_ok=True)
+    ex ('gcc {FLAGS} -o bin/gui_test gui_test.c -lcairo -lpthread -lm')
+    return
+
+def mem_pool_test ():
+    os.makedirs ("bin", exist_ok=True)
+    ex ('gcc {FLAGS} -o bin/mem_pool_test mem_pool_test.c -lpthread -lm')
+    return
+
+def mem_pool_bench ():
+    os.makedirs ("bin", exist_ok=True)
+    ex ('gcc {FLAGS} -o bin/mem_pool_bench mem_pool_bench.c -lm')
+    return
+
 cfg.builtin_completions = ['--get_run_deps', '--get_build_deps']
 if __name__ == "__main__":
     # Everything above this line will be executed for each TAB press.
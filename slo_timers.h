@@ -53,6 +53,24 @@ float time_elapsed_in_ms (struct timespec *time_start, struct timespec *time_end
            (float)(time_end->tv_nsec-time_start->tv_nsec)/1000000);
 }
 
+static inline
+void timespec_add_ns (struct timespec *t, int64_t ns)
+{
+    int64_t nsec = t->tv_nsec + ns;
+    t->tv_sec += nsec/1000000000;
+    t->tv_nsec = nsec%1000000000;
+    if (t->tv_nsec < 0) {
+        t->tv_nsec += 1000000000;
+        t->tv_sec--;
+    }
+}
+
+static inline
+bool timespec_less_than (struct timespec *a, struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
 // Process clock
 // Usage:
 //   BEGIN_CPU_BLOCK;
@@ -87,5 +105,395 @@ struct timespec wall_ticks_end;
     wall_ticks_start = wall_ticks_end;\
     }
 
+//////////////////////
+// SCOPED PROFILER
+//
+// Hierarchical profiler that records begin/end timestamps of named zones into
+// a ring buffer holding the last PROF_NUM_FRAMES frames. Nothing is printed
+// while measuring, results are read later by an overlay or dumped to a file.
+//
+// Usage:
+//   prof_begin_frame ();
+//   PROF_BEGIN ("update");
+//     PROF_BEGIN ("upload");
+//     <some code to measure>
+//     PROF_END;
+//   PROF_END;
+//   prof_end_frame ();
+//
+// NOTE: Zone names must be string literals, only the pointer is stored.
+// NOTE: This is not thread safe, zones must be recorded from a single thread.
+
+#define PROF_NUM_FRAMES 64
+#define PROF_MAX_ZONES 256
+#define PROF_MAX_DEPTH 16
+
+struct prof_zone_t {
+    const char *name;
+    int64_t start_ns; // Relative to the frame's start.
+    int64_t end_ns;
+    uint8_t depth;
+    bool gpu;         // Times are filled by the GPU profiler when available.
+    bool resolved;
+};
+
+struct prof_frame_t {
+    uint64_t id;
+    struct timespec start;
+    int64_t length_ns;
+    uint32_t num_zones;
+    struct prof_zone_t zones[PROF_MAX_ZONES];
+};
+
+struct profiler_t {
+    bool enabled;
+    bool in_frame;
+    uint64_t num_frames; // Total frames recorded, the current one is num_frames-1.
+    uint32_t dropped_zones;
+
+    uint32_t depth;
+    uint32_t stack[PROF_MAX_DEPTH];
+
+    struct prof_frame_t frames[PROF_NUM_FRAMES];
+};
+
+struct profiler_t global_profiler = {.enabled = true};
+
+static inline
+int64_t timespec_diff_ns (struct timespec *start, struct timespec *end)
+{
+    return (int64_t)(end->tv_sec - start->tv_sec)*1000000000 + (end->tv_nsec - start->tv_nsec);
+}
+
+static inline
+struct prof_frame_t* prof_curr_frame (struct profiler_t *prof)
+{
+    return &prof->frames[(prof->num_frames - 1)%PROF_NUM_FRAMES];
+}
+
+// Returns the n'th most recently finished frame, 0 being the last one. Returns
+// NULL if there is no such frame.
+static inline
+struct prof_frame_t* prof_get_frame (struct profiler_t *prof, uint32_t n)
+{
+    uint64_t num_finished = prof->in_frame ? prof->num_frames - 1 : prof->num_frames;
+    if (n >= num_finished || n >= PROF_NUM_FRAMES - 1) {
+        return NULL;
+    }
+    return &prof->frames[(num_finished - 1 - n)%PROF_NUM_FRAMES];
+}
+
+void prof_begin_frame_full (struct profiler_t *prof)
+{
+    if (!prof->enabled) {
+        return;
+    }
+
+    prof->num_frames++;
+    prof->in_frame = true;
+    prof->depth = 0;
+
+    struct prof_frame_t *frame = prof_curr_frame (prof);
+    frame->id = prof->num_frames - 1;
+    frame->num_zones = 0;
+    frame->length_ns = 0;
+    clock_gettime (CLOCK_MONOTONIC, &frame->start);
+}
+
+void prof_end_frame_full (struct profiler_t *prof)
+{
+    if (!prof->enabled || !prof->in_frame) {
+        return;
+    }
+
+    struct prof_frame_t *frame = prof_curr_frame (prof);
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    frame->length_ns = timespec_diff_ns (&frame->start, &now);
+    prof->in_frame = false;
+}
+
+// Returns the index of the new zone in the current frame, or -1 if it was
+// dropped.
+int prof_zone_begin (struct profiler_t *prof, const char *name, bool gpu)
+{
+    if (!prof->enabled || !prof->in_frame) {
+        return -1;
+    }
+
+    struct prof_frame_t *frame = prof_curr_frame (prof);
+    if (frame->num_zones == PROF_MAX_ZONES || prof->depth == PROF_MAX_DEPTH) {
+        prof->dropped_zones++;
+        // NOTE: Still push something so the matching PROF_END is balanced.
+        if (prof->depth < PROF_MAX_DEPTH) {
+            prof->stack[prof->depth++] = UINT32_MAX;
+        }
+        return -1;
+    }
+
+    uint32_t id = frame->num_zones++;
+    struct prof_zone_t *zone = &frame->zones[id];
+    zone->name = name;
+    zone->depth = prof->depth;
+    zone->gpu = gpu;
+    zone->resolved = !gpu;
+    zone->end_ns = 0;
+    prof->stack[prof->depth++] = id;
+
+    if (!gpu) {
+        struct timespec now;
+        clock_gettime (CLOCK_MONOTONIC, &now);
+        zone->start_ns = timespec_diff_ns (&frame->start, &now);
+    }
+    return id;
+}
+
+void prof_zone_end (struct profiler_t *prof)
+{
+    if (!prof->enabled || !prof->in_frame || prof->depth == 0) {
+        return;
+    }
+
+    uint32_t id = prof->stack[--prof->depth];
+    if (id == UINT32_MAX) {
+        return;
+    }
+
+    struct prof_frame_t *frame = prof_curr_frame (prof);
+    struct prof_zone_t *zone = &frame->zones[id];
+    if (!zone->gpu) {
+        struct timespec now;
+        clock_gettime (CLOCK_MONOTONIC, &now);
+        zone->end_ns = timespec_diff_ns (&frame->start, &now);
+    }
+}
+
+#define prof_begin_frame() prof_begin_frame_full(&global_profiler)
+#define prof_end_frame() prof_end_frame_full(&global_profiler)
+#define PROF_BEGIN(name) prof_zone_begin(&global_profiler,name,false)
+#define PROF_END prof_zone_end(&global_profiler)
+
+// Writes all frames in the ring buffer to _path_ as tab separated values, one
+// zone per line. Times are in microseconds relative to the start of the frame.
+bool prof_dump (struct profiler_t *prof, const char *path)
+{
+    FILE *f = fopen (path, "w");
+    if (f == NULL) {
+        printf ("Error opening %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    fprintf (f, "frame\tframe_us\tzone\tdepth\tgpu\tstart_us\tend_us\n");
+    uint32_t n;
+    struct prof_frame_t *frame;
+    for (n=PROF_NUM_FRAMES; n>0; n--) {
+        if ((frame = prof_get_frame (prof, n-1)) == NULL) {
+            continue;
+        }
+
+        uint32_t i;
+        for (i=0; i<frame->num_zones; i++) {
+            struct prof_zone_t *zone = &frame->zones[i];
+            if (!zone->resolved) {
+                continue;
+            }
+            fprintf (f, "%" PRIu64 "\t%.3f\t%s\t%d\t%d\t%.3f\t%.3f\n",
+                     frame->id, (double)frame->length_ns/1000, zone->name,
+                     zone->depth, zone->gpu, (double)zone->start_ns/1000, (double)zone->end_ns/1000);
+        }
+    }
+    fclose (f);
+    return true;
+}
+
+//////////////////////
+// TRACE RECORDER
+//
+// Records timestamped events into per thread ring buffers, and writes them as
+// Chrome trace JSON that can be opened with chrome://tracing or Perfetto. Each
+// thread gets its own buffer the first time it records something, so
+// recording never takes a lock.
+//
+// Usage:
+//   TRACE_BEGIN ("swap");
+//   <some code>
+//   TRACE_END;
+//   TRACE_INSTANT ("KeyPress");
+//   ...
+//   trace_dump ("trace.json");
+//
+// Buffers keep the last TRACE_BUFFER_EVENTS events of each thread, older ones
+// are overwritten.
+//
+// NOTE: Event names must be string literals that don't need to be escaped in
+// JSON, only the pointer is stored.
+// NOTE: trace_dump() can run while other threads record events, but events
+// being overwritten at that moment may be written out with wrong data.
+
+#define TRACE_BUFFER_EVENTS (1<<16)
+#define TRACE_MAX_DEPTH 32
+
+enum trace_event_type_t {
+    TRACE_EVENT_COMPLETE, // A zone with a duration
+    TRACE_EVENT_INSTANT
+};
+
+struct trace_event_t {
+    const char *name;
+    int64_t start_ns;
+    int64_t duration_ns;
+    enum trace_event_type_t type;
+};
+
+struct trace_buffer_t {
+    struct trace_buffer_t *next;
+    uint32_t tid;
+    const char *thread_name;
+
+    uint32_t depth;
+    struct trace_event_t stack[TRACE_MAX_DEPTH];
+
+    uint64_t num_events; // Total events recorded, written with release semantics.
+    struct trace_event_t events[TRACE_BUFFER_EVENTS];
+};
+
+bool trace_enabled = true;
+struct trace_buffer_t *trace_buffers = NULL;
+uint32_t trace_next_tid = 1;
+__thread struct trace_buffer_t *trace_thread_buffer = NULL;
+
+static inline
+int64_t trace_now_ns ()
+{
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+struct trace_buffer_t* trace_get_thread_buffer ()
+{
+    if (trace_thread_buffer == NULL) {
+        struct trace_buffer_t *buff = calloc (1, sizeof (struct trace_buffer_t));
+        if (buff == NULL) {
+            return NULL;
+        }
+        buff->tid = __atomic_fetch_add (&trace_next_tid, 1, __ATOMIC_RELAXED);
+
+        // Push the buffer into the global list.
+        buff->next = __atomic_load_n (&trace_buffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n (&trace_buffers, &buff->next, buff, true,
+                                             __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        trace_thread_buffer = buff;
+    }
+    return trace_thread_buffer;
+}
+
+// NOTE: _name_ must be a string literal.
+void trace_set_thread_name (const char *name)
+{
+    struct trace_buffer_t *buff = trace_get_thread_buffer ();
+    if (buff != NULL) {
+        buff->thread_name = name;
+    }
+}
+
+static inline
+void trace_push_event (struct trace_buffer_t *buff, const char *name,
+                       enum trace_event_type_t type, int64_t start_ns, int64_t duration_ns)
+{
+    struct trace_event_t *event = &buff->events[buff->num_events%TRACE_BUFFER_EVENTS];
+    event->name = name;
+    event->type = type;
+    event->start_ns = start_ns;
+    event->duration_ns = duration_ns;
+    __atomic_store_n (&buff->num_events, buff->num_events + 1, __ATOMIC_RELEASE);
+}
+
+void trace_begin (const char *name)
+{
+    struct trace_buffer_t *buff;
+    if (!trace_enabled || (buff = trace_get_thread_buffer ()) == NULL) {
+        return;
+    }
+
+    // NOTE: Zones deeper than TRACE_MAX_DEPTH are not recorded, but depth is
+    // still counted so trace_end() stays balanced.
+    if (buff->depth < TRACE_MAX_DEPTH) {
+        buff->stack[buff->depth].name = name;
+        buff->stack[buff->depth].start_ns = trace_now_ns ();
+    }
+    buff->depth++;
+}
+
+void trace_end ()
+{
+    struct trace_buffer_t *buff = trace_thread_buffer;
+    if (!trace_enabled || buff == NULL || buff->depth == 0) {
+        return;
+    }
+
+    buff->depth--;
+    if (buff->depth < TRACE_MAX_DEPTH) {
+        struct trace_event_t *zone = &buff->stack[buff->depth];
+        trace_push_event (buff, zone->name, TRACE_EVENT_COMPLETE,
+                          zone->start_ns, trace_now_ns () - zone->start_ns);
+    }
+}
+
+void trace_instant (const char *name)
+{
+    struct trace_buffer_t *buff;
+    if (!trace_enabled || (buff = trace_get_thread_buffer ()) == NULL) {
+        return;
+    }
+    trace_push_event (buff, name, TRACE_EVENT_INSTANT, trace_now_ns (), 0);
+}
+
+#define TRACE_BEGIN(name) trace_begin(name)
+#define TRACE_END trace_end()
+#define TRACE_INSTANT(name) trace_instant(name)
+
+bool trace_dump (const char *path)
+{
+    FILE *f = fopen (path, "w");
+    if (f == NULL) {
+        printf ("Error opening %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    fprintf (f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    struct trace_buffer_t *buff = __atomic_load_n (&trace_buffers, __ATOMIC_ACQUIRE);
+    for (; buff != NULL; buff = buff->next) {
+        if (buff->thread_name != NULL) {
+            fprintf (f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%" PRIu32
+                     ",\"args\":{\"name\":\"%s\"}}",
+                     first ? "" : ",\n", buff->tid, buff->thread_name);
+            first = false;
+        }
+
+        uint64_t num_events = __atomic_load_n (&buff->num_events, __ATOMIC_ACQUIRE);
+        uint64_t i = num_events > TRACE_BUFFER_EVENTS ? num_events - TRACE_BUFFER_EVENTS : 0;
+        for (; i<num_events; i++) {
+            struct trace_event_t *event = &buff->events[i%TRACE_BUFFER_EVENTS];
+            if (event->type == TRACE_EVENT_COMPLETE) {
+                fprintf (f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%" PRIu32
+                         ",\"ts\":%.3f,\"dur\":%.3f}",
+                         first ? "" : ",\n", event->name, buff->tid,
+                         (double)event->start_ns/1000, (double)event->duration_ns/1000);
+            } else {
+                fprintf (f, "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%" PRIu32
+                         ",\"ts\":%.3f}",
+                         first ? "" : ",\n", event->name, buff->tid,
+                         (double)event->start_ns/1000);
+            }
+            first = false;
+        }
+    }
+    fprintf (f, "\n]}\n");
+    fclose (f);
+    return true;
+}
+
 #define SLO_TIMERS_H
 #endif
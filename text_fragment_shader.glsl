@@ -0,0 +1,16 @@
+#version 150 core
+
+in vec2 tex_coord;
+in vec4 color;
+
+out vec4 out_color;
+
+// Glyph atlas, only has coverage in the red channel.
+uniform sampler2D atlas;
+
+void main ()
+{
+    float coverage = texture (atlas, tex_coord).r;
+    // Output is premultiplied.
+    out_color = vec4 (color.rgb*color.a, color.a)*coverage;
+}
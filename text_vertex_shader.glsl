@@ -0,0 +1,20 @@
+#version 150 core
+
+in vec2 position;
+in vec2 tex_coord_in;
+in vec4 color_in;
+
+out vec2 tex_coord;
+out vec4 color;
+
+// Size of the viewport in pixels, positions are in pixels from its top left
+// corner.
+uniform vec2 viewport_size;
+
+void main ()
+{
+    tex_coord = tex_coord_in;
+    color = color_in;
+    vec2 ndc = 2*position/viewport_size - 1;
+    gl_Position = vec4 (ndc.x, -ndc.y, 0.0, 1.0);
+}
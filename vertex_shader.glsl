@@ -1,15 +1,26 @@
-#version 150 core
-in vec3 position;
-in vec3 in_normal;
+#version 330 core
+// NOTE: Attribute locations are explicit so every program using this shader
+// can share the same VAOs.
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec3 in_normal;
+
+// Per instance attributes, position is in a unit cube so it's scaled by
+// instance_size and translated to instance_min.
+layout(location = 2) in vec3 instance_min;
+layout(location = 3) in vec3 instance_size;
+layout(location = 4) in vec4 instance_color;
 
 flat out vec3 normal;
+flat out vec4 color;
 
 uniform mat4 model;
 uniform mat4 view;
 uniform mat4 proj;
+uniform float alpha;
 
 void main()
 {
     normal = in_normal;
-    gl_Position = proj * view * model * vec4(position, 1.0);
+    color = vec4(instance_color.rgb, alpha);
+    gl_Position = proj * view * model * vec4(instance_min + position*instance_size, 1.0);
 }
@@ -0,0 +1,17 @@
+#version 400 core
+// Resolves the weighted blended OIT targets into a premultiplied color that
+// can be blended over the opaque geometry.
+out vec4 out_color;
+
+uniform sampler2DMS accum_texture;
+uniform sampler2DMS revealage_texture;
+
+void main()
+{
+    ivec2 coord = ivec2 (gl_FragCoord.xy);
+    vec4 accum = texelFetch (accum_texture, coord, gl_SampleID);
+    float revealage = texelFetch (revealage_texture, coord, gl_SampleID).r;
+
+    vec3 average_color = accum.rgb / clamp (accum.a, 1e-4, 5e4);
+    out_color = vec4 (average_color * (1.0 - revealage), 1.0 - revealage);
+}
@@ -0,0 +1,31 @@
+#version 400 core
+// Weighted blended order independent transparency, from "Weighted Blended
+// Order-Independent Transparency" by McGuire and Bavoil (2013).
+//
+// Blending must be set to (ONE, ONE) for accum and (ZERO, ONE_MINUS_SRC_COLOR)
+// for revealage. Fragments behind opaque geometry are rejected by the depth
+// test against the opaque depth buffer.
+flat in vec3 normal;
+flat in vec4 color;
+
+layout(location = 0) out vec4 accum;
+layout(location = 1) out float revealage;
+
+void main()
+{
+    float value = 0.9;
+    if (normal.x != 0) {
+        value *= 0.8;
+    } else if (normal.z != 0) {
+        value *= 0.6;
+    }
+
+    vec4 premul_color = vec4(color.rgb * value * color.a, color.a);
+
+    // Depth based weight, equation 10 of the paper.
+    float weight = clamp (pow (min (1.0, premul_color.a * 10.0) + 0.01, 3.0) * 1e8 *
+                          pow (1.0 - gl_FragCoord.z * 0.9, 3.0), 1e-2, 3e3);
+
+    accum = premul_color * weight;
+    revealage = premul_color.a;
+}
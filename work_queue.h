@@ -0,0 +1,262 @@
+/*
+ * Copyright (C) 2018 Santiago León O. <santileortiz@gmail.com>
+ */
+
+#if !defined(WORK_QUEUE_H)
+#include <pthread.h>
+
+// Fixed size pool of worker threads that run jobs pushed from any thread.
+// Depends on common.h and slo_timers.h.
+//
+// Jobs go through a bounded lock free multiple producer multiple consumer
+// queue, the one described by Dmitry Vyukov. Each cell has a sequence number
+// that tells if it's free or full for the current lap around the ring, so
+// claiming a cell only takes a CAS on the enqueue or dequeue position.
+//
+// Idle workers sleep on a futex over a counter that producers increment for
+// each pushed job, nothing spins while the queue is empty. Threads waiting for
+// a group of jobs sleep on a futex over the number of jobs left in the group.
+//
+// Each worker has a scratch mem_pool_t that is reset after every job. Jobs
+// must not keep pointers into it.
+
+#define WORK_QUEUE_SIZE 1024 // Must be a power of 2
+#define WORK_QUEUE_MAX_WORKERS 16
+#define WORKER_SCRATCH_BIN_SIZE (1024*1024)
+#define CACHE_LINE_SIZE 64
+
+typedef void (job_func_t)(mem_pool_t *scratch, void *data);
+
+struct job_group_t {
+    uint32_t pending; // Jobs not finished yet, also a futex word.
+};
+
+struct job_t {
+    job_func_t *func;
+    void *data;
+    struct job_group_t *group;
+};
+
+struct work_queue_cell_t {
+    uint64_t seq;
+    struct job_t job;
+};
+
+struct worker_t {
+    pthread_t thread;
+    struct work_queue_t *queue;
+    mem_pool_t scratch;
+    mem_pool_temp_marker_t scratch_flush;
+};
+
+// NOTE: Padding keeps positions written by producers, consumers and the wake
+// up counter in different cache lines.
+struct work_queue_t {
+    struct work_queue_cell_t cells[WORK_QUEUE_SIZE];
+
+    uint8_t pad0[CACHE_LINE_SIZE];
+    uint64_t enqueue_pos;
+    uint8_t pad1[CACHE_LINE_SIZE];
+    uint64_t dequeue_pos;
+    uint8_t pad2[CACHE_LINE_SIZE];
+
+    // Incremented for each pushed job, idle workers wait on it.
+    uint32_t job_counter;
+    uint32_t num_sleeping;
+    bool stop;
+    uint8_t pad3[CACHE_LINE_SIZE];
+
+    int num_workers;
+    struct worker_t workers[WORK_QUEUE_MAX_WORKERS];
+};
+
+bool work_queue_try_push (struct work_queue_t *wq, struct job_t *job)
+{
+    struct work_queue_cell_t *cell;
+    uint64_t pos = __atomic_load_n (&wq->enqueue_pos, __ATOMIC_RELAXED);
+    while (true) {
+        cell = &wq->cells[pos & (WORK_QUEUE_SIZE-1)];
+        uint64_t seq = __atomic_load_n (&cell->seq, __ATOMIC_ACQUIRE);
+        int64_t dif = (int64_t)seq - (int64_t)pos;
+        if (dif == 0) {
+            // NOTE: On failure pos gets the current enqueue position.
+            if (__atomic_compare_exchange_n (&wq->enqueue_pos, &pos, pos+1, true,
+                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            // The cell still has a job from the previous lap, queue is full.
+            return false;
+        } else {
+            pos = __atomic_load_n (&wq->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->job = *job;
+    __atomic_store_n (&cell->seq, pos+1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool work_queue_try_pop (struct work_queue_t *wq, struct job_t *job)
+{
+    struct work_queue_cell_t *cell;
+    uint64_t pos = __atomic_load_n (&wq->dequeue_pos, __ATOMIC_RELAXED);
+    while (true) {
+        cell = &wq->cells[pos & (WORK_QUEUE_SIZE-1)];
+        uint64_t seq = __atomic_load_n (&cell->seq, __ATOMIC_ACQUIRE);
+        int64_t dif = (int64_t)seq - (int64_t)(pos+1);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n (&wq->dequeue_pos, &pos, pos+1, true,
+                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            // The cell wasn't written for this lap yet, queue is empty.
+            return false;
+        } else {
+            pos = __atomic_load_n (&wq->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    *job = cell->job;
+    __atomic_store_n (&cell->seq, pos+WORK_QUEUE_SIZE, __ATOMIC_RELEASE);
+    return true;
+}
+
+void job_run (struct job_t *job, mem_pool_t *scratch)
+{
+    job->func (scratch, job->data);
+
+    struct job_group_t *group = job->group;
+    if (group != NULL && __atomic_sub_fetch (&group->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        futex_wake (&group->pending, INT_MAX);
+    }
+}
+
+void* worker_thread (void *arg)
+{
+    struct worker_t *worker = (struct worker_t*)arg;
+    struct work_queue_t *wq = worker->queue;
+    trace_set_thread_name ("worker");
+
+    worker->scratch.min_bin_size = WORKER_SCRATCH_BIN_SIZE;
+    worker->scratch_flush = mem_pool_begin_temporary_memory (&worker->scratch);
+
+    struct job_t job;
+    while (true) {
+        if (work_queue_try_pop (wq, &job)) {
+            job_run (&job, &worker->scratch);
+            mem_pool_end_temporary_memory (worker->scratch_flush);
+            continue;
+        }
+
+        uint32_t counter = __atomic_load_n (&wq->job_counter, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n (&wq->stop, __ATOMIC_SEQ_CST)) {
+            break;
+        }
+
+        // A job may have been pushed between the failed pop and reading the
+        // counter, its push would not wake us.
+        if (work_queue_try_pop (wq, &job)) {
+            job_run (&job, &worker->scratch);
+            mem_pool_end_temporary_memory (worker->scratch_flush);
+            continue;
+        }
+
+        __atomic_add_fetch (&wq->num_sleeping, 1, __ATOMIC_SEQ_CST);
+        futex_wait (&wq->job_counter, counter);
+        __atomic_sub_fetch (&wq->num_sleeping, 1, __ATOMIC_SEQ_CST);
+    }
+
+    mem_pool_destroy (&worker->scratch);
+    worker->scratch = ZERO_INIT (mem_pool_t);
+    return NULL;
+}
+
+// Leaves one core for the thread that pushes jobs.
+int work_queue_default_num_workers ()
+{
+    long num_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+    return CLAMP (num_cpus - 1, 1, WORK_QUEUE_MAX_WORKERS);
+}
+
+// NOTE: _wq_ must be zero initialized. Calling this on a queue that already
+// has workers does nothing, it doesn't leak their threads.
+void work_queue_init (struct work_queue_t *wq, int num_workers)
+{
+    assert (num_workers <= WORK_QUEUE_MAX_WORKERS);
+    if (wq->num_workers > 0) {
+        return;
+    }
+    memset (wq, 0, sizeof (struct work_queue_t));
+
+    uint64_t i;
+    for (i=0; i<WORK_QUEUE_SIZE; i++) {
+        wq->cells[i].seq = i;
+    }
+
+    int w;
+    for (w=0; w<num_workers; w++) {
+        struct worker_t *worker = &wq->workers[w];
+        worker->queue = wq;
+        if (pthread_create (&worker->thread, NULL, worker_thread, worker) != 0) {
+            printf ("Could not create worker thread %d, using %d.\n", w, w);
+            break;
+        }
+        wq->num_workers++;
+    }
+}
+
+// Runs _func_ with _data_ on a worker. If _group_ is not NULL it's counted in
+// it, see job_group_wait(). When there are no workers or the queue is full
+// the job runs right away in the calling thread.
+void work_queue_push (struct work_queue_t *wq, struct job_group_t *group,
+                      job_func_t *func, void *data)
+{
+    struct job_t job = {func, data, group};
+    if (group != NULL) {
+        __atomic_add_fetch (&group->pending, 1, __ATOMIC_RELAXED);
+    }
+
+    if (wq->num_workers == 0 || !work_queue_try_push (wq, &job)) {
+        mem_pool_t scratch = {0};
+        job_run (&job, &scratch);
+        mem_pool_destroy (&scratch);
+        return;
+    }
+
+    __atomic_add_fetch (&wq->job_counter, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&wq->num_sleeping, __ATOMIC_SEQ_CST) > 0) {
+        futex_wake (&wq->job_counter, 1);
+    }
+}
+
+// Blocks until all jobs pushed with _group_ have finished.
+void job_group_wait (struct job_group_t *group)
+{
+    uint32_t pending;
+    while ((pending = __atomic_load_n (&group->pending, __ATOMIC_ACQUIRE)) != 0) {
+        futex_wait (&group->pending, pending);
+    }
+}
+
+// Waits for jobs already in the queue and stops all workers.
+void work_queue_destroy (struct work_queue_t *wq)
+{
+    if (wq->num_workers == 0) {
+        return;
+    }
+
+    __atomic_store_n (&wq->stop, true, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch (&wq->job_counter, 1, __ATOMIC_SEQ_CST);
+    futex_wake (&wq->job_counter, INT_MAX);
+
+    int w;
+    for (w=0; w<wq->num_workers; w++) {
+        pthread_join (wq->workers[w].thread, NULL);
+    }
+    wq->num_workers = 0;
+}
+
+#define WORK_QUEUE_H
+#endif
@@ -26,8 +26,10 @@
 #include <errno.h>
 
 #include "common.h"
-#include "gui.h"
 #include "slo_timers.h"
+#include "work_queue.h"
+#include "blur.h"
+#include "gui.h"
 
 #define WINDOW_HEIGHT 700
 #define WINDOW_WIDTH 700
@@ -35,6 +37,7 @@
 // NOTE: This is a unity build
 #include "opengl_util.h"
 #include "app_api.h"
+#include "closet.h"
 #include "closet_maker.c"
 
 struct x_state {
@@ -702,11 +705,151 @@ void x11_get_screen_extents (struct x_state *x_st, float *x_dpi, float *y_dpi,
 }
 
 typedef GLXContext (*glXCreateContextAttribsARBProc)(Display*, GLXFBConfig, GLXContext, Bool, const int*);
+typedef void (*glXSwapIntervalEXTProc)(Display*, GLXDrawable, int);
+typedef int (*glXSwapIntervalMESAProc)(unsigned int);
+
+bool glx_has_extension (Display *dpy, int screen, const char *name)
+{
+    const char *extensions = glXQueryExtensionsString (dpy, screen);
+    size_t len = strlen (name);
+    const char *c = extensions;
+    while (c != NULL && (c = strstr (c, name)) != NULL) {
+        if ((c == extensions || c[-1] == ' ') && (c[len] == ' ' || c[len] == '\0')) {
+            return true;
+        }
+        c += len;
+    }
+    return false;
+}
+
+// Tries to make glXSwapBuffers() wait for vertical blank. Returns true if it
+// succeeded.
+bool glx_enable_swap_control (Display *dpy, GLXDrawable drawable)
+{
+    int screen = DefaultScreen (dpy);
+    if (glx_has_extension (dpy, screen, "GLX_EXT_swap_control")) {
+        glXSwapIntervalEXTProc glXSwapIntervalEXT = (glXSwapIntervalEXTProc)
+            glXGetProcAddressARB ((const GLubyte *) "glXSwapIntervalEXT");
+        if (glXSwapIntervalEXT) {
+            glXSwapIntervalEXT (dpy, drawable, 1);
+            return true;
+        }
+
+    } else if (glx_has_extension (dpy, screen, "GLX_MESA_swap_control")) {
+        glXSwapIntervalMESAProc glXSwapIntervalMESA = (glXSwapIntervalMESAProc)
+            glXGetProcAddressARB ((const GLubyte *) "glXSwapIntervalMESA");
+        if (glXSwapIntervalMESA && glXSwapIntervalMESA (1) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Frame pacing. Frames are scheduled against absolute deadlines with
+// clock_nanosleep(TIMER_ABSTIME), so errors in sleep duration don't accumulate
+// as drift. When swap control is available glXSwapBuffers() already blocks
+// until vertical blank and we only sleep on frames that didn't swap.
+struct frame_pacer_t {
+    int64_t frame_length_ns;
+    bool swap_control;
+
+    struct timespec frame_start;
+    struct timespec deadline;
+
+    uint32_t num_frames;
+    uint32_t missed_frames;
+};
+
+void frame_pacer_init (struct frame_pacer_t *pacer, float frame_rate, bool swap_control)
+{
+    pacer->frame_length_ns = 1000000000/frame_rate;
+    pacer->swap_control = swap_control;
+    clock_gettime (CLOCK_MONOTONIC, &pacer->frame_start);
+    pacer->deadline = pacer->frame_start;
+    timespec_add_ns (&pacer->deadline, pacer->frame_length_ns);
+}
+
+// Sets the frame length from the refresh interval reported by the compositor
+// in _NET_WM_FRAME_TIMINGS.
+void frame_pacer_set_refresh_interval (struct frame_pacer_t *pacer, uint32_t refresh_interval_us)
+{
+    // NOTE: 0 means the compositor doesn't know the refresh interval. Ignore
+    // values outside 10 Hz to 1000 Hz, they are surely wrong.
+    if (refresh_interval_us >= 1000 && refresh_interval_us <= 100000) {
+        pacer->frame_length_ns = (int64_t)refresh_interval_us*1000;
+    }
+}
+
+// Starts a new frame and returns the time since the start of the previous one
+// in milliseconds.
+float frame_pacer_begin_frame (struct frame_pacer_t *pacer)
+{
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    float dt = time_elapsed_in_ms (&pacer->frame_start, &now);
+    pacer->frame_start = now;
+    pacer->num_frames++;
+
+    // NOTE: update_input() expects time to always move forward.
+    return MAX (dt, 0.001f);
+}
+
+// Makes the next frame's deadline be one frame length from now. Used after
+// blocking for events, when there is no previous schedule to keep.
+void frame_pacer_reset (struct frame_pacer_t *pacer)
+{
+    clock_gettime (CLOCK_MONOTONIC, &pacer->deadline);
+    timespec_add_ns (&pacer->deadline, pacer->frame_length_ns);
+}
+
+void frame_pacer_end_frame (struct frame_pacer_t *pacer, bool swapped)
+{
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+
+    if (pacer->swap_control && swapped) {
+        // NOTE: glXSwapBuffers() already paced this frame.
+        pacer->deadline = now;
+        timespec_add_ns (&pacer->deadline, pacer->frame_length_ns);
+
+    } else if (timespec_less_than (&pacer->deadline, &now)) {
+        // Don't try to catch up on missed frames, schedule the next one a
+        // full frame from now.
+        pacer->missed_frames++;
+        pacer->deadline = now;
+        timespec_add_ns (&pacer->deadline, pacer->frame_length_ns);
+
+    } else {
+        TRACE_BEGIN ("sleep");
+        while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &pacer->deadline, NULL) == EINTR);
+        TRACE_END;
+        timespec_add_ns (&pacer->deadline, pacer->frame_length_ns);
+    }
+}
+
+// Names used for X11 events in the trace.
+const char* x11_event_name (uint8_t response_type)
+{
+    switch (response_type & ~0x80) {
+        case 0: return "X11 error";
+        case XCB_KEY_PRESS: return "KeyPress";
+        case XCB_KEY_RELEASE: return "KeyRelease";
+        case XCB_BUTTON_PRESS: return "ButtonPress";
+        case XCB_BUTTON_RELEASE: return "ButtonRelease";
+        case XCB_MOTION_NOTIFY: return "MotionNotify";
+        case XCB_EXPOSE: return "Expose";
+        case XCB_CONFIGURE_NOTIFY: return "ConfigureNotify";
+        case XCB_PROPERTY_NOTIFY: return "PropertyNotify";
+        case XCB_CLIENT_MESSAGE: return "ClientMessage";
+        default: return "X11 event";
+    }
+}
 
 int main (void)
 {
     // Setup clocks
     setup_clocks ();
+    trace_set_thread_name ("main");
 
     //////////////////
     // X11 setup
@@ -848,12 +991,10 @@ int main (void)
                             &graphics.screen_width, &graphics.screen_height);
     bool force_blit = false;
 
-    float frame_rate = 60;
-    float target_frame_length_ms = 1000/(frame_rate);
-    struct timespec start_ticks;
-    struct timespec end_ticks;
+    bool swap_control = glx_enable_swap_control (x_st->xlib_dpy, glX_window);
+    struct frame_pacer_t frame_pacer = {0};
+    frame_pacer_init (&frame_pacer, 60, swap_control);
 
-    clock_gettime(CLOCK_MONOTONIC, &start_ticks);
     app_input_t app_input = {0};
     app_input.wheel = 1;
 
@@ -863,7 +1004,14 @@ int main (void)
     st->memory = bootstrap;
 
     while (!st->end_execution) {
-        while ((event = xcb_poll_for_event (x_st->xcb_c))) {
+        // NOTE: When the app is idle we block until the first event arrives,
+        // then process all other queued events without blocking.
+        bool blocked = st->idle;
+        bool block = st->idle;
+        TRACE_BEGIN (block ? "wait for events" : "poll events");
+        while ((event = block ? xcb_wait_for_event (x_st->xcb_c) : xcb_poll_for_event (x_st->xcb_c))) {
+            block = false;
+            TRACE_INSTANT (x11_event_name (event->response_type));
             // NOTE: The most significant bit of event->response_type is set if
             // the event was generated from a SendEvent request, here we don't
             // care about the source of the event.
@@ -940,6 +1088,8 @@ int main (void)
                         } else if (client_message->type == xcb_atoms_cache[LOC_ATOM__NET_WM_FRAME_DRAWN]) {
                             handled = true;
                         } else if (client_message->type == xcb_atoms_cache[LOC_ATOM__NET_WM_FRAME_TIMINGS]) {
+                            // NOTE: data32[3] is the refresh interval in microseconds.
+                            frame_pacer_set_refresh_interval (&frame_pacer, client_message->data.data32[3]);
                             handled = true;
                         }
 
@@ -965,35 +1115,47 @@ int main (void)
             }
             free (event);
         }
+        TRACE_END;
+
+        if (blocked) {
+            // Time spent waiting for events is not a missed frame.
+            frame_pacer_reset (&frame_pacer);
+        }
 
+        TRACE_BEGIN ("start of frame");
         x11_notify_start_of_frame (x_st);
+        TRACE_END;
+
+        // NOTE: After blocking for events this includes the time we waited.
+        // That's correct, for example the double click timeout must count it.
+        app_input.time_elapsed_ms = frame_pacer_begin_frame (&frame_pacer);
 
-        // TODO: How bad is this? should we actually measure it?
-        app_input.time_elapsed_ms = target_frame_length_ms;
+        prof_begin_frame ();
+        gpu_prof_begin_frame ();
 
+        PROF_BEGIN ("update_and_render");
+        TRACE_BEGIN ("update_and_render");
         bool blit_needed = update_and_render (st, &graphics, app_input);
+        TRACE_END;
+        PROF_END;
 
+        bool swapped = false;
         if (blit_needed || force_blit) {
+            PROF_BEGIN ("swap");
+            TRACE_BEGIN ("glXSwapBuffers");
             glXSwapBuffers(x_st->xlib_dpy, glX_window);
+            TRACE_END;
+            PROF_END;
             force_blit = false;
+            swapped = true;
         }
 
-        x11_notify_end_of_frame (x_st);
+        gpu_prof_end_frame ();
+        prof_end_frame ();
 
-        clock_gettime (CLOCK_MONOTONIC, &end_ticks);
-        float time_elapsed = time_elapsed_in_ms (&start_ticks, &end_ticks);
-        if (time_elapsed < target_frame_length_ms) {
-            struct timespec sleep_ticks;
-            sleep_ticks.tv_sec = 0;
-            sleep_ticks.tv_nsec = (long)((target_frame_length_ms-time_elapsed)*1000000);
-            nanosleep (&sleep_ticks, NULL);
-        } else {
-            printf ("Frame missed! %f ms elapsed\n", time_elapsed);
-        }
+        x11_notify_end_of_frame (x_st);
 
-        clock_gettime(CLOCK_MONOTONIC, &end_ticks);
-        //printf ("FPS: %f\n", 1000/time_elapsed_in_ms (&start_ticks, &end_ticks));
-        start_ticks = end_ticks;
+        frame_pacer_end_frame (&frame_pacer, swapped);
 
         xcb_flush (x_st->xcb_c);
         app_input.keycode = 0;
@@ -1002,6 +1164,25 @@ int main (void)
         mem_pool_end_temporary_memory (x_st->transient_pool_flush);
     }
 
+    printf ("Memory pool bins allocated: %" PRIu64 " (%.2f per frame), freed: %" PRIu64 ".\n",
+            mem_pool_bins_allocated,
+            frame_pacer.num_frames ? (double)mem_pool_bins_allocated/frame_pacer.num_frames : 0,
+            mem_pool_bins_freed);
+    text_cache_print_stats (&st->gui_st.text_cache);
+    shadow_cache_print_stats (&st->gui_st.shadow_cache);
+
+    if (frame_pacer.missed_frames > 0) {
+        printf ("Missed %" PRIu32 " of %" PRIu32 " frames.\n",
+                frame_pacer.missed_frames, frame_pacer.num_frames);
+    }
+
+    // NOTE: Set CLOSET_MAKER_TRACE to a file name to get the trace of the last
+    // frames when exiting. F12 writes it to trace.json at any time.
+    char *trace_path = getenv ("CLOSET_MAKER_TRACE");
+    if (trace_path != NULL && trace_dump (trace_path)) {
+        printf ("Wrote trace to %s\n", trace_path);
+    }
+
     glXDestroyWindow(x_st->xlib_dpy, glX_window);
     xcb_destroy_window(x_st->xcb_c, x_st->window);
     glXDestroyContext (x_st->xlib_dpy, gl_context);